@@ -359,6 +359,7 @@ void tb_set_jmp_target(TranslationBlock *tb, int n, uintptr_t addr)
 static inline void tb_add_jump(TranslationBlock *tb, int n,
                                TranslationBlock *tb_next)
 {
+    uintptr_t addr = (uintptr_t)tb_next->tc.ptr;
     uintptr_t old;
 
     assert(n < ARRAY_SIZE(tb->jmp_list_next));
@@ -368,6 +369,14 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
     if (tb_next->cflags & CF_INVALID) {
         goto out_unlock_next;
     }
+    /* see "Cross-TB liveness" in TranslationBlock */
+    if (tb->jmp_skip[n]) {
+        if (!tb_next->entry_offset || tb_next->pc <= tb->pc ||
+            (tb->jmp_skip[n] & ~tb_next->dead_in)) {
+            goto out_unlock_next;
+        }
+        addr += tb_next->entry_offset;
+    }
     /* Atomically claim the jump destination slot only if it was NULL */
     old = atomic_cmpxchg(&tb->jmp_dest[n], (uintptr_t)NULL, (uintptr_t)tb_next);
     if (old) {
@@ -375,7 +384,7 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
     }
 
     /* patch the native jump address */
-    tb_set_jmp_target(tb, n, (uintptr_t)tb_next->tc.ptr);
+    tb_set_jmp_target(tb, n, addr);
 
     /* add in TB jmp list */
     tb->jmp_list_next[n] = tb_next->jmp_list_head;
@@ -395,6 +404,24 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
     return;
 }
 
+/*
+ * Retranslate the TB that helper_tb_hot() reported, together with the
+ * blocks it most often continues to, as a trace that replaces it.
+ */
+static void cpu_exec_hot_tb(CPUState *cpu)
+{
+    TranslationBlock *tb = cpu->hot_tb;
+
+    cpu->hot_tb = NULL;
+    if (tb_cflags(tb) & CF_INVALID) {
+        return;
+    }
+    mmap_lock();
+    tb_gen_code(cpu, tb->pc, tb->cs_base, tb->flags,
+                (tb_cflags(tb) & CF_HASH_MASK) | CF_TRACE);
+    mmap_unlock();
+}
+
 static inline TranslationBlock *tb_find(CPUState *cpu,
                                         TranslationBlock *last_tb,
                                         int tb_exit, uint32_t cf_mask)
@@ -728,6 +755,9 @@ int cpu_exec(CPUState *cpu)
                 cpu->cflags_next_tb = -1;
             }
 
+            if (unlikely(cpu->hot_tb)) {
+                cpu_exec_hot_tb(cpu);
+            }
             tb = tb_find(cpu, last_tb, tb_exit, cflags);
             cpu_loop_exec_tb(cpu, tb, &last_tb, &tb_exit);
             /* Try to align the host and virtual clocks
@@ -0,0 +1,245 @@
+/*
+ * Instrumentation of translated code for TCG plugins
+ *
+ * While a TB is translated, we note where each guest instruction starts
+ * in the op stream (its insn_start op) and where it accesses memory.
+ * Once the front end is done, the plugins' TB translation callbacks
+ * decide what to instrument, and the callbacks and inline ops they
+ * registered are emitted at the end of the op stream and moved into
+ * place.  Code that no plugin instruments is left as is; the copies of
+ * guest addresses taken for memory callbacks die in liveness analysis.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "tcg/tcg.h"
+#include "tcg/tcg-op.h"
+#include "exec/exec-all.h"
+#include "exec/cpu_ldst.h"
+#include "exec/helper-proto.h"
+#include "exec/plugin-gen.h"
+#include "exec/translator.h"
+
+/* A guest memory access of the instruction being translated */
+typedef struct PluginMemOp {
+    TCGOp *op;      /* the qemu_ld/st op */
+    TCGv vaddr;     /* copy of its address */
+    uint32_t info;  /* qemu_plugin_meminfo_t */
+} PluginMemOp;
+
+void HELPER(plugin_vcpu_udata_cb)(CPUArchState *env, void *f, void *userp)
+{
+    qemu_plugin_vcpu_udata_cb_t cb = f;
+
+    cb(env_cpu(env)->cpu_index, userp);
+}
+
+void HELPER(plugin_vcpu_mem_cb)(CPUArchState *env, target_ulong vaddr,
+                                uint32_t info, void *f, void *userp)
+{
+    qemu_plugin_vcpu_mem_cb_t cb = f;
+
+    cb(env_cpu(env)->cpu_index, info, vaddr, userp);
+}
+
+bool plugin_gen_tb_start(CPUState *cpu, const TranslationBlock *tb)
+{
+    struct qemu_plugin_tb *ptb = tcg_ctx->plugin_tb;
+
+    if (!qemu_plugin_tb_trans_enabled()) {
+        return false;
+    }
+    if (!ptb) {
+        ptb = g_new0(struct qemu_plugin_tb, 1);
+        ptb->insns = g_ptr_array_new();
+        ptb->exec_cbs = g_array_new(false, false,
+                                    sizeof(struct qemu_plugin_dyn_cb));
+        tcg_ctx->plugin_tb = ptb;
+    }
+    ptb->n = 0;
+    ptb->vaddr = tb->pc;
+    g_array_set_size(ptb->exec_cbs, 0);
+    return true;
+}
+
+void plugin_gen_insn_start(CPUState *cpu, const DisasContextBase *db)
+{
+    struct qemu_plugin_tb *ptb = tcg_ctx->plugin_tb;
+    struct qemu_plugin_insn *insn;
+    TCGOp *op;
+
+    if (ptb->n == ptb->insns->len) {
+        insn = g_new0(struct qemu_plugin_insn, 1);
+        insn->data = g_byte_array_new();
+        insn->exec_cbs = g_array_new(false, false,
+                                     sizeof(struct qemu_plugin_dyn_cb));
+        insn->mem_cbs = g_array_new(false, false,
+                                    sizeof(struct qemu_plugin_dyn_cb));
+        insn->mem_ops = g_array_new(false, false, sizeof(PluginMemOp));
+        g_ptr_array_add(ptb->insns, insn);
+    }
+    insn = g_ptr_array_index(ptb->insns, ptb->n++);
+    g_byte_array_set_size(insn->data, 0);
+    g_array_set_size(insn->exec_cbs, 0);
+    g_array_set_size(insn->mem_cbs, 0);
+    g_array_set_size(insn->mem_ops, 0);
+    insn->vaddr = db->pc_next;
+
+    /* The insn_start hook may emit more than the insn_start op */
+    for (op = tcg_last_op(); op->opc != INDEX_op_insn_start;
+         op = QTAILQ_PREV(op, link)) {
+        continue;
+    }
+    insn->start_op = op;
+    tcg_ctx->plugin_insn = insn;
+}
+
+void plugin_gen_insn_end(CPUState *cpu, const DisasContextBase *db)
+{
+    struct qemu_plugin_insn *insn = tcg_ctx->plugin_insn;
+    CPUArchState *env = cpu->env_ptr;
+    target_ulong pc;
+
+    /* The front end has just read these, so this cannot fault */
+    for (pc = insn->vaddr; pc != db->pc_next; pc++) {
+        uint8_t byte = cpu_ldub_code(env, pc);
+
+        g_byte_array_append(insn->data, &byte, 1);
+    }
+    tcg_ctx->plugin_insn = NULL;
+}
+
+/* Called by tcg_gen_qemu_ld/st right after emitting the access */
+void plugin_gen_mem_record(TCGv vaddr, TCGMemOp memop, bool is_store)
+{
+    struct qemu_plugin_insn *insn = tcg_ctx->plugin_insn;
+    PluginMemOp m = {
+        .op = tcg_last_op(),
+        .vaddr = vaddr,
+        .info = memop & MO_SIZE,
+    };
+
+    if (memop & MO_SIGN) {
+        m.info |= PLUGIN_MEMINFO_SIGN_EXTEND;
+    }
+    if ((memop & MO_BSWAP) == MO_BE) {
+        m.info |= PLUGIN_MEMINFO_BIG_ENDIAN;
+    }
+    if (is_store) {
+        m.info |= PLUGIN_MEMINFO_STORE;
+    }
+    g_array_append_val(insn->mem_ops, m);
+}
+
+/* Move the ops emitted after @mark to right after @dest */
+static TCGOp *plugin_gen_move_after(TCGOp *mark, TCGOp *dest)
+{
+    TCGOp *op;
+
+    if (dest == mark) {
+        return tcg_last_op();
+    }
+    while ((op = QTAILQ_NEXT(mark, link)) != NULL) {
+        QTAILQ_REMOVE(&tcg_ctx->ops, op, link);
+        QTAILQ_INSERT_AFTER(&tcg_ctx->ops, dest, op, link);
+        dest = op;
+    }
+    return dest;
+}
+
+static void plugin_gen_exec_cb(const struct qemu_plugin_dyn_cb *cb)
+{
+    TCGv_ptr ptr = tcg_const_ptr(cb->userp);
+
+    if (cb->type == PLUGIN_CB_INLINE) {
+        TCGv_i64 val = tcg_temp_new_i64();
+
+        tcg_gen_ld_i64(val, ptr, 0);
+        tcg_gen_addi_i64(val, val, cb->imm);
+        tcg_gen_st_i64(val, ptr, 0);
+        tcg_temp_free_i64(val);
+    } else {
+        TCGv_ptr f = tcg_const_ptr(cb->f);
+
+        gen_helper_plugin_vcpu_udata_cb(cpu_env, f, ptr);
+        tcg_temp_free_ptr(f);
+    }
+    tcg_temp_free_ptr(ptr);
+}
+
+static TCGOp *plugin_gen_exec_cbs(GArray *cbs, TCGOp *dest)
+{
+    guint i;
+
+    for (i = 0; i < cbs->len; i++) {
+        TCGOp *mark = tcg_last_op();
+
+        plugin_gen_exec_cb(&g_array_index(cbs, struct qemu_plugin_dyn_cb, i));
+        dest = plugin_gen_move_after(mark, dest);
+    }
+    return dest;
+}
+
+static void plugin_gen_mem_cbs(struct qemu_plugin_insn *insn)
+{
+    guint i, j;
+
+    for (i = 0; i < insn->mem_ops->len; i++) {
+        PluginMemOp *m = &g_array_index(insn->mem_ops, PluginMemOp, i);
+        enum qemu_plugin_mem_rw rw = (m->info & PLUGIN_MEMINFO_STORE) ?
+                                     QEMU_PLUGIN_MEM_W : QEMU_PLUGIN_MEM_R;
+        TCGOp *dest = m->op;
+
+        for (j = 0; j < insn->mem_cbs->len; j++) {
+            struct qemu_plugin_dyn_cb *cb =
+                &g_array_index(insn->mem_cbs, struct qemu_plugin_dyn_cb, j);
+            TCGOp *mark = tcg_last_op();
+            TCGv_i32 info;
+            TCGv_ptr f, userp;
+
+            if (!(cb->rw & rw)) {
+                continue;
+            }
+            info = tcg_const_i32(m->info);
+            f = tcg_const_ptr(cb->f);
+            userp = tcg_const_ptr(cb->userp);
+            gen_helper_plugin_vcpu_mem_cb(cpu_env, m->vaddr, info, f, userp);
+            tcg_temp_free_ptr(userp);
+            tcg_temp_free_ptr(f);
+            tcg_temp_free_i32(info);
+            dest = plugin_gen_move_after(mark, dest);
+        }
+    }
+}
+
+void plugin_gen_tb_end(CPUState *cpu)
+{
+    struct qemu_plugin_tb *ptb = tcg_ctx->plugin_tb;
+    struct qemu_plugin_insn *insn;
+    size_t i;
+
+    tcg_ctx->plugin_insn = NULL;
+    if (ptb->n == 0) {
+        return;
+    }
+
+    qemu_plugin_tb_trans_cb(ptb);
+
+    /*
+     * What we emit below is moved back into the middle of the TB, where
+     * the front end may hold values in any temp it has freed since.
+     * Only allocate temps that the TB does not use yet.
+     */
+    memset(tcg_ctx->free_temps, 0, sizeof(tcg_ctx->free_temps));
+
+    insn = g_ptr_array_index(ptb->insns, 0);
+    plugin_gen_exec_cbs(ptb->exec_cbs, QTAILQ_PREV(insn->start_op, link));
+
+    for (i = 0; i < ptb->n; i++) {
+        insn = g_ptr_array_index(ptb->insns, i);
+        plugin_gen_exec_cbs(insn->exec_cbs, insn->start_op);
+        plugin_gen_mem_cbs(insn);
+    }
+}
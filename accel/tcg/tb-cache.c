@@ -0,0 +1,619 @@
+/*
+ * Persistent translation block cache
+ *
+ * Saves the TBs that are alive when QEMU exits to a file, and restores them
+ * on the next start, so that a later run of the same binary on the same host
+ * does not have to translate again the guest code it has already seen.
+ *
+ * Translated code is not position independent: it calls helpers and jumps to
+ * the epilogue with PC-relative branches, and hands TB pointers back to the
+ * execution loop.  The code is therefore restored at the address it had when
+ * it was saved, which requires both the QEMU binary and code_gen_buffer to be
+ * mapped where they were.  code_gen_buffer is requested at the saved address;
+ * for the binary this means a non-PIE build or disabled address space
+ * randomization.  The cache is ignored when any of this does not hold.
+ *
+ * A saved TB is only used after checking that it is looked up with the same
+ * pc, cs_base, flags and cflags, and that the guest code it was translated
+ * from did not change.  TBs that embed pointers to host data (see
+ * tcg_host_ptr()) are never saved.  The whole cache is dropped when the
+ * machine type or the guest CPU model and features differ from the run
+ * that saved it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "exec/ram_addr.h"
+#include "exec/tb-hash.h"
+#include "hw/boards.h"
+#include "qemu/error-report.h"
+#include "qemu/notify.h"
+#include "qemu/rcu.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/tcg.h"
+#include "tcg.h"
+#include "tb-cache.h"
+#include "trace.h"
+#ifdef CONFIG_CPUID_H
+#include "qemu/cpuid.h"
+#endif
+
+#define TB_CACHE_MAGIC      "QEMU-TBC"
+#define TB_CACHE_VERSION    3
+
+/* The binary and host that generated the code */
+typedef struct TBCacheHost {
+    char target[16];
+    uint64_t exe_dev;
+    uint64_t exe_ino;
+    uint64_t exe_size;
+    uint64_t exe_mtime;
+    uint64_t anchor;            /* address of tb_gen_code() */
+    uint32_t cpuid[4];          /* the backend depends on host features */
+} TBCacheHost;
+
+/* Where the code was generated */
+typedef struct TBCacheLayout {
+    uint64_t code_gen_prologue;
+    uint64_t code_gen_epilogue;
+    uint64_t code_gen_buffer;
+    uint64_t code_gen_buffer_size;
+    uint64_t code_capacity;
+} TBCacheLayout;
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_tbs;
+    TBCacheHost host;
+    TBCacheLayout layout;
+    uint8_t guest[32];          /* see tb_cache_guest_id() */
+} TBCacheHeader;
+
+/*
+ * Each entry is followed by @code_size bytes of host code and search data,
+ * then by @size bytes of guest code, padded to 8 bytes.  Entries are sorted
+ * by host address.
+ */
+typedef struct TBCacheEntry {
+    uint64_t tb;
+    uint64_t tc_ptr;
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t phys_pc;
+    uint64_t jmp_target_arg[2];
+    uint64_t dead_in;
+    uint64_t jmp_skip[2];
+    uint32_t flags;
+    uint32_t cflags;
+    uint32_t trace_vcpu_dstate;
+    uint32_t tc_size;
+    uint32_t code_size;
+    uint16_t size;
+    uint16_t icount;
+    uint16_t jmp_reset_offset[2];
+    uint16_t entry_offset;
+} TBCacheEntry;
+
+QEMU_BUILD_BUG_ON(sizeof(TBCacheHeader) % 8);
+QEMU_BUILD_BUG_ON(sizeof(TBCacheEntry) % 8);
+
+typedef struct TBCacheSaveState {
+    GByteArray *buf;
+    uint32_t nb_tbs;
+} TBCacheSaveState;
+
+static struct {
+    QemuMutex lock;
+    char *path;
+    /* Contents of the file, while it has entries that can be used */
+    gchar *data;
+    gsize len;
+    /* TBCacheEntry -> TranslationBlock, for the entries not tried yet */
+    GHashTable *tbs;
+    Notifier exit_notifier;
+} tb_cache;
+
+static guint tb_cache_hash(gconstpointer key)
+{
+    const TBCacheEntry *e = key;
+
+    return tb_hash_func(e->phys_pc, e->pc, e->flags, e->cflags & CF_HASH_MASK,
+                        e->trace_vcpu_dstate);
+}
+
+static gboolean tb_cache_equal(gconstpointer a, gconstpointer b)
+{
+    const TBCacheEntry *ea = a;
+    const TBCacheEntry *eb = b;
+
+    return ea->pc == eb->pc &&
+        ea->cs_base == eb->cs_base &&
+        ea->phys_pc == eb->phys_pc &&
+        ea->flags == eb->flags &&
+        (ea->cflags & CF_HASH_MASK) == (eb->cflags & CF_HASH_MASK) &&
+        ea->trace_vcpu_dstate == eb->trace_vcpu_dstate;
+}
+
+static bool tb_cache_host_id(TBCacheHost *host)
+{
+    struct stat st;
+
+    memset(host, 0, sizeof(*host));
+    if (stat("/proc/self/exe", &st) < 0) {
+        return false;
+    }
+
+    pstrcpy(host->target, sizeof(host->target), TARGET_NAME);
+    host->exe_dev = st.st_dev;
+    host->exe_ino = st.st_ino;
+    host->exe_size = st.st_size;
+    host->exe_mtime = st.st_mtime;
+    host->anchor = (uintptr_t)tb_gen_code;
+#ifdef CONFIG_CPUID_H
+    {
+        unsigned a, b, c, d;
+
+        __cpuid(1, a, b, c, d);
+        host->cpuid[0] = c;
+        host->cpuid[1] = d;
+        if (__get_cpuid_max(0, NULL) >= 7) {
+            __cpuid_count(7, 0, a, b, c, d);
+            host->cpuid[2] = b;
+            host->cpuid[3] = c;
+        }
+    }
+#endif
+    return true;
+}
+
+static void tb_cache_hash_str(GChecksum *sum, const char *str)
+{
+    g_checksum_update(sum, (const guchar *)str, strlen(str) + 1);
+}
+
+/* The string output visitor only handles scalars */
+static bool tb_cache_prop_hashable(ObjectProperty *prop)
+{
+    return prop->get && strcmp(prop->name, "realized") &&
+        (!strcmp(prop->type, "bool") || !strcmp(prop->type, "str") ||
+         !strcmp(prop->type, "string") ||
+         g_str_has_prefix(prop->type, "int") ||
+         g_str_has_prefix(prop->type, "uint"));
+}
+
+static gint tb_cache_name_cmp(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/*
+ * Front ends translate according to guest CPU features that are not part
+ * of tb->flags, such as the x86 CPUID words or the Arm ID registers.  They
+ * follow from the CPU model and its properties, and from the machine type
+ * for boards that configure their CPUs, so hash all of these.  The other
+ * CPUs are assumed to be configured like the first one.
+ */
+static void tb_cache_guest_id(uint8_t *id, gsize len)
+{
+    GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+    GPtrArray *names = g_ptr_array_new();
+    Object *obj = OBJECT(first_cpu);
+    ObjectPropertyIterator iter;
+    ObjectProperty *prop;
+    guint i;
+
+    tb_cache_hash_str(sum, MACHINE_GET_CLASS(current_machine)->name);
+    tb_cache_hash_str(sum, object_get_typename(obj));
+
+    object_property_iter_init(&iter, obj);
+    while ((prop = object_property_iter_next(&iter))) {
+        if (tb_cache_prop_hashable(prop)) {
+            g_ptr_array_add(names, prop->name);
+        }
+    }
+    g_ptr_array_sort(names, tb_cache_name_cmp);
+
+    for (i = 0; i < names->len; i++) {
+        const char *name = g_ptr_array_index(names, i);
+        char *value = object_property_print(obj, name, false, NULL);
+
+        if (value) {
+            tb_cache_hash_str(sum, name);
+            tb_cache_hash_str(sum, value);
+            g_free(value);
+        }
+    }
+    g_ptr_array_free(names, true);
+
+    memset(id, 0, len);
+    g_checksum_get_digest(sum, id, &len);
+    g_checksum_free(sum);
+}
+
+static void tb_cache_layout(TBCacheLayout *layout)
+{
+    memset(layout, 0, sizeof(*layout));
+    layout->code_gen_prologue = (uintptr_t)tcg_init_ctx.code_gen_prologue;
+    layout->code_gen_epilogue = (uintptr_t)tcg_init_ctx.code_gen_epilogue;
+    layout->code_gen_buffer = (uintptr_t)tcg_init_ctx.code_gen_buffer;
+    layout->code_gen_buffer_size = tcg_init_ctx.code_gen_buffer_size;
+    layout->code_capacity = tcg_code_capacity();
+}
+
+static void tb_cache_drop(void)
+{
+    qemu_mutex_lock(&tb_cache.lock);
+    if (tb_cache.tbs) {
+        g_hash_table_destroy(tb_cache.tbs);
+        atomic_set(&tb_cache.tbs, NULL);
+    }
+    g_free(tb_cache.data);
+    tb_cache.data = NULL;
+    tb_cache.len = 0;
+    qemu_mutex_unlock(&tb_cache.lock);
+}
+
+/* Length of the search data that encode_search() placed after the code */
+static size_t tb_cache_search_size(TranslationBlock *tb)
+{
+    const uint8_t *start = tb->tc.ptr + tb->tc.size;
+    const uint8_t *p = start;
+    int n = tb->icount * (TARGET_INSN_START_WORDS + 1);
+
+    /* Each value is a sleb128, whose last byte has the top bit clear */
+    while (n--) {
+        while (*p++ & 0x80) {
+            continue;
+        }
+    }
+    return p - start;
+}
+
+static gboolean tb_cache_save_tb(gpointer key, gpointer value, gpointer data)
+{
+    static const uint8_t zero[8];
+    TranslationBlock *tb = value;
+    TBCacheSaveState *s = data;
+    uint32_t cflags = tb_cflags(tb);
+    TBCacheEntry e;
+    size_t len;
+
+    /* Traces are built afresh from the TBs that become hot again */
+    if ((cflags & (CF_INVALID | CF_NOCACHE | CF_HOST_PTRS | CF_TRACE)) ||
+        tb->page_addr[0] == -1 || tb->size == 0) {
+        return false;
+    }
+
+    memset(&e, 0, sizeof(e));
+    e.tb = (uintptr_t)tb;
+    e.tc_ptr = (uintptr_t)tb->tc.ptr;
+    e.pc = tb->pc;
+    e.cs_base = tb->cs_base;
+    e.phys_pc = tb->page_addr[0] | (tb->pc & ~TARGET_PAGE_MASK);
+    e.jmp_target_arg[0] = tb->jmp_target_arg[0];
+    e.jmp_target_arg[1] = tb->jmp_target_arg[1];
+    e.flags = tb->flags;
+    e.cflags = cflags;
+    e.trace_vcpu_dstate = tb->trace_vcpu_dstate;
+    e.tc_size = tb->tc.size;
+    e.code_size = tb->tc.size + tb_cache_search_size(tb);
+    e.size = tb->size;
+    e.icount = tb->icount;
+    e.jmp_reset_offset[0] = tb->jmp_reset_offset[0];
+    e.jmp_reset_offset[1] = tb->jmp_reset_offset[1];
+    e.entry_offset = tb->entry_offset;
+    e.dead_in = tb->dead_in;
+    e.jmp_skip[0] = tb->jmp_skip[0];
+    e.jmp_skip[1] = tb->jmp_skip[1];
+
+    g_byte_array_append(s->buf, (uint8_t *)&e, sizeof(e));
+    g_byte_array_append(s->buf, tb->tc.ptr, e.code_size);
+
+    len = MIN(tb->size, TARGET_PAGE_SIZE - (tb->pc & ~TARGET_PAGE_MASK));
+    g_byte_array_append(s->buf, qemu_map_ram_ptr(NULL, e.phys_pc), len);
+    if (len < tb->size) {
+        g_byte_array_append(s->buf, qemu_map_ram_ptr(NULL, tb->page_addr[1]),
+                            tb->size - len);
+    }
+    len = ROUND_UP(e.code_size + e.size, 8) - (e.code_size + e.size);
+    g_byte_array_append(s->buf, zero, len);
+
+    s->nb_tbs++;
+    return false;
+}
+
+static void tb_cache_save(Notifier *notifier, void *data)
+{
+    TBCacheSaveState s;
+    TBCacheHeader hdr;
+    GError *err = NULL;
+
+    /* The vCPUs are only known to be stopped after a clean shutdown */
+    if (runstate_is_running()) {
+        return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TB_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TB_CACHE_VERSION;
+    if (!tb_cache_host_id(&hdr.host)) {
+        return;
+    }
+    tb_cache_layout(&hdr.layout);
+    tb_cache_guest_id(hdr.guest, sizeof(hdr.guest));
+
+    s.buf = g_byte_array_new();
+    s.nb_tbs = 0;
+    g_byte_array_append(s.buf, (uint8_t *)&hdr, sizeof(hdr));
+
+    rcu_read_lock();
+    tcg_tb_foreach(tb_cache_save_tb, &s);
+    rcu_read_unlock();
+    ((TBCacheHeader *)s.buf->data)->nb_tbs = s.nb_tbs;
+
+    if (!g_file_set_contents(tb_cache.path, (gchar *)s.buf->data, s.buf->len,
+                             &err)) {
+        warn_report("Could not save TB cache: %s", err->message);
+        g_error_free(err);
+    } else {
+        trace_tb_cache_save(tb_cache.path, s.nb_tbs);
+    }
+    g_byte_array_free(s.buf, true);
+}
+
+/*
+ * Read the cache file at @path, and arrange for the TBs to be saved to it
+ * at exit.  Must be called before code_gen_buffer is allocated.
+ */
+void tb_cache_open(const char *path)
+{
+    TBCacheHeader *hdr;
+    TBCacheHost host;
+    GError *err = NULL;
+
+    if (!tb_cache_host_id(&host)) {
+        warn_report("TB cache is not supported on this host");
+        return;
+    }
+
+    qemu_mutex_init(&tb_cache.lock);
+    tb_cache.path = g_strdup(path);
+
+    if (!g_file_get_contents(path, &tb_cache.data, &tb_cache.len, &err)) {
+        if (!g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            warn_report("Could not read TB cache: %s", err->message);
+        }
+        g_error_free(err);
+        tb_cache.data = NULL;
+        tb_cache.len = 0;
+    } else {
+        hdr = (TBCacheHeader *)tb_cache.data;
+        if (tb_cache.len < sizeof(*hdr) ||
+            memcmp(hdr->magic, TB_CACHE_MAGIC, sizeof(hdr->magic))) {
+            /* Do not overwrite whatever this is */
+            error_report("%s is not a TB cache file", path);
+            exit(1);
+        }
+        if (hdr->version != TB_CACHE_VERSION ||
+            memcmp(&hdr->host, &host, sizeof(host))) {
+            trace_tb_cache_discard(path, "saved by another binary or host");
+            tb_cache_drop();
+        }
+    }
+
+    tb_cache.exit_notifier.notify = tb_cache_save;
+    qemu_add_exit_notifier(&tb_cache.exit_notifier);
+}
+
+/* Preferred address of code_gen_buffer, or 0 */
+uintptr_t tb_cache_buffer_hint(void)
+{
+    TBCacheHeader *hdr = (TBCacheHeader *)tb_cache.data;
+
+    return hdr ? hdr->layout.code_gen_prologue : 0;
+}
+
+static bool tb_cache_entry_valid(const TBCacheEntry *e, uintptr_t start,
+                                 uintptr_t end)
+{
+    return e->tb >= start && QEMU_IS_ALIGNED(e->tb, sizeof(uintptr_t)) &&
+        e->tb + sizeof(TranslationBlock) <= e->tc_ptr &&
+        e->tc_ptr + e->code_size <= end &&
+        e->tc_size <= e->code_size &&
+        (e->jmp_reset_offset[0] == TB_JMP_RESET_OFFSET_INVALID ||
+         e->jmp_reset_offset[0] < e->tc_size) &&
+        (e->jmp_reset_offset[1] == TB_JMP_RESET_OFFSET_INVALID ||
+         e->jmp_reset_offset[1] < e->tc_size) &&
+        e->entry_offset < e->tc_size &&
+        e->size > 0 && e->size <= TARGET_PAGE_SIZE && e->icount > 0 &&
+        !(e->cflags & (CF_INVALID | CF_NOCACHE | CF_HOST_PTRS | CF_TRACE));
+}
+
+static void tb_cache_init_tb(TranslationBlock *tb, const TBCacheEntry *e)
+{
+    int n;
+
+    memset(tb, 0, sizeof(*tb));
+    tb->pc = e->pc;
+    tb->cs_base = e->cs_base;
+    tb->flags = e->flags;
+    tb->size = e->size;
+    tb->icount = e->icount;
+    tb->cflags = e->cflags;
+    tb->trace_vcpu_dstate = e->trace_vcpu_dstate;
+    tb->exec_count = tb_trace_threshold;
+    tb->tc.ptr = (void *)(uintptr_t)e->tc_ptr;
+    tb->tc.size = e->tc_size;
+    tb->page_addr[0] = -1;
+    tb->page_addr[1] = -1;
+    /* tb_add_jump() relies on these to chain past skipped stores */
+    tb->entry_offset = e->entry_offset;
+    tb->dead_in = e->dead_in;
+    tb->jmp_skip[0] = e->jmp_skip[0];
+    tb->jmp_skip[1] = e->jmp_skip[1];
+    qemu_spin_init(&tb->jmp_lock);
+
+    for (n = 0; n < 2; n++) {
+        tb->jmp_reset_offset[n] = e->jmp_reset_offset[n];
+        tb->jmp_target_arg[n] = e->jmp_target_arg[n];
+        /* Undo the chaining done in the run that saved the code */
+        if (tb->jmp_reset_offset[n] != TB_JMP_RESET_OFFSET_INVALID) {
+            tb_set_jmp_target(tb, n, (uintptr_t)(tb->tc.ptr +
+                                                 tb->jmp_reset_offset[n]));
+        }
+    }
+}
+
+/*
+ * Copy the saved code back into code_gen_buffer, and keep it out of the
+ * way of new translations until the next tb_flush().  Called once, after
+ * tcg_region_init() and before the vCPU threads start, while the first
+ * vCPU is realized.
+ */
+void tb_cache_load(void)
+{
+    TBCacheHeader *hdr = (TBCacheHeader *)tb_cache.data;
+    TBCacheLayout layout;
+    uint8_t guest[sizeof(hdr->guest)];
+    uintptr_t start, end, used;
+    size_t off;
+    uint32_t i;
+
+    if (!hdr) {
+        return;
+    }
+
+    tb_cache_layout(&layout);
+    if (memcmp(&hdr->layout, &layout, sizeof(layout))) {
+        trace_tb_cache_discard(tb_cache.path, "code_gen_buffer moved");
+        tb_cache_drop();
+        return;
+    }
+    tb_cache_guest_id(guest, sizeof(guest));
+    if (memcmp(hdr->guest, guest, sizeof(guest))) {
+        trace_tb_cache_discard(tb_cache.path, "different machine or CPU");
+        tb_cache_drop();
+        return;
+    }
+
+    start = layout.code_gen_buffer;
+    end = start + layout.code_gen_buffer_size;
+    used = start;
+    tb_cache.tbs = g_hash_table_new(tb_cache_hash, tb_cache_equal);
+
+    off = sizeof(*hdr);
+    for (i = 0; i < hdr->nb_tbs; i++) {
+        TBCacheEntry *e = (TBCacheEntry *)(tb_cache.data + off);
+        TranslationBlock *tb;
+        uint64_t len;
+
+        if (tb_cache.len - off < sizeof(*e)) {
+            goto corrupt;
+        }
+        len = ROUND_UP(sizeof(*e) + (uint64_t)e->code_size + e->size, 8);
+        if (tb_cache.len - off < len ||
+            !tb_cache_entry_valid(e, used, end)) {
+            goto corrupt;
+        }
+
+        tb = (TranslationBlock *)(uintptr_t)e->tb;
+        memcpy((void *)(uintptr_t)e->tc_ptr, e + 1, e->code_size);
+        tb_cache_init_tb(tb, e);
+        g_hash_table_insert(tb_cache.tbs, e, tb);
+
+        used = e->tc_ptr + e->code_size;
+        off += len;
+    }
+
+    flush_icache_range(start, used);
+    tcg_region_reserve((void *)used);
+    trace_tb_cache_load(tb_cache.path, hdr->nb_tbs);
+    return;
+
+corrupt:
+    warn_report("TB cache %s is corrupt, ignoring it", tb_cache.path);
+    tb_cache_drop();
+}
+
+/*
+ * Return the saved TB for the given lookup parameters, if the guest code it
+ * was translated from is unchanged.  On success, *@phys_page2 is set like
+ * tb_gen_code() does.  Each saved TB is tried only once.
+ */
+TranslationBlock *tb_cache_lookup(CPUState *cpu, target_ulong pc,
+                                  target_ulong cs_base, uint32_t flags,
+                                  uint32_t cflags, tb_page_addr_t phys_pc,
+                                  tb_page_addr_t *phys_page2)
+{
+    CPUArchState *env = cpu->env_ptr;
+    TBCacheEntry key = {
+        .pc = pc,
+        .cs_base = cs_base,
+        .phys_pc = phys_pc,
+        .flags = flags,
+        .cflags = cflags,
+        .trace_vcpu_dstate = *cpu->trace_dstate,
+    };
+    TranslationBlock *tb = NULL;
+    TBCacheEntry *e = NULL;
+    target_ulong virt_page2;
+    const uint8_t *guest;
+    size_t len;
+
+    if (likely(!atomic_read(&tb_cache.tbs))) {
+        return NULL;
+    }
+
+    qemu_mutex_lock(&tb_cache.lock);
+    if (tb_cache.tbs &&
+        g_hash_table_lookup_extended(tb_cache.tbs, &key, (gpointer *)&e,
+                                     (gpointer *)&tb)) {
+        g_hash_table_remove(tb_cache.tbs, e);
+    }
+    qemu_mutex_unlock(&tb_cache.lock);
+    if (!tb) {
+        return NULL;
+    }
+
+    *phys_page2 = -1;
+    virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
+    if ((pc & TARGET_PAGE_MASK) != virt_page2) {
+        *phys_page2 = get_page_addr_code(env, virt_page2);
+        if (*phys_page2 == -1) {
+            return NULL;
+        }
+    }
+
+    guest = (const uint8_t *)(e + 1) + e->code_size;
+    len = MIN(tb->size, TARGET_PAGE_SIZE - (pc & ~TARGET_PAGE_MASK));
+    rcu_read_lock();
+    if (memcmp(qemu_map_ram_ptr(NULL, phys_pc), guest, len) ||
+        (len < tb->size &&
+         memcmp(qemu_map_ram_ptr(NULL, *phys_page2), guest + len,
+                tb->size - len))) {
+        tb = NULL;
+    }
+    rcu_read_unlock();
+
+    if (tb) {
+        trace_tb_cache_hit(tb, pc);
+    }
+    return tb;
+}
+
+/*
+ * Forget the saved TBs that were not used.  Called by tb_flush() with all
+ * vCPUs stopped; from now on the memory they occupy is reused.
+ */
+void tb_cache_flush(void)
+{
+    if (tb_cache.tbs) {
+        trace_tb_cache_flush(g_hash_table_size(tb_cache.tbs));
+        tb_cache_drop();
+    }
+}
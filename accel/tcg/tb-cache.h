@@ -0,0 +1,42 @@
+/*
+ * Persistent translation block cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef TB_CACHE_H
+#define TB_CACHE_H
+
+#include "exec/exec-all.h"
+
+#ifdef CONFIG_SOFTMMU
+void tb_cache_open(const char *path);
+uintptr_t tb_cache_buffer_hint(void);
+TranslationBlock *tb_cache_lookup(CPUState *cpu, target_ulong pc,
+                                  target_ulong cs_base, uint32_t flags,
+                                  uint32_t cflags, tb_page_addr_t phys_pc,
+                                  tb_page_addr_t *phys_page2);
+void tb_cache_flush(void);
+#else
+static inline uintptr_t tb_cache_buffer_hint(void)
+{
+    return 0;
+}
+
+static inline TranslationBlock *tb_cache_lookup(CPUState *cpu,
+                                                target_ulong pc,
+                                                target_ulong cs_base,
+                                                uint32_t flags,
+                                                uint32_t cflags,
+                                                tb_page_addr_t phys_pc,
+                                                tb_page_addr_t *phys_page2)
+{
+    return NULL;
+}
+
+static inline void tb_cache_flush(void)
+{
+}
+#endif
+
+#endif /* TB_CACHE_H */
@@ -31,8 +31,10 @@
 #include "cpu.h"
 #include "sysemu/cpus.h"
 #include "qemu/main-loop.h"
+#include "tb-cache.h"
 
 unsigned long tcg_tb_size;
+const char *tcg_tb_cache;
 
 /* mask must never be zero, except for A20 change call */
 static void tcg_handle_interrupt(CPUState *cpu, int mask)
@@ -61,6 +63,9 @@ static void tcg_handle_interrupt(CPUState *cpu, int mask)
 
 static int tcg_init(MachineState *ms)
 {
+    if (tcg_tb_cache) {
+        tb_cache_open(tcg_tb_cache);
+    }
     tcg_exec_init(tcg_tb_size * 1024 * 1024);
     cpu_interrupt_handler = tcg_handle_interrupt;
     return 0;
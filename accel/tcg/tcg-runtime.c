@@ -163,6 +163,21 @@ void *HELPER(lookup_tb_ptr)(CPUArchState *env)
     return tb->tc.ptr;
 }
 
+/*
+ * The TB has been executed tb_trace_threshold times.  Have the main loop
+ * retranslate it as a trace at the next TB boundary; we cannot do it from
+ * inside the TB that is running.
+ */
+void HELPER(tb_hot)(CPUArchState *env, void *ptr)
+{
+    CPUState *cpu = env_cpu(env);
+
+    if (tb_trace_threshold && !cpu->hot_tb) {
+        cpu->hot_tb = ptr;
+        atomic_set(&cpu_neg(cpu)->icount_decr.u16.high, -1);
+    }
+}
+
 void HELPER(exit_atomic)(CPUArchState *env)
 {
     cpu_loop_exit_atomic(env_cpu(env), GETPC());
@@ -26,6 +26,7 @@
 #include "disas/disas.h"
 #include "exec/exec-all.h"
 #include "tcg.h"
+#include "tcg-op.h"
 #if defined(CONFIG_USER_ONLY)
 #include "qemu.h"
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -49,6 +50,7 @@
 #include "exec/cputlb.h"
 #include "exec/tb-hash.h"
 #include "translate-all.h"
+#include "tb-cache.h"
 #include "qemu/bitmap.h"
 #include "qemu/error-report.h"
 #include "qemu/qemu-print.h"
@@ -100,13 +102,27 @@
 
 #define SMC_BITMAP_USE_THRESHOLD 10
 
+#ifdef CONFIG_SOFTMMU
+/*
+ * Bytes of a page that may hold translated code.  The bitmap is a
+ * superset of the bytes covered by the TBs on the page's list: TBs
+ * set their bits when they are added, but removing a TB leaves its
+ * bits in place until the bitmap is rebuilt.  This lets writers check
+ * it without the page lock, see tb_page_code_overlaps().
+ */
+typedef struct PageCodeBitmap {
+    struct rcu_head rcu;
+    unsigned long bits[BITS_TO_LONGS(TARGET_PAGE_SIZE)];
+} PageCodeBitmap;
+#endif
+
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
     uintptr_t first_tb;
 #ifdef CONFIG_SOFTMMU
     /* in order to optimize self modifying code, we count the number
        of lookups we do to a given page to use a bitmap */
-    unsigned long *code_bitmap;
+    PageCodeBitmap *code_bitmap;
     unsigned int code_write_count;
 #else
     unsigned long flags;
@@ -214,6 +230,8 @@ TCGContext tcg_init_ctx;
 __thread TCGContext *tcg_ctx;
 TBContext tb_ctx;
 bool parallel_cpus;
+/* Executions after which a TB is retranslated as a trace; 0 disables it */
+uint32_t tb_trace_threshold;
 
 static void page_table_config_init(void)
 {
@@ -1064,6 +1082,11 @@ static inline void *alloc_code_gen_buffer(void)
 #  endif
 # endif
 
+    /* Saved translations can only be reused at the address they had */
+    if (tb_cache_buffer_hint()) {
+        start = tb_cache_buffer_hint();
+    }
+
     buf = mmap((void *)start, size, prot, flags, -1, 0);
     if (buf == MAP_FAILED) {
         return NULL;
@@ -1178,8 +1201,12 @@ static inline void invalidate_page_bitmap(PageDesc *p)
 {
     assert_page_locked(p);
 #ifdef CONFIG_SOFTMMU
-    g_free(p->code_bitmap);
-    p->code_bitmap = NULL;
+    PageCodeBitmap *bm = p->code_bitmap;
+
+    if (bm) {
+        atomic_rcu_set(&p->code_bitmap, NULL);
+        g_free_rcu(bm, rcu);
+    }
     p->code_write_count = 0;
 #endif
 }
@@ -1250,11 +1277,13 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
 
     CPU_FOREACH(cpu) {
         cpu_tb_jmp_cache_clear(cpu);
+        cpu->hot_tb = NULL;
     }
 
     qht_reset_size(&tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
+    tb_cache_flush();
     tcg_region_reset_all();
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
@@ -1452,11 +1481,9 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
     if (rm_from_page_list) {
         p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
         tb_page_remove(p, tb);
-        invalidate_page_bitmap(p);
         if (tb->page_addr[1] != -1) {
             p = page_find(tb->page_addr[1] >> TARGET_PAGE_BITS);
             tb_page_remove(p, tb);
-            invalidate_page_bitmap(p);
         }
     }
 
@@ -1500,31 +1527,42 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 }
 
 #ifdef CONFIG_SOFTMMU
+/* Mark the bytes of page @n of @tb in @bm */
+static void page_bitmap_add_tb(PageCodeBitmap *bm, TranslationBlock *tb,
+                               int n)
+{
+    int tb_start, tb_end;
+
+    /* NOTE: this is subtle as a TB may span two physical pages */
+    if (n == 0) {
+        /* NOTE: tb_end may be after the end of the page, but
+           it is not a problem */
+        tb_start = tb->pc & ~TARGET_PAGE_MASK;
+        tb_end = tb_start + tb->size;
+        if (tb_end > TARGET_PAGE_SIZE) {
+            tb_end = TARGET_PAGE_SIZE;
+        }
+    } else {
+        tb_start = 0;
+        tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
+    }
+    bitmap_set(bm->bits, tb_start, tb_end - tb_start);
+}
+
 /* call with @p->lock held */
 static void build_page_bitmap(PageDesc *p)
 {
-    int n, tb_start, tb_end;
+    PageCodeBitmap *bm;
     TranslationBlock *tb;
+    int n;
 
     assert_page_locked(p);
-    p->code_bitmap = bitmap_new(TARGET_PAGE_SIZE);
+    bm = g_new0(PageCodeBitmap, 1);
 
     PAGE_FOR_EACH_TB(p, tb, n) {
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE) {
-                tb_end = TARGET_PAGE_SIZE;
-             }
-        } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
-        bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
+        page_bitmap_add_tb(bm, tb, n);
     }
+    atomic_rcu_set(&p->code_bitmap, bm);
 }
 #endif
 
@@ -1548,7 +1586,15 @@ static inline void tb_page_add(PageDesc *p, TranslationBlock *tb,
     page_already_protected = p->first_tb != (uintptr_t)NULL;
 #endif
     p->first_tb = (uintptr_t)tb | n;
-    invalidate_page_bitmap(p);
+#ifdef CONFIG_SOFTMMU
+    /*
+     * Lock-free readers may see the bitmap without @tb's bits until we
+     * return, like a write racing with the translation of @tb would.
+     */
+    if (p->code_bitmap) {
+        page_bitmap_add_tb(p->code_bitmap, tb, n);
+    }
+#endif
 
 #if defined(CONFIG_USER_ONLY)
     if (p->flags & PAGE_WRITE) {
@@ -1644,10 +1690,8 @@ tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
         /* remove TB from the page(s) if we couldn't insert it */
         if (unlikely(existing_tb)) {
             tb_page_remove(p, tb);
-            invalidate_page_bitmap(p);
             if (p2) {
                 tb_page_remove(p2, tb);
-                invalidate_page_bitmap(p2);
             }
             tb = existing_tb;
         }
@@ -1666,13 +1710,273 @@ tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
     return tb;
 }
 
+/* Maximum number of guest blocks in a trace */
+#define TB_TRACE_MAX_BLOCKS 8
+
+/*
+ * A trace is built by translating its blocks one after another into the
+ * same op stream, each one spliced in place of the goto_tb exit of the
+ * previous block that leads to it.  Since control falls straight through
+ * from one block to the next, tcg_optimize() and the register allocator
+ * see one basic block where the guest branch used to be.
+ *
+ * Only the last block keeps its exits chainable: a TB has just two jump
+ * slots.  Side exits of the earlier blocks go through lookup_and_goto_ptr,
+ * i.e. back to the normal TBs.  All blocks must lie within one page after
+ * the first, so that [tb->pc, tb->pc + tb->size) covers them for
+ * invalidation purposes.
+ */
+typedef struct TBTraceBlock {
+    TCGOp *first;  /* first op of the block */
+    TCGOp *end;    /* op following the block, NULL for the end of the list */
+    TranslationBlock *tb;  /* TB previously generated for the block */
+} TBTraceBlock;
+
+/*
+ * Find the goto_tb op of jump slot @n of @tb in @blk, and the exit_tb op
+ * that it falls back to.  Reject exits with anything but straight-line
+ * code between the two.
+ */
+static TCGOp *tb_trace_find_exit(TranslationBlock *tb, TBTraceBlock *blk,
+                                 int n, TCGOp **exit_op)
+{
+    TCGOp *op, *goto_op = NULL;
+
+    for (op = blk->first; op != blk->end; op = QTAILQ_NEXT(op, link)) {
+        if (!goto_op) {
+            if (op->opc == INDEX_op_goto_tb && op->args[0] == n) {
+                goto_op = op;
+            }
+        } else if (op->opc == INDEX_op_exit_tb) {
+            if (op->args[0] != (uintptr_t)tb + n) {
+                return NULL;
+            }
+            *exit_op = op;
+            return goto_op;
+        } else if (op->opc == INDEX_op_set_label ||
+                   op->opc == INDEX_op_call ||
+                   (tcg_op_defs[op->opc].flags & TCG_OPF_BB_END)) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Code following the spliced exit ends up after the next block, and the
+ * host PC to guest insn mapping would attribute it to that block's last
+ * insn.  Accept it only if nothing in it can need that mapping.
+ */
+static bool tb_trace_tail_ok(TBTraceBlock *blk, TCGOp *exit_op)
+{
+    TCGOp *op;
+
+    for (op = QTAILQ_NEXT(exit_op, link); op != blk->end;
+         op = QTAILQ_NEXT(op, link)) {
+        if (op->opc == INDEX_op_insn_start ||
+            (tcg_op_defs[op->opc].flags & TCG_OPF_CALL_CLOBBER)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Turn jump slot @n of @blk into a lookup_and_goto_ptr side exit.
+ * Returns false if the slot is used in a way we do not recognize.
+ */
+static bool tb_trace_unchain_exit(TranslationBlock *tb, TBTraceBlock *blk,
+                                  int n)
+{
+    TCGOp *goto_op, *exit_op, *mark, *op;
+
+    goto_op = tb_trace_find_exit(tb, blk, n, &exit_op);
+    if (!goto_op) {
+        for (op = blk->first; op != blk->end; op = QTAILQ_NEXT(op, link)) {
+            if (op->opc == INDEX_op_goto_tb && op->args[0] == n) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    mark = tcg_last_op();
+    tcg_gen_lookup_and_goto_ptr();
+    while ((op = QTAILQ_NEXT(mark, link)) != NULL) {
+        QTAILQ_REMOVE(&tcg_ctx->ops, op, link);
+        QTAILQ_INSERT_BEFORE(exit_op, op, link);
+    }
+    tcg_op_remove(tcg_ctx, exit_op);
+    tcg_op_remove(tcg_ctx, goto_op);
+    return true;
+}
+
+/*
+ * Pick the successor of @blk worth inlining: a chained, still valid block
+ * that has itself run at least half the threshold.
+ */
+static TranslationBlock *tb_trace_next(TranslationBlock *tb,
+                                       TBTraceBlock *blk, int *slot)
+{
+    TranslationBlock *best = NULL;
+    int64_t best_count = tb_trace_threshold / 2;
+    int n;
+
+    for (n = 0; n < 2; n++) {
+        TranslationBlock *dest;
+        uintptr_t d;
+        int64_t count;
+
+        qemu_spin_lock(&blk->tb->jmp_lock);
+        d = blk->tb->jmp_dest[n];
+        qemu_spin_unlock(&blk->tb->jmp_lock);
+
+        dest = (TranslationBlock *)(d & ~(uintptr_t)1);
+        if (!dest || (d & 1) ||
+            (tb_cflags(dest) & (CF_INVALID | CF_TRACE)) ||
+            (tb_cflags(dest) & CF_HASH_MASK) != (tb->cflags & CF_HASH_MASK)) {
+            continue;
+        }
+        count = (int64_t)tb_trace_threshold - atomic_read(&dest->exec_count);
+        if (count >= best_count) {
+            best = dest;
+            best_count = count;
+            *slot = n;
+        }
+    }
+    return best;
+}
+
+/*
+ * The jump slots of the trace are those of its last block, @blk.  Where
+ * that block is chained forward, leave out of the chained path the
+ * stores of the globals that the destination overwrites before reading
+ * them; tb_add_jump() checks that the TB it links agrees.
+ */
+static void tb_trace_skip_stores(TranslationBlock *tb, TBTraceBlock *blk)
+{
+    int n;
+
+    for (n = 0; n < 2; n++) {
+        TranslationBlock *dest;
+        uintptr_t d;
+
+        qemu_spin_lock(&blk->tb->jmp_lock);
+        d = blk->tb->jmp_dest[n];
+        qemu_spin_unlock(&blk->tb->jmp_lock);
+
+        dest = (TranslationBlock *)(d & ~(uintptr_t)1);
+        if (dest && !(d & 1) && dest->entry_offset && dest->pc > tb->pc &&
+            !(tb_cflags(dest) & CF_INVALID)) {
+            tcg_ctx->tb_jmp_skip[n] = dest->dead_in;
+        }
+    }
+}
+
+/*
+ * @tb holds the ops just translated for @hot.  Append the blocks that
+ * @hot and its successors most often jump to, up to @max_insns guest
+ * instructions in total.
+ */
+static void tb_trace_extend(CPUState *cpu, TranslationBlock *tb,
+                            TranslationBlock *hot, int max_insns)
+{
+    target_ulong pc = tb->pc;
+    target_ulong cs_base = tb->cs_base;
+    uint32_t flags = tb->flags;
+    target_ulong end = pc + tb->size;
+    target_ulong pcs[TB_TRACE_MAX_BLOCKS];
+    int icount = tb->icount;
+    TBTraceBlock blk = {
+        .first = QTAILQ_FIRST(&tcg_ctx->ops),
+        .end = NULL,
+        .tb = hot,
+    };
+    int nb_blocks;
+
+    pcs[0] = pc;
+    for (nb_blocks = 1; nb_blocks < TB_TRACE_MAX_BLOCKS; nb_blocks++) {
+        TranslationBlock *next;
+        TCGOp *goto_op, *exit_op, *mark, *op;
+        target_ulong next_end;
+        int i, n;
+
+        next = tb_trace_next(tb, &blk, &n);
+        if (!next || next->pc < pc ||
+            next->pc + next->size - pc > TARGET_PAGE_SIZE ||
+            icount >= max_insns) {
+            break;
+        }
+        /* No unrolling: loops stay loops, through the chained jump */
+        for (i = 0; i < nb_blocks; i++) {
+            if (pcs[i] == next->pc) {
+                break;
+            }
+        }
+        if (i < nb_blocks) {
+            break;
+        }
+
+        goto_op = tb_trace_find_exit(tb, &blk, n, &exit_op);
+        if (!goto_op || !tb_trace_tail_ok(&blk, exit_op) ||
+            !tb_trace_unchain_exit(tb, &blk, 1 - n)) {
+            break;
+        }
+
+        /* Translate the next block at the end of the op list... */
+        mark = tcg_last_op();
+        tb->pc = next->pc;
+        tb->cs_base = next->cs_base;
+        tb->flags = next->flags;
+        tcg_ctx->tb_trace_block = true;
+#ifdef CONFIG_DEBUG_TCG
+        tcg_ctx->goto_tb_issue_mask = 0;
+#endif
+        gen_intermediate_code(cpu, tb, max_insns - icount);
+        tcg_ctx->tb_trace_block = false;
+        next_end = tb->pc + tb->size;
+        tb->pc = pc;
+        tb->cs_base = cs_base;
+        tb->flags = flags;
+
+        if (next_end - pc > TARGET_PAGE_SIZE) {
+            while ((op = QTAILQ_NEXT(mark, link)) != NULL) {
+                tcg_op_remove(tcg_ctx, op);
+            }
+            break;
+        }
+
+        /* ... and move it in place of the exit that leads to it.  */
+        blk.first = QTAILQ_NEXT(mark, link);
+        blk.end = QTAILQ_NEXT(exit_op, link);
+        blk.tb = next;
+        while ((op = QTAILQ_NEXT(mark, link)) != NULL) {
+            QTAILQ_REMOVE(&tcg_ctx->ops, op, link);
+            QTAILQ_INSERT_BEFORE(goto_op, op, link);
+        }
+        while ((op = QTAILQ_NEXT(goto_op, link)) != blk.end) {
+            tcg_op_remove(tcg_ctx, op);
+        }
+        tcg_op_remove(tcg_ctx, goto_op);
+
+        pcs[nb_blocks] = next->pc;
+        end = MAX(end, next_end);
+        icount += tb->icount;
+    }
+
+    tb->size = end - pc;
+    tb->icount = icount;
+    tb_trace_skip_stores(tb, &blk);
+    trace_translate_trace(tb, pc, nb_blocks, icount);
+}
+
 /* Called with mmap_lock held for user mode emulation.  */
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base,
                               uint32_t flags, int cflags)
 {
     CPUArchState *env = cpu->env_ptr;
-    TranslationBlock *tb, *existing_tb;
+    TranslationBlock *tb, *existing_tb, *hot = NULL;
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
     tcg_insn_unit *gen_code_buf;
@@ -1694,6 +1998,35 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     cflags &= ~CF_CLUSTER_MASK;
     cflags |= cpu->cluster_index << CF_CLUSTER_SHIFT;
 
+    /* A trace replaces the TB that became hot */
+    if (cflags & CF_TRACE) {
+        if (!(cflags & CF_NOCACHE) && !cpu->singlestep_enabled &&
+            !singlestep && QTAILQ_EMPTY(&cpu->breakpoints)) {
+            hot = tb_htable_lookup(cpu, pc, cs_base, flags,
+                                   cflags & CF_HASH_MASK);
+        }
+        if (!hot) {
+            cflags &= ~CF_TRACE;
+        }
+    }
+
+    /*
+     * Saved translations know nothing about debugging, which changes the
+     * code generated by the front ends.
+     */
+    if (!(cflags & (CF_NOCACHE | CF_TRACE)) && !cpu->singlestep_enabled &&
+        !singlestep && QTAILQ_EMPTY(&cpu->breakpoints)) {
+        tb = tb_cache_lookup(cpu, pc, cs_base, flags, cflags, phys_pc,
+                             &phys_page2);
+        if (tb) {
+            existing_tb = tb_link_page(tb, phys_pc, phys_page2);
+            if (likely(existing_tb == tb)) {
+                tcg_tb_insert(tb);
+            }
+            return existing_tb;
+        }
+    }
+
     max_insns = cflags & CF_COUNT_MASK;
     if (max_insns == 0) {
         max_insns = CF_COUNT_MASK;
@@ -1723,6 +2056,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->flags = flags;
     tb->cflags = cflags;
     tb->trace_vcpu_dstate = *cpu->trace_dstate;
+    tb->exec_count = tb_trace_threshold;
     tcg_ctx->tb_cflags = cflags;
  tb_overflow:
 
@@ -1736,6 +2070,9 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
 
     tcg_ctx->cpu = env_cpu(env);
     gen_intermediate_code(cpu, tb, max_insns);
+    if (hot) {
+        tb_trace_extend(cpu, tb, hot, max_insns);
+    }
     tcg_ctx->cpu = NULL;
 
     trace_translate_block(tb, tb->pc, tb->tc.ptr);
@@ -1797,6 +2134,13 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         goto buffer_overflow;
     }
     tb->tc.size = gen_code_size;
+    tb->entry_offset = tcg_ctx->tb_entry_offset;
+    tb->dead_in = tcg_ctx->tb_dead_in;
+    tb->jmp_skip[0] = tcg_ctx->tb_jmp_skip[0];
+    tb->jmp_skip[1] = tcg_ctx->tb_jmp_skip[1];
+    if (tcg_ctx->tb_host_ptrs) {
+        tb->cflags |= CF_HOST_PTRS;
+    }
 
 #ifdef CONFIG_PROFILER
     atomic_set(&prof->code_time, prof->code_time + profile_getclock() - ti);
@@ -1863,6 +2207,9 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if ((pc & TARGET_PAGE_MASK) != virt_page2) {
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
+    if (hot) {
+        tb_phys_invalidate(hot, -1);
+    }
     /*
      * No explicit memory barrier is required -- tb_link_page() makes the
      * TB visible in a consistent state.
@@ -2065,15 +2412,53 @@ void tb_invalidate_phys_page_fast(struct page_collection *pages,
         unsigned long b;
 
         nr = start & ~TARGET_PAGE_MASK;
-        b = p->code_bitmap[BIT_WORD(nr)] >> (nr & (BITS_PER_LONG - 1));
+        b = p->code_bitmap->bits[BIT_WORD(nr)] >> (nr & (BITS_PER_LONG - 1));
         if (b & ((1 << len) - 1)) {
-            goto do_invalidate;
+            tb_invalidate_phys_page_range__locked(pages, p, start,
+                                                  start + len, 1);
+            /*
+             * Drop the bits of the TBs just invalidated (or of TBs removed
+             * earlier), so that the rest of a write burst over this code
+             * passes tb_page_code_overlaps() without taking any lock.
+             */
+            if (p->first_tb) {
+                invalidate_page_bitmap(p);
+                build_page_bitmap(p);
+            }
         }
     } else {
-    do_invalidate:
         tb_invalidate_phys_page_range__locked(pages, p, start, start + len, 1);
     }
 }
+
+/*
+ * Return false if a write of @len bytes at @start cannot hit a TB, in
+ * which case tb_invalidate_phys_page_fast() would do nothing and the
+ * caller need not lock the page.  Same constraints on @start and @len.
+ *
+ * Called within RCU critical section, without any page lock.  Racing
+ * with the translation of a TB on the page is benign: the write may
+ * then be missed, just like when it lands before the TB is linked.
+ */
+bool tb_page_code_overlaps(tb_page_addr_t start, int len)
+{
+    PageCodeBitmap *bm;
+    PageDesc *p;
+    unsigned int nr;
+    unsigned long b;
+
+    p = page_find(start >> TARGET_PAGE_BITS);
+    if (!p) {
+        return false;
+    }
+    bm = atomic_rcu_read(&p->code_bitmap);
+    if (!bm) {
+        return true;
+    }
+    nr = start & ~TARGET_PAGE_MASK;
+    b = atomic_read(&bm->bits[BIT_WORD(nr)]) >> (nr & (BITS_PER_LONG - 1));
+    return b & ((1 << len) - 1);
+}
 #else
 /* Called with mmap_lock held. If pc is not 0 then it indicates the
  * host PC of the faulting store instruction that caused this invalidate.
@@ -1,5 +1,6 @@
 #include "qemu/osdep.h"
 #include "qom/cpu.h"
+#include "qemu/plugin.h"
 #include "sysemu/replay.h"
 #include "sysemu/sysemu.h"
 
@@ -11,6 +12,7 @@ void cpu_resume(CPUState *cpu)
 
 void qemu_init_vcpu(CPUState *cpu)
 {
+    qemu_plugin_vcpu_init_hook(cpu);
 }
 
 /* User mode emulation does not support record/replay yet.  */
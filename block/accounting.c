@@ -26,6 +26,7 @@
 #include "qemu/osdep.h"
 #include "block/accounting.h"
 #include "block/block_int.h"
+#include "qemu/host-utils.h"
 #include "qemu/timer.h"
 #include "sysemu/qtest.h"
 
@@ -56,6 +57,129 @@ void block_acct_cleanup(BlockAcctStats *stats)
     qemu_mutex_destroy(&stats->lock);
 }
 
+static unsigned block_acct_log_histogram_index(uint64_t value)
+{
+    unsigned msb, shift;
+
+    if (value < BLOCK_ACCT_HIST_SUB_BUCKETS) {
+        return value;
+    }
+
+    msb = 63 - clz64(value);
+    if (msb >= BLOCK_ACCT_HIST_MAX_BITS) {
+        return BLOCK_ACCT_HIST_NBUCKETS - 1;
+    }
+
+    shift = msb - BLOCK_ACCT_HIST_SUB_BITS;
+    return (shift + 1) * BLOCK_ACCT_HIST_SUB_BUCKETS +
+           (value >> shift) - BLOCK_ACCT_HIST_SUB_BUCKETS;
+}
+
+/* Lowest value accounted in bucket @index */
+static uint64_t block_acct_log_histogram_lower(unsigned index)
+{
+    unsigned shift;
+
+    if (index < BLOCK_ACCT_HIST_SUB_BUCKETS) {
+        return index;
+    }
+
+    shift = index / BLOCK_ACCT_HIST_SUB_BUCKETS - 1;
+    return (uint64_t)(BLOCK_ACCT_HIST_SUB_BUCKETS +
+                      index % BLOCK_ACCT_HIST_SUB_BUCKETS) << shift;
+}
+
+/* Highest value accounted in bucket @index, except for the last bucket,
+ * which is unbounded and reports its lowest value */
+static uint64_t block_acct_log_histogram_upper(unsigned index)
+{
+    if (index == BLOCK_ACCT_HIST_NBUCKETS - 1) {
+        return block_acct_log_histogram_lower(index);
+    }
+    return block_acct_log_histogram_lower(index + 1) - 1;
+}
+
+static void block_acct_log_histogram_account(BlockAcctLogHistogram *hist,
+                                             uint64_t value)
+{
+    hist->buckets[block_acct_log_histogram_index(value)]++;
+    hist->count++;
+}
+
+/* The smallest value that is greater than or equal to @permille / 1000 of
+ * the accounted values (up to the bucket resolution) */
+static uint64_t block_acct_log_histogram_percentile(BlockAcctLogHistogram *hist,
+                                                    unsigned permille)
+{
+    uint64_t rank = DIV_ROUND_UP(hist->count * permille, 1000);
+    uint64_t sum = 0;
+    unsigned i;
+
+    for (i = 0; i < BLOCK_ACCT_HIST_NBUCKETS; i++) {
+        sum += hist->buckets[i];
+        if (sum >= rank && sum > 0) {
+            break;
+        }
+    }
+
+    return block_acct_log_histogram_upper(MIN(i, BLOCK_ACCT_HIST_NBUCKETS - 1));
+}
+
+static bool block_acct_log_histogram_percentiles(BlockAcctLogHistogram *hist,
+                                                 BlockAcctPercentiles *p)
+{
+    if (!hist->count) {
+        return false;
+    }
+
+    p->p50 = block_acct_log_histogram_percentile(hist, 500);
+    p->p99 = block_acct_log_histogram_percentile(hist, 990);
+    p->p999 = block_acct_log_histogram_percentile(hist, 999);
+    return true;
+}
+
+/* The sliding window histograms follow the algorithm of
+ * util/timed-average.c: values are accounted in two windows offset by half a
+ * period, and read from the oldest one.
+ */
+static void block_acct_timed_histogram_init(BlockAcctTimedHistogram *th,
+                                            QEMUClockType clock_type,
+                                            uint64_t period)
+{
+    int64_t now = qemu_clock_get_ns(clock_type);
+
+    memset(th, 0, sizeof(*th));
+    th->period = period * 4 / 3;
+    th->clock_type = clock_type;
+    th->expiration[0] = now + th->period / 2;
+    th->expiration[1] = now + th->period;
+}
+
+static void block_acct_timed_histogram_expire(BlockAcctTimedHistogram *th)
+{
+    int64_t now = qemu_clock_get_ns(th->clock_type);
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (th->expiration[i] <= now) {
+            int64_t elapsed = (now - th->expiration[i]) % th->period;
+
+            memset(&th->windows[i], 0, sizeof(th->windows[i]));
+            th->expiration[i] = now + th->period - elapsed;
+        }
+    }
+
+    th->current = th->expiration[0] < th->expiration[1] ? 0 : 1;
+}
+
+static void block_acct_timed_histogram_account(BlockAcctTimedHistogram *th,
+                                               uint64_t value)
+{
+    block_acct_timed_histogram_expire(th);
+    block_acct_log_histogram_account(&th->windows[0], value);
+    block_acct_log_histogram_account(&th->windows[1], value);
+}
+
 void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
 {
     BlockAcctTimedStats *s;
@@ -70,6 +194,9 @@ void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
     for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
         timed_average_init(&s->latency[i], clock_type,
                            (uint64_t) interval_length * NANOSECONDS_PER_SECOND);
+        block_acct_timed_histogram_init(&s->latency_log_histogram[i],
+                           clock_type,
+                           (uint64_t) interval_length * NANOSECONDS_PER_SECOND);
     }
     qemu_mutex_unlock(&stats->lock);
 }
@@ -92,6 +219,35 @@ void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
     cookie->bytes = bytes;
     cookie->start_time_ns = qemu_clock_get_ns(clock_type);
     cookie->type = type;
+    cookie->in_flight = true;
+
+    qemu_mutex_lock(&stats->lock);
+    stats->in_flight[type]++;
+    block_acct_log_histogram_account(&stats->queue_depth_histogram[type],
+                                     stats->in_flight[type]);
+    qemu_mutex_unlock(&stats->lock);
+}
+
+/* Remove @cookie from the requests in flight, unless that was done already */
+static void block_acct_release(BlockAcctStats *stats, BlockAcctCookie *cookie)
+{
+    if (cookie->in_flight) {
+        assert(stats->in_flight[cookie->type] > 0);
+        stats->in_flight[cookie->type]--;
+        cookie->in_flight = false;
+    }
+}
+
+/* Drop a request without accounting it as done or failed, for example
+ * because it was cancelled or because it will be submitted again with a
+ * new block_acct_start() */
+void block_acct_cancel(BlockAcctStats *stats, BlockAcctCookie *cookie)
+{
+    assert(cookie->type < BLOCK_MAX_IOTYPE);
+
+    qemu_mutex_lock(&stats->lock);
+    block_acct_release(stats, cookie);
+    qemu_mutex_unlock(&stats->lock);
 }
 
 /* block_latency_histogram_compare_func:
@@ -197,6 +353,8 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
 
     qemu_mutex_lock(&stats->lock);
 
+    block_acct_release(stats, cookie);
+
     if (failed) {
         stats->failed_ops[cookie->type]++;
     } else {
@@ -211,8 +369,13 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
         stats->total_time_ns[cookie->type] += latency_ns;
         stats->last_access_time_ns = time_ns;
 
+        block_acct_log_histogram_account(
+            &stats->latency_log_histogram[cookie->type], latency_ns);
+
         QSLIST_FOREACH(s, &stats->intervals, entries) {
             timed_average_account(&s->latency[cookie->type], latency_ns);
+            block_acct_timed_histogram_account(
+                &s->latency_log_histogram[cookie->type], latency_ns);
         }
     }
 
@@ -274,3 +437,75 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
 
     return (double) sum / elapsed;
 }
+
+bool block_acct_latency_percentiles(BlockAcctStats *stats,
+                                    enum BlockAcctType type,
+                                    BlockAcctPercentiles *p)
+{
+    bool ret;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    qemu_mutex_lock(&stats->lock);
+    ret = block_acct_log_histogram_percentiles(
+        &stats->latency_log_histogram[type], p);
+    qemu_mutex_unlock(&stats->lock);
+
+    return ret;
+}
+
+bool block_acct_timed_latency_percentiles(BlockAcctTimedStats *stats,
+                                          enum BlockAcctType type,
+                                          BlockAcctPercentiles *p)
+{
+    BlockAcctTimedHistogram *th = &stats->latency_log_histogram[type];
+    bool ret;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    qemu_mutex_lock(&stats->stats->lock);
+    block_acct_timed_histogram_expire(th);
+    ret = block_acct_log_histogram_percentiles(&th->windows[th->current], p);
+    qemu_mutex_unlock(&stats->stats->lock);
+
+    return ret;
+}
+
+/* Return the queue depth histogram in the format of BlockLatencyHistogram,
+ * trimmed after the last non-empty bucket.  Returns the number of bins, or
+ * 0 (with *@boundaries and *@bins set to NULL) if no request was accounted.
+ */
+int block_acct_queue_depth_histogram(BlockAcctStats *stats,
+                                     enum BlockAcctType type,
+                                     uint64_t **boundaries, uint64_t **bins)
+{
+    BlockAcctLogHistogram *hist = &stats->queue_depth_histogram[type];
+    int nbins = 0;
+    int i;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    *boundaries = NULL;
+    *bins = NULL;
+
+    qemu_mutex_lock(&stats->lock);
+    for (i = 0; i < BLOCK_ACCT_HIST_NBUCKETS; i++) {
+        if (hist->buckets[i]) {
+            nbins = i + 1;
+        }
+    }
+
+    if (nbins) {
+        *boundaries = g_new(uint64_t, nbins - 1);
+        *bins = g_new(uint64_t, nbins);
+        for (i = 0; i < nbins; i++) {
+            if (i > 0) {
+                (*boundaries)[i - 1] = block_acct_log_histogram_lower(i);
+            }
+            (*bins)[i] = hist->buckets[i];
+        }
+    }
+    qemu_mutex_unlock(&stats->lock);
+
+    return nbins;
+}
@@ -22,11 +22,18 @@
 #include "qapi/qmp/qerror.h"
 #include "qemu/ratelimit.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "sysemu/block-backend.h"
 #include "qemu/bitmap.h"
 #include "qemu/error-report.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_MAX_WORKERS_DEFAULT 8
+#define BACKUP_MAX_WORKERS_LIMIT 64
+#define BACKUP_MAX_CHUNK_DEFAULT (4 * MiB)
+
+/* Background copy requests are resized to complete in about this time */
+#define BACKUP_CHUNK_LATENCY_NS (50 * SCALE_MS)
 
 typedef struct CowRequest {
     int64_t start_byte;
@@ -56,8 +63,25 @@ typedef struct BackupBlockJob {
     int64_t copy_range_size;
 
     bool serialize_target_writes;
+
+    /* Background copy requests that may run in parallel */
+    int max_workers;
+    int nb_workers;
+    /* Job coroutine waiting for a background copy request to complete */
+    CoQueue worker_queue;
+    /* First error of a background copy request that must be reported */
+    int worker_ret;
+    /* Current and maximum size of a background copy request, in bytes */
+    int64_t chunk_size;
+    int64_t max_chunk;
 } BackupBlockJob;
 
+typedef struct BackupWorker {
+    BackupBlockJob *job;
+    int64_t offset;
+    int64_t bytes;
+} BackupWorker;
+
 static const BlockJobDriver backup_job_driver;
 
 /* See if in-flight requests overlap and wait for them to complete */
@@ -97,26 +121,30 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
-/* Copy range to target with a bounce buffer and return the bytes copied. If
- * error occurred, return a negative error number */
+/* Copy range to target with a bounce buffer of @bounce_size bytes and return
+ * the bytes copied. If error occurred, return a negative error number */
 static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
                                                       int64_t start,
                                                       int64_t end,
                                                       bool is_write_notifier,
                                                       bool *error_is_read,
-                                                      void **bounce_buffer)
+                                                      void **bounce_buffer,
+                                                      int64_t bounce_size)
 {
     int ret;
     BlockBackend *blk = job->common.blk;
     int nbytes;
+    int nr_clusters;
+    int off, len;
     int read_flags = is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0;
     int write_flags = job->serialize_target_writes ? BDRV_REQ_SERIALISING : 0;
 
     assert(QEMU_IS_ALIGNED(start, job->cluster_size));
-    hbitmap_reset(job->copy_bitmap, start, job->cluster_size);
-    nbytes = MIN(job->cluster_size, job->len - start);
+    nbytes = MIN(MIN(end, job->len) - start, bounce_size);
+    nr_clusters = DIV_ROUND_UP(nbytes, job->cluster_size);
+    hbitmap_reset(job->copy_bitmap, start, job->cluster_size * nr_clusters);
     if (!*bounce_buffer) {
-        *bounce_buffer = blk_blockalign(blk, job->cluster_size);
+        *bounce_buffer = blk_blockalign(blk, bounce_size);
     }
 
     ret = blk_co_pread(blk, start, nbytes, *bounce_buffer, read_flags);
@@ -128,25 +156,40 @@ static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
         goto fail;
     }
 
-    if (buffer_is_zero(*bounce_buffer, nbytes)) {
-        ret = blk_co_pwrite_zeroes(job->target, start,
-                                   nbytes, write_flags | BDRV_REQ_MAY_UNMAP);
-    } else {
-        ret = blk_co_pwrite(job->target, start,
-                            nbytes, *bounce_buffer, write_flags |
-                            (job->compress ? BDRV_REQ_WRITE_COMPRESSED : 0));
-    }
-    if (ret < 0) {
-        trace_backup_do_cow_write_fail(job, start, ret);
-        if (error_is_read) {
-            *error_is_read = false;
+    /* Write runs of zero and of data clusters separately, so that the zero
+     * clusters of a chunk do not take up space in the target */
+    for (off = 0; off < nbytes; off += len) {
+        uint8_t *buf = (uint8_t *)*bounce_buffer + off;
+        int cluster_bytes = MIN(job->cluster_size, nbytes - off);
+        bool zero = buffer_is_zero(buf, cluster_bytes);
+
+        for (len = cluster_bytes; off + len < nbytes; len += cluster_bytes) {
+            cluster_bytes = MIN(job->cluster_size, nbytes - off - len);
+            if (buffer_is_zero(buf + len, cluster_bytes) != zero) {
+                break;
+            }
+        }
+
+        if (zero) {
+            ret = blk_co_pwrite_zeroes(job->target, start + off, len,
+                                       write_flags | BDRV_REQ_MAY_UNMAP);
+        } else {
+            ret = blk_co_pwrite(job->target, start + off, len, buf,
+                                write_flags | (job->compress ?
+                                               BDRV_REQ_WRITE_COMPRESSED : 0));
+        }
+        if (ret < 0) {
+            trace_backup_do_cow_write_fail(job, start + off, ret);
+            if (error_is_read) {
+                *error_is_read = false;
+            }
+            goto fail;
         }
-        goto fail;
     }
 
     return nbytes;
 fail:
-    hbitmap_set(job->copy_bitmap, start, job->cluster_size);
+    hbitmap_set(job->copy_bitmap, start, job->cluster_size * nr_clusters);
     return ret;
 
 }
@@ -167,7 +210,7 @@ static int coroutine_fn backup_cow_with_offload(BackupBlockJob *job,
 
     assert(QEMU_IS_ALIGNED(job->copy_range_size, job->cluster_size));
     assert(QEMU_IS_ALIGNED(start, job->cluster_size));
-    nbytes = MIN(job->copy_range_size, end - start);
+    nbytes = MIN(job->copy_range_size, MIN(end, job->len) - start);
     nr_clusters = DIV_ROUND_UP(nbytes, job->cluster_size);
     hbitmap_reset(job->copy_bitmap, start, job->cluster_size * nr_clusters);
     ret = blk_co_copy_range(blk, start, job->target, start, nbytes,
@@ -190,11 +233,13 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
     int ret = 0;
     int64_t start, end; /* bytes */
     void *bounce_buffer = NULL;
+    int64_t bounce_size;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
 
     start = QEMU_ALIGN_DOWN(offset, job->cluster_size);
     end = QEMU_ALIGN_UP(bytes + offset, job->cluster_size);
+    bounce_size = MIN(end - start, job->max_chunk);
 
     trace_backup_do_cow_enter(job, start, offset, bytes);
 
@@ -202,23 +247,34 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
     cow_request_begin(&cow_request, job, start, end);
 
     while (start < end) {
+        int64_t dirty_end;
+
         if (!hbitmap_get(job->copy_bitmap, start)) {
             trace_backup_do_cow_skip(job, start);
             start += job->cluster_size;
             continue; /* already copied */
         }
 
+        /* Copy the clusters that still need it in as few requests as possible */
+        dirty_end = hbitmap_next_zero(job->copy_bitmap, start, end - start);
+        if (dirty_end < 0) {
+            dirty_end = end;
+        }
+
         trace_backup_do_cow_process(job, start);
 
         if (job->use_copy_range) {
-            ret = backup_cow_with_offload(job, start, end, is_write_notifier);
+            ret = backup_cow_with_offload(job, start, dirty_end,
+                                          is_write_notifier);
             if (ret < 0) {
                 job->use_copy_range = false;
             }
         }
         if (!job->use_copy_range) {
-            ret = backup_cow_with_bounce_buffer(job, start, end, is_write_notifier,
-                                                error_is_read, &bounce_buffer);
+            ret = backup_cow_with_bounce_buffer(job, start, dirty_end,
+                                                is_write_notifier,
+                                                error_is_read, &bounce_buffer,
+                                                bounce_size);
         }
         if (ret < 0) {
             break;
@@ -335,6 +391,19 @@ static void backup_drain(BlockJob *job)
     }
 }
 
+static bool backup_drained_poll(BlockJob *job)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    /* Until the job is paused or cancelled, it may still start background
+     * copy requests.  After that, the ones already started must finish. */
+    if (!s->common.job.paused && !s->common.job.cancelled) {
+        return true;
+    }
+
+    return s->nb_workers > 0;
+}
+
 static BlockErrorAction backup_error_action(BackupBlockJob *job,
                                             bool read, int error)
 {
@@ -384,38 +453,155 @@ static bool bdrv_is_unallocated_range(BlockDriverState *bs,
     return offset >= end;
 }
 
-static int coroutine_fn backup_loop(BackupBlockJob *job)
+/*
+ * Size the background copy requests so that each one completes in about
+ * BACKUP_CHUNK_LATENCY_NS: larger requests hide the latency of remote
+ * targets, while smaller ones keep guest writes from waiting too long for
+ * the clusters they touch.
+ */
+static void backup_adapt_chunk_size(BackupBlockJob *job, int64_t bytes,
+                                    int64_t latency_ns)
 {
+    if (latency_ns > BACKUP_CHUNK_LATENCY_NS) {
+        job->chunk_size = MAX(job->cluster_size,
+                              QEMU_ALIGN_DOWN(job->chunk_size / 2,
+                                              job->cluster_size));
+    } else if (latency_ns < BACKUP_CHUNK_LATENCY_NS / 2 &&
+               bytes >= job->chunk_size) {
+        job->chunk_size = MIN(job->max_chunk, job->chunk_size * 2);
+    }
+}
+
+static void coroutine_fn backup_worker_co(void *opaque)
+{
+    BackupWorker *w = opaque;
+    BackupBlockJob *job = w->job;
+    bool error_is_read = false;
+    int64_t start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     int ret;
-    bool error_is_read;
+
+    ret = backup_do_cow(job, w->offset, w->bytes, &error_is_read, false);
+    if (ret < 0) {
+        /* The clusters are dirty again, backup_loop() retries them later */
+        if (backup_error_action(job, error_is_read, -ret) ==
+            BLOCK_ERROR_ACTION_REPORT && !job->worker_ret)
+        {
+            job->worker_ret = ret;
+        }
+    } else {
+        backup_adapt_chunk_size(job, w->bytes,
+                                qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                start_ns);
+    }
+
+    trace_backup_worker_done(job, w->offset, w->bytes, ret);
+
+    job->nb_workers--;
+    qemu_co_queue_restart_all(&job->worker_queue);
+    g_free(w);
+}
+
+static void coroutine_fn backup_wait_for_workers(BackupBlockJob *job,
+                                                 int max_workers)
+{
+    while (job->nb_workers > max_workers) {
+        qemu_co_queue_wait(&job->worker_queue, NULL);
+    }
+}
+
+/* Return how many bytes from @offset the next background request copies */
+static int64_t backup_chunk_bytes(BackupBlockJob *job, int64_t offset)
+{
+    BlockDriverState *bs = blk_bs(job->common.blk);
+    int64_t bytes = MIN(job->chunk_size, job->len - offset);
+    int64_t dirty_end;
+    int64_t pnum;
+
+    dirty_end = hbitmap_next_zero(job->copy_bitmap, offset, bytes);
+    if (dirty_end >= 0) {
+        bytes = dirty_end - offset;
+    }
+
+    /* Do not copy the unallocated clusters that follow */
+    if (job->sync_mode == MIRROR_SYNC_MODE_TOP &&
+        bdrv_is_allocated(bs, offset, bytes, &pnum) > 0)
+    {
+        bytes = MIN(bytes, QEMU_ALIGN_UP(pnum, job->cluster_size));
+    }
+
+    return bytes;
+}
+
+static int coroutine_fn backup_loop(BackupBlockJob *job)
+{
     int64_t offset;
+    int64_t bytes;
     HBitmapIter hbi;
     BlockDriverState *bs = blk_bs(job->common.blk);
 
-    hbitmap_iter_init(&hbi, job->copy_bitmap, 0);
-    while ((offset = hbitmap_iter_next(&hbi)) != -1) {
-        if (job->sync_mode == MIRROR_SYNC_MODE_TOP &&
-            bdrv_is_unallocated_range(bs, offset, job->cluster_size))
+    qemu_co_queue_init(&job->worker_queue);
+    job->chunk_size = job->cluster_size;
+
+    /* Requests that fail leave their clusters dirty, so go over the bitmap
+     * until nothing is left to copy */
+    while (!job->worker_ret && hbitmap_count(job->copy_bitmap)) {
+        hbitmap_iter_init(&hbi, job->copy_bitmap, 0);
+        while (!job->worker_ret &&
+               (offset = hbitmap_iter_next(&hbi)) != -1)
         {
-            hbitmap_reset(job->copy_bitmap, offset, job->cluster_size);
-            continue;
-        }
+            BackupWorker *w;
+            Coroutine *co;
+
+            if (job->sync_mode == MIRROR_SYNC_MODE_TOP &&
+                bdrv_is_unallocated_range(bs, offset, job->cluster_size))
+            {
+                hbitmap_reset(job->copy_bitmap, offset, job->cluster_size);
+                continue;
+            }
+
+            /* A pause must not leave background requests running */
+            if (job->common.job.pause_count > 0) {
+                backup_wait_for_workers(job, 0);
+            }
 
-        do {
             if (yield_and_check(job)) {
-                return 0;
+                goto out;
             }
-            ret = backup_do_cow(job, offset,
-                                job->cluster_size, &error_is_read, false);
-            if (ret < 0 && backup_error_action(job, error_is_read, -ret) ==
-                           BLOCK_ERROR_ACTION_REPORT)
-            {
-                return ret;
+
+            backup_wait_for_workers(job, job->max_workers - 1);
+            if (job->worker_ret) {
+                break;
+            }
+
+            /* The range may have been copied by a guest write meanwhile */
+            if (!hbitmap_get(job->copy_bitmap, offset)) {
+                continue;
+            }
+
+            bytes = backup_chunk_bytes(job, offset);
+            w = g_new(BackupWorker, 1);
+            *w = (BackupWorker) {
+                .job    = job,
+                .offset = offset,
+                .bytes  = bytes,
+            };
+            job->nb_workers++;
+            trace_backup_worker_start(job, offset, bytes);
+            co = qemu_coroutine_create(backup_worker_co, w);
+            qemu_coroutine_enter(co);
+
+            if (offset + bytes >= job->len) {
+                break;
             }
-        } while (ret < 0);
+            hbitmap_iter_init(&hbi, job->copy_bitmap, offset + bytes);
+        }
+
+        backup_wait_for_workers(job, 0);
     }
 
-    return 0;
+out:
+    backup_wait_for_workers(job, 0);
+    return job->worker_ret;
 }
 
 /* init copy_bitmap from sync_bitmap */
@@ -495,6 +681,7 @@ static const BlockJobDriver backup_job_driver = {
         .clean                  = backup_clean,
     },
     .drain                  = backup_drain,
+    .drained_poll           = backup_drained_poll,
 };
 
 static int64_t backup_calculate_cluster_size(BlockDriverState *target,
@@ -537,6 +724,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *target, int64_t speed,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
                   bool compress,
+                  int max_workers, int64_t max_chunk,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   int creation_flags,
@@ -569,6 +757,17 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         return NULL;
     }
 
+    if (max_workers < 0 || max_workers > BACKUP_MAX_WORKERS_LIMIT) {
+        error_setg(errp, "max-workers must be between 1 and %d, "
+                   "or 0 for the default", BACKUP_MAX_WORKERS_LIMIT);
+        return NULL;
+    }
+
+    if (max_chunk < 0) {
+        error_setg(errp, "max-chunk must not be negative");
+        return NULL;
+    }
+
     if (compress && target->drv->bdrv_co_pwritev_compressed == NULL) {
         error_setg(errp, "Compression is not supported for this drive %s",
                    bdrv_get_device_name(target));
@@ -655,6 +854,14 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                                QEMU_ALIGN_UP(job->copy_range_size,
                                              job->cluster_size));
 
+    job->max_workers = max_workers ?: BACKUP_MAX_WORKERS_DEFAULT;
+    job->max_chunk = QEMU_ALIGN_UP(max_chunk ?: BACKUP_MAX_CHUNK_DEFAULT,
+                                   job->cluster_size);
+    if (compress) {
+        /* Compressed writes must cover exactly one cluster */
+        job->max_chunk = job->cluster_size;
+    }
+
     /* Required permissions are already taken with target's blk_new() */
     block_job_add_bdrv(&job->common, "target", target, 0, BLK_PERM_ALL,
                        &error_abort);
@@ -40,7 +40,6 @@ struct qemu_laiocb {
 };
 
 typedef struct {
-    int plugged;
     unsigned int in_queue;
     unsigned int in_flight;
     bool blocked;
@@ -63,6 +62,7 @@ struct LinuxAioState {
 };
 
 static void ioq_submit(LinuxAioState *s);
+static void laio_deferred_submit(void *opaque);
 
 static inline ssize_t io_event_ret(struct io_event *ev)
 {
@@ -232,8 +232,8 @@ static void qemu_laio_process_completions_and_submit(LinuxAioState *s)
     aio_context_acquire(s->aio_context);
     qemu_laio_process_completions(s);
 
-    if (!s->io_q.plugged && !QSIMPLEQ_EMPTY(&s->io_q.pending)) {
-        ioq_submit(s);
+    if (!QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        aio_io_plug_call(s->aio_context, laio_deferred_submit, s);
     }
     aio_context_release(s->aio_context);
 }
@@ -271,7 +271,6 @@ static bool qemu_laio_poll_cb(void *opaque)
 static void ioq_init(LaioQueue *io_q)
 {
     QSIMPLEQ_INIT(&io_q->pending);
-    io_q->plugged = 0;
     io_q->in_queue = 0;
     io_q->in_flight = 0;
     io_q->blocked = false;
@@ -331,18 +330,28 @@ static void ioq_submit(LinuxAioState *s)
     }
 }
 
+/* Submit the requests queued during a plug scope of the AioContext */
+static void laio_deferred_submit(void *opaque)
+{
+    LinuxAioState *s = opaque;
+
+    aio_context_acquire(s->aio_context);
+    if (!QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        ioq_submit(s);
+    }
+    aio_context_release(s->aio_context);
+}
+
+/* The queue is shared by all users of the AioContext, so plugging it is
+ * the same as plugging the AioContext */
 void laio_io_plug(BlockDriverState *bs, LinuxAioState *s)
 {
-    s->io_q.plugged++;
+    aio_io_plug(s->aio_context);
 }
 
 void laio_io_unplug(BlockDriverState *bs, LinuxAioState *s)
 {
-    assert(s->io_q.plugged);
-    if (--s->io_q.plugged == 0 &&
-        !s->io_q.blocked && !QSIMPLEQ_EMPTY(&s->io_q.pending)) {
-        ioq_submit(s);
-    }
+    aio_io_unplug(s->aio_context);
 }
 
 static int laio_do_submit(int fd, struct qemu_laiocb *laiocb, off_t offset,
@@ -369,10 +378,12 @@ static int laio_do_submit(int fd, struct qemu_laiocb *laiocb, off_t offset,
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, laiocb, next);
     s->io_q.in_queue++;
-    if (!s->io_q.blocked &&
-        (!s->io_q.plugged ||
-         s->io_q.in_flight + s->io_q.in_queue >= MAX_EVENTS)) {
-        ioq_submit(s);
+    if (!s->io_q.blocked) {
+        if (s->io_q.in_flight + s->io_q.in_queue >= MAX_EVENTS) {
+            ioq_submit(s);
+        } else {
+            aio_io_plug_call(s->aio_context, laio_deferred_submit, s);
+        }
     }
 
     return 0;
@@ -404,6 +415,7 @@ int coroutine_fn laio_co_submit(BlockDriverState *bs, LinuxAioState *s, int fd,
 
 void laio_detach_aio_context(LinuxAioState *s, AioContext *old_context)
 {
+    aio_io_plug_cancel(old_context, laio_deferred_submit, s);
     aio_set_event_notifier(old_context, &s->e, false, NULL, NULL);
     qemu_bh_delete(s->completion_bh);
     s->aio_context = NULL;
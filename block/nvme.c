@@ -30,6 +30,17 @@
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
 #define NVME_BAR_SIZE 8192
+#define NVME_IO_QUEUES_DEFAULT 1
+#define NVME_IO_QUEUES_MAX 64
+
+typedef struct BDRVNVMeState BDRVNVMeState;
+
+/* An interrupt vector of the controller */
+typedef struct {
+    EventNotifier notifier;
+    BDRVNVMeState *s;
+    int vector;
+} NVMeIrq;
 
 typedef struct {
     int32_t  head, tail;
@@ -55,6 +66,12 @@ typedef struct {
     /* Fields protected by BQL */
     int         index;
     uint8_t     *prp_list_pages;
+    /* Interrupt vector of the completion queue */
+    int         vector;
+
+    /* The AioContext that submits requests to this queue pair, NULL while
+     * unclaimed.  Written under BDRVNVMeState.queue_lock. */
+    AioContext  *aio_context;
 
     /* Fields protected by @lock */
     NVMeQueue   sq, cq;
@@ -87,7 +104,7 @@ typedef volatile struct {
 
 QEMU_BUILD_BUG_ON(offsetof(NVMeRegs, doorbells) != 0x1000);
 
-typedef struct {
+struct BDRVNVMeState {
     AioContext *aio_context;
     QEMUVFIOState *vfio;
     NVMeRegs *regs;
@@ -97,11 +114,18 @@ typedef struct {
      */
     NVMeQueuePair **queues;
     int nr_queues;
+    /* Protects claiming I/O queue pairs for an AioContext */
+    QemuMutex queue_lock;
+    /* Number of I/O queue pairs not claimed by any AioContext yet */
+    int free_io_queues;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
     bool write_cache_supported;
-    EventNotifier irq_notifier;
+    /* Interrupt vectors.  [0] serves the admin queue, and also the I/O
+     * queues if the device does not have a vector for each of them. */
+    NVMeIrq *irqs;
+    int nr_irqs;
     uint64_t nsze; /* Namespace size reported by identify command */
     int nsid;      /* The namespace id to read/write data. */
     uint64_t max_transfer;
@@ -115,10 +139,13 @@ typedef struct {
 
     /* PCI address (required for nvme_refresh_filename()) */
     char *device;
-} BDRVNVMeState;
+};
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_IO_QUEUES "io-queues"
+#define NVME_BLOCK_OPT_IRQ_COALESCING_THRESHOLD "irq-coalescing-threshold"
+#define NVME_BLOCK_OPT_IRQ_COALESCING_TIME "irq-coalescing-time"
 
 static QemuOptsList runtime_opts = {
     .name = "nvme",
@@ -134,6 +161,24 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_IO_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of I/O queue pairs; each AioContext "
+                    "that submits requests gets one of its own",
+        },
+        {
+            .name = NVME_BLOCK_OPT_IRQ_COALESCING_THRESHOLD,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Completions to aggregate before raising an interrupt "
+                    "(1-256, 0 keeps the controller setting)",
+        },
+        {
+            .name = NVME_BLOCK_OPT_IRQ_COALESCING_TIME,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum delay of an aggregated interrupt, in units "
+                    "of 100 microseconds (0-255)",
+        },
         { /* end of list */ }
     },
 };
@@ -350,7 +395,8 @@ static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
         smp_mb_release();
         *q->cq.doorbell = cpu_to_le32(q->cq.head);
         if (!qemu_co_queue_empty(&q->free_req_queue)) {
-            aio_bh_schedule_oneshot(s->aio_context, nvme_free_req_queue_cb, q);
+            aio_bh_schedule_oneshot(q->aio_context ?: s->aio_context,
+                                    nvme_free_req_queue_cb, q);
         }
     }
     q->busy = false;
@@ -472,13 +518,17 @@ out:
     qemu_vfree(resp);
 }
 
-static bool nvme_poll_queues(BDRVNVMeState *s)
+/* Process the completion queues that are served by interrupt @vector */
+static bool nvme_poll_queues(BDRVNVMeState *s, int vector)
 {
     bool progress = false;
     int i;
 
     for (i = 0; i < s->nr_queues; i++) {
         NVMeQueuePair *q = s->queues[i];
+        if (q->vector != vector) {
+            continue;
+        }
         qemu_mutex_lock(&q->lock);
         while (nvme_process_completion(s, q)) {
             /* Keep polling */
@@ -491,11 +541,11 @@ static bool nvme_poll_queues(BDRVNVMeState *s)
 
 static void nvme_handle_event(EventNotifier *n)
 {
-    BDRVNVMeState *s = container_of(n, BDRVNVMeState, irq_notifier);
+    NVMeIrq *irq = container_of(n, NVMeIrq, notifier);
 
-    trace_nvme_handle_event(s);
+    trace_nvme_handle_event(irq->s, irq->vector);
     event_notifier_test_and_clear(n);
-    nvme_poll_queues(s);
+    nvme_poll_queues(irq->s, irq->vector);
 }
 
 static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
@@ -510,11 +560,13 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     if (!q) {
         return false;
     }
+    /* Use a dedicated interrupt vector if there is one for this queue */
+    q->vector = n < s->nr_irqs ? n : 0;
     cmd = (NvmeCmd) {
         .opcode = NVME_ADM_CMD_CREATE_CQ,
         .prp1 = cpu_to_le64(q->cq.iova),
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | (n & 0xFFFF)),
-        .cdw11 = cpu_to_le32(0x3),
+        .cdw11 = cpu_to_le32(0x3 | (q->vector << 16)),
     };
     if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
         error_setg(errp, "Failed to create io queue [%d]", n);
@@ -535,40 +587,157 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
     s->queues[n] = q;
     s->nr_queues++;
+    s->free_io_queues++;
     return true;
 }
 
 static bool nvme_poll_cb(void *opaque)
 {
     EventNotifier *e = opaque;
-    BDRVNVMeState *s = container_of(e, BDRVNVMeState, irq_notifier);
-    bool progress = false;
+    NVMeIrq *irq = container_of(e, NVMeIrq, notifier);
 
-    trace_nvme_poll_cb(s);
-    progress = nvme_poll_queues(s);
-    return progress;
+    trace_nvme_poll_cb(irq->s, irq->vector);
+    return nvme_poll_queues(irq->s, irq->vector);
+}
+
+/* Return the I/O queue pair for requests from the current AioContext.
+ *
+ * The first requests from each AioContext claim a queue pair of their own,
+ * whose completion interrupt is then handled (and polled) in that
+ * AioContext, so that submission and completion never cross threads.  Once
+ * all queue pairs are claimed, further AioContexts share them. */
+static NVMeQueuePair *nvme_get_io_queue(BDRVNVMeState *s)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    NVMeQueuePair *q = NULL;
+    int i;
+
+    assert(s->nr_queues > 1);
+    for (i = 1; i < s->nr_queues; i++) {
+        if (atomic_read(&s->queues[i]->aio_context) == ctx) {
+            return s->queues[i];
+        }
+    }
+
+    if (atomic_read(&s->free_io_queues)) {
+        qemu_mutex_lock(&s->queue_lock);
+        for (i = 1; i < s->nr_queues; i++) {
+            if (s->queues[i]->aio_context == ctx) {
+                /* Claimed by a concurrent request from this context */
+                q = s->queues[i];
+                break;
+            }
+            if (!q && !s->queues[i]->aio_context) {
+                q = s->queues[i];
+            }
+        }
+        if (q && !q->aio_context) {
+            trace_nvme_claim_queue(s, q->index, ctx);
+            if (q->vector) {
+                aio_set_event_notifier(ctx, &s->irqs[q->vector].notifier,
+                                       false, nvme_handle_event, nvme_poll_cb);
+            }
+            atomic_set(&q->aio_context, ctx);
+            atomic_set(&s->free_io_queues, s->free_io_queues - 1);
+        }
+        qemu_mutex_unlock(&s->queue_lock);
+        if (q) {
+            return q;
+        }
+    }
+
+    q = s->queues[1 + g_direct_hash(ctx) % (s->nr_queues - 1)];
+    trace_nvme_share_queue(s, q->index, ctx);
+    return q;
+}
+
+/* Release the I/O queue pairs claimed by AioContexts.  There must be no
+ * requests in flight. */
+static void nvme_release_io_queues(BDRVNVMeState *s)
+{
+    int i;
+
+    qemu_mutex_lock(&s->queue_lock);
+    for (i = 1; i < s->nr_queues; i++) {
+        NVMeQueuePair *q = s->queues[i];
+
+        if (!q->aio_context) {
+            continue;
+        }
+        if (q->vector) {
+            aio_set_event_notifier(q->aio_context,
+                                   &s->irqs[q->vector].notifier,
+                                   false, NULL, NULL);
+        }
+        atomic_set(&q->aio_context, NULL);
+        s->free_io_queues++;
+    }
+    qemu_mutex_unlock(&s->queue_lock);
+}
+
+/* Set up one interrupt vector for the admin queue and, if the device has
+ * enough of them, one for each of @io_queues I/O queues. */
+static int nvme_init_irqs(BlockDriverState *bs, int io_queues, Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    EventNotifier **notifiers;
+    int nr_vectors;
+    int i, ret;
+
+    nr_vectors = qemu_vfio_pci_get_irq_count(s->vfio, VFIO_PCI_MSIX_IRQ_INDEX,
+                                             errp);
+    if (nr_vectors < 0) {
+        return nr_vectors;
+    }
+    /* I/O queues without a vector of their own share vector 0 */
+    nr_vectors = MIN(nr_vectors, io_queues + 1);
+
+    s->irqs = g_new0(NVMeIrq, nr_vectors);
+    notifiers = g_new(EventNotifier *, nr_vectors);
+    for (i = 0; i < nr_vectors; i++) {
+        NVMeIrq *irq = &s->irqs[i];
+
+        ret = event_notifier_init(&irq->notifier, 0);
+        if (ret) {
+            error_setg(errp, "Failed to init event notifier");
+            goto out;
+        }
+        irq->s = s;
+        irq->vector = i;
+        notifiers[i] = &irq->notifier;
+        s->nr_irqs++;
+    }
+
+    ret = qemu_vfio_pci_init_irqs(s->vfio, notifiers, nr_vectors,
+                                  VFIO_PCI_MSIX_IRQ_INDEX, errp);
+    if (ret) {
+        goto out;
+    }
+    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irqs[0].notifier,
+                           false, nvme_handle_event, nvme_poll_cb);
+out:
+    g_free(notifiers);
+    return ret;
 }
 
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     int io_queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     int ret;
+    int i;
     uint64_t cap;
     uint64_t timeout_ms;
     uint64_t deadline, now;
     Error *local_err = NULL;
+    NvmeCmd cmd;
 
     qemu_co_mutex_init(&s->dma_map_lock);
     qemu_co_queue_init(&s->dma_flush_queue);
+    qemu_mutex_init(&s->queue_lock);
     s->device = g_strdup(device);
     s->nsid = namespace;
     s->aio_context = bdrv_get_aio_context(bs);
-    ret = event_notifier_init(&s->irq_notifier, 0);
-    if (ret) {
-        error_setg(errp, "Failed to init event notifier");
-        return ret;
-    }
 
     s->vfio = qemu_vfio_open_pci(device, errp);
     if (!s->vfio) {
@@ -641,13 +810,10 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         }
     }
 
-    ret = qemu_vfio_pci_init_irq(s->vfio, &s->irq_notifier,
-                                 VFIO_PCI_MSIX_IRQ_INDEX, errp);
+    ret = nvme_init_irqs(bs, io_queues, errp);
     if (ret) {
         goto out;
     }
-    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
-                           false, nvme_handle_event, nvme_poll_cb);
 
     nvme_identify(bs, namespace, &local_err);
     if (local_err) {
@@ -656,9 +822,31 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         goto out;
     }
 
-    /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    /* Request the I/O queues (Number of Queues feature).  The controller may
+     * allocate fewer; creating the ones beyond its limit then fails. */
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(0x07),
+        .cdw11 = cpu_to_le32(((io_queues - 1) << 16) | (io_queues - 1)),
+    };
+    if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
+        error_setg(errp, "Failed to request %d io queues", io_queues);
         ret = -EIO;
+        goto out;
+    }
+
+    /* Set up command queues. */
+    for (i = 0; i < io_queues; i++) {
+        if (!nvme_add_io_queue(bs, &local_err)) {
+            if (i == 0) {
+                error_propagate(errp, local_err);
+                ret = -EIO;
+                goto out;
+            }
+            trace_nvme_io_queues_limited(s, i, io_queues);
+            error_free(local_err);
+            break;
+        }
     }
 out:
     /* Cleaning up is done in nvme_file_open() upon error. */
@@ -720,18 +908,45 @@ static int nvme_enable_disable_write_cache(BlockDriverState *bs, bool enable,
     return ret;
 }
 
+/* Let the controller aggregate up to @threshold completions, for at most
+ * @time * 100 microseconds, before raising an I/O queue interrupt. */
+static int nvme_set_irq_coalescing(BlockDriverState *bs, int threshold,
+                                   int time, Error **errp)
+{
+    int ret;
+    BDRVNVMeState *s = bs->opaque;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(0x08),
+        .cdw11 = cpu_to_le32((time << 8) | (threshold - 1)),
+    };
+
+    ret = nvme_cmd_sync(bs, s->queues[0], &cmd);
+    if (ret) {
+        error_setg(errp, "Failed to configure NVMe interrupt coalescing");
+    }
+    return ret;
+}
+
 static void nvme_close(BlockDriverState *bs)
 {
     int i;
     BDRVNVMeState *s = bs->opaque;
 
+    nvme_release_io_queues(s);
+    if (s->nr_irqs) {
+        aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irqs[0].notifier,
+                               false, NULL, NULL);
+    }
     for (i = 0; i < s->nr_queues; ++i) {
         nvme_free_queue_pair(bs, s->queues[i]);
     }
     g_free(s->queues);
-    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
-                           false, NULL, NULL);
-    event_notifier_cleanup(&s->irq_notifier);
+    for (i = 0; i < s->nr_irqs; ++i) {
+        event_notifier_cleanup(&s->irqs[i].notifier);
+    }
+    g_free(s->irqs);
+    qemu_mutex_destroy(&s->queue_lock);
     qemu_vfio_pci_unmap_bar(s->vfio, 0, (void *)s->regs, 0, NVME_BAR_SIZE);
     qemu_vfio_close(s->vfio);
 
@@ -744,6 +959,7 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    int64_t io_queues, coalescing_threshold, coalescing_time;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -757,11 +973,40 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    io_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_IO_QUEUES,
+                                    NVME_IO_QUEUES_DEFAULT);
+    coalescing_threshold =
+        qemu_opt_get_number(opts, NVME_BLOCK_OPT_IRQ_COALESCING_THRESHOLD, 0);
+    coalescing_time =
+        qemu_opt_get_number(opts, NVME_BLOCK_OPT_IRQ_COALESCING_TIME, 0);
     qemu_opts_del(opts);
+    if (io_queues < 1 || io_queues > NVME_IO_QUEUES_MAX) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_IO_QUEUES "' must be between 1 "
+                   "and %d", NVME_IO_QUEUES_MAX);
+        return -EINVAL;
+    }
+    if (coalescing_threshold < 0 || coalescing_threshold > 256) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_IRQ_COALESCING_THRESHOLD
+                   "' must be between 0 and 256");
+        return -EINVAL;
+    }
+    if (coalescing_time < 0 || coalescing_time > 255) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_IRQ_COALESCING_TIME
+                   "' must be between 0 and 255");
+        return -EINVAL;
+    }
+
+    ret = nvme_init(bs, device, namespace, io_queues, errp);
     if (ret) {
         goto fail;
     }
+    if (coalescing_threshold) {
+        ret = nvme_set_irq_coalescing(bs, coalescing_threshold,
+                                      coalescing_time, errp);
+        if (ret) {
+            goto fail;
+        }
+    }
     if (flags & BDRV_O_NOCACHE) {
         if (!s->write_cache_supported) {
             error_setg(errp,
@@ -915,7 +1160,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     uint32_t cdw12 = (((bytes >> BDRV_SECTOR_BITS) - 1) & 0xFFFF) |
                        (flags & BDRV_REQ_FUA ? 1 << 30 : 0);
@@ -927,12 +1172,11 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         .cdw12 = cpu_to_le32(cdw12),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
     trace_nvme_prw_aligned(s, is_write, offset, bytes, flags, qiov->niov);
-    assert(s->nr_queues > 1);
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -1029,18 +1273,17 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
         .nsid = cpu_to_le32(s->nsid),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
-    assert(s->nr_queues > 1);
     req = nvme_get_free_req(ioq);
     assert(req);
     nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
@@ -1081,7 +1324,9 @@ static void nvme_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
 
-    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
+    /* The I/O queues are claimed again by the next requests */
+    nvme_release_io_queues(s);
+    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irqs[0].notifier,
                            false, NULL, NULL);
 }
 
@@ -1091,7 +1336,7 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
     BDRVNVMeState *s = bs->opaque;
 
     s->aio_context = new_context;
-    aio_set_event_notifier(new_context, &s->irq_notifier,
+    aio_set_event_notifier(new_context, &s->irqs[0].notifier,
                            false, nvme_handle_event, nvme_poll_cb);
 }
 
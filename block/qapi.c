@@ -428,10 +428,45 @@ static void bdrv_latency_histogram_stats(BlockLatencyHistogram *hist,
     }
 }
 
+static void bdrv_latency_percentiles_stats(bool found,
+                                           BlockAcctPercentiles *p,
+                                           bool *not_null,
+                                           BlockLatencyPercentiles **info)
+{
+    *not_null = found;
+    if (found) {
+        *info = g_new0(BlockLatencyPercentiles, 1);
+        (*info)->p50 = p->p50;
+        (*info)->p99 = p->p99;
+        (*info)->p999 = p->p999;
+    }
+}
+
+static void bdrv_queue_depth_histogram_stats(BlockAcctStats *stats,
+                                             enum BlockAcctType type,
+                                             bool *not_null,
+                                             BlockLatencyHistogramInfo **info)
+{
+    uint64_t *boundaries, *bins;
+    int nbins;
+
+    nbins = block_acct_queue_depth_histogram(stats, type, &boundaries, &bins);
+    *not_null = nbins > 0;
+    if (*not_null) {
+        *info = g_new0(BlockLatencyHistogramInfo, 1);
+
+        (*info)->boundaries = uint64_list(boundaries, nbins - 1);
+        (*info)->bins = uint64_list(bins, nbins);
+    }
+    g_free(boundaries);
+    g_free(bins);
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
     BlockAcctTimedStats *ts = NULL;
+    BlockAcctPercentiles p;
 
     ds->rd_bytes = stats->nr_bytes[BLOCK_ACCT_READ];
     ds->wr_bytes = stats->nr_bytes[BLOCK_ACCT_WRITE];
@@ -492,6 +527,19 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
             block_acct_queue_depth(ts, BLOCK_ACCT_READ);
         dev_stats->avg_wr_queue_depth =
             block_acct_queue_depth(ts, BLOCK_ACCT_WRITE);
+
+        bdrv_latency_percentiles_stats(
+            block_acct_timed_latency_percentiles(ts, BLOCK_ACCT_READ, &p), &p,
+            &dev_stats->has_rd_latency_percentiles,
+            &dev_stats->rd_latency_percentiles);
+        bdrv_latency_percentiles_stats(
+            block_acct_timed_latency_percentiles(ts, BLOCK_ACCT_WRITE, &p), &p,
+            &dev_stats->has_wr_latency_percentiles,
+            &dev_stats->wr_latency_percentiles);
+        bdrv_latency_percentiles_stats(
+            block_acct_timed_latency_percentiles(ts, BLOCK_ACCT_FLUSH, &p), &p,
+            &dev_stats->has_flush_latency_percentiles,
+            &dev_stats->flush_latency_percentiles);
     }
 
     bdrv_latency_histogram_stats(&stats->latency_histogram[BLOCK_ACCT_READ],
@@ -503,6 +551,26 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     bdrv_latency_histogram_stats(&stats->latency_histogram[BLOCK_ACCT_FLUSH],
                                  &ds->has_flush_latency_histogram,
                                  &ds->flush_latency_histogram);
+
+    bdrv_latency_percentiles_stats(
+        block_acct_latency_percentiles(stats, BLOCK_ACCT_READ, &p), &p,
+        &ds->has_rd_latency_percentiles, &ds->rd_latency_percentiles);
+    bdrv_latency_percentiles_stats(
+        block_acct_latency_percentiles(stats, BLOCK_ACCT_WRITE, &p), &p,
+        &ds->has_wr_latency_percentiles, &ds->wr_latency_percentiles);
+    bdrv_latency_percentiles_stats(
+        block_acct_latency_percentiles(stats, BLOCK_ACCT_FLUSH, &p), &p,
+        &ds->has_flush_latency_percentiles, &ds->flush_latency_percentiles);
+
+    bdrv_queue_depth_histogram_stats(stats, BLOCK_ACCT_READ,
+                                     &ds->has_rd_queue_depth_histogram,
+                                     &ds->rd_queue_depth_histogram);
+    bdrv_queue_depth_histogram_stats(stats, BLOCK_ACCT_WRITE,
+                                     &ds->has_wr_queue_depth_histogram,
+                                     &ds->wr_queue_depth_histogram);
+    bdrv_queue_depth_histogram_stats(stats, BLOCK_ACCT_FLUSH,
+                                     &ds->has_flush_queue_depth_histogram,
+                                     &ds->flush_queue_depth_histogram);
 }
 
 static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
@@ -532,6 +600,11 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
 
     s->stats->wr_highest_offset = stat64_get(&bs->wr_highest_offset);
 
+    s->driver_specific = bdrv_get_specific_stats(bs);
+    if (s->driver_specific) {
+        s->has_driver_specific = true;
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_bds_stats(bs->file->bs, blk_level);
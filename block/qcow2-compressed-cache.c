@@ -0,0 +1,426 @@
+/*
+ * Cache and read-ahead for decompressed qcow2 clusters
+ *
+ * Decompressing a cluster is much more expensive than reading it, and guests
+ * usually read compressed clusters in pieces much smaller than a cluster, so
+ * keep the last few decompressed clusters in memory.  When a sequential reader
+ * is detected, the next compressed clusters are read and decompressed in the
+ * background so that several of them are inflated in parallel on the thread
+ * pool while the guest consumes the current one.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qcow2.h"
+#include "trace.h"
+
+/* Number of compressed clusters decompressed ahead of a sequential reader */
+#define QCOW2_COMPRESSED_READAHEAD  4
+
+typedef struct Qcow2DecompressedCluster {
+    /* Compressed cluster descriptor of the cached data, 0 if unused */
+    uint64_t l2_entry;
+    /* Decompressed data, cluster_size bytes */
+    uint8_t *data;
+    /* The data is being read and decompressed */
+    bool in_flight;
+    /* The host clusters were freed while the entry was in flight */
+    bool discarded;
+    /* Coroutines waiting for the entry to leave the in_flight state */
+    CoQueue wait_queue;
+    uint64_t lru_counter;
+} Qcow2DecompressedCluster;
+
+struct Qcow2CompressedCache {
+    Qcow2DecompressedCluster *entries;
+    int nb_entries;
+    uint64_t lru_counter;
+    /* Guest offset right after the last compressed read */
+    uint64_t next_offset;
+    /* Guest offset up to which read-ahead has been started */
+    uint64_t readahead_end;
+};
+
+typedef struct Qcow2ReadaheadCo {
+    BlockDriverState *bs;
+    Qcow2DecompressedCluster *entry;
+} Qcow2ReadaheadCo;
+
+static void compressed_cluster_range(BDRVQcow2State *s, uint64_t l2_entry,
+                                     uint64_t *coffset, int *csize)
+{
+    int nb_csectors;
+
+    *coffset = l2_entry & s->cluster_offset_mask;
+    nb_csectors = ((l2_entry >> s->csize_shift) & s->csize_mask) + 1;
+    *csize = nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE -
+        (*coffset & ~QCOW2_COMPRESSED_SECTOR_MASK);
+}
+
+/*
+ * Read the compressed cluster described by @l2_entry and decompress it into
+ * @out_buf, which must be cluster_size bytes long.
+ */
+static int coroutine_fn
+qcow2_co_load_compressed(BlockDriverState *bs, uint64_t l2_entry,
+                         uint8_t *out_buf)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t coffset;
+    uint8_t *buf;
+    int csize;
+    int ret;
+
+    compressed_cluster_range(s, l2_entry, &coffset, &csize);
+
+    buf = g_try_malloc(csize);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
+        ret = -EIO;
+        goto out;
+    }
+
+    ret = 0;
+out:
+    g_free(buf);
+    return ret;
+}
+
+static Qcow2CompressedCache *compressed_cache_get(BDRVQcow2State *s)
+{
+    Qcow2CompressedCache *c;
+    int i;
+
+    if (!s->compressed_cache) {
+        c = g_new0(Qcow2CompressedCache, 1);
+        c->nb_entries = s->compressed_cache_size;
+        c->entries = g_new0(Qcow2DecompressedCluster, c->nb_entries);
+        for (i = 0; i < c->nb_entries; i++) {
+            qemu_co_queue_init(&c->entries[i].wait_queue);
+        }
+        s->compressed_cache = c;
+    }
+
+    return s->compressed_cache;
+}
+
+static void compressed_cache_drop_entry(Qcow2DecompressedCluster *e)
+{
+    e->l2_entry = 0;
+    e->lru_counter = 0;
+    e->discarded = false;
+}
+
+static Qcow2DecompressedCluster *
+compressed_cache_find(Qcow2CompressedCache *c, uint64_t l2_entry)
+{
+    int i;
+
+    for (i = 0; i < c->nb_entries; i++) {
+        Qcow2DecompressedCluster *e = &c->entries[i];
+
+        if (e->l2_entry == l2_entry && !e->discarded) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Take the least recently used entry that is not in flight and mark it as
+ * being filled with the data of @l2_entry.  Returns NULL if all entries are
+ * busy or memory for the data could not be allocated.
+ */
+static Qcow2DecompressedCluster *
+compressed_cache_alloc(BlockDriverState *bs, Qcow2CompressedCache *c,
+                       uint64_t l2_entry)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressedCluster *victim = NULL;
+    int i;
+
+    for (i = 0; i < c->nb_entries; i++) {
+        Qcow2DecompressedCluster *e = &c->entries[i];
+
+        if (e->in_flight) {
+            continue;
+        }
+        if (!victim || e->lru_counter < victim->lru_counter) {
+            victim = e;
+        }
+    }
+
+    if (!victim) {
+        return NULL;
+    }
+
+    if (!victim->data) {
+        victim->data = qemu_try_blockalign(bs, s->cluster_size);
+        if (!victim->data) {
+            return NULL;
+        }
+    }
+
+    victim->l2_entry = l2_entry;
+    victim->in_flight = true;
+    victim->discarded = false;
+    victim->lru_counter = ++c->lru_counter;
+    return victim;
+}
+
+/*
+ * Fill an entry returned by compressed_cache_alloc() and wake up everyone
+ * waiting for it.  On failure the entry is dropped again, so that waiters
+ * retry the read themselves and see the error.
+ */
+static int coroutine_fn
+compressed_cache_fill(BlockDriverState *bs, Qcow2DecompressedCluster *e)
+{
+    int ret;
+
+    ret = qcow2_co_load_compressed(bs, e->l2_entry, e->data);
+
+    e->in_flight = false;
+    if (ret < 0 || e->discarded) {
+        compressed_cache_drop_entry(e);
+    }
+    qemu_co_queue_restart_all(&e->wait_queue);
+
+    return ret;
+}
+
+static void coroutine_fn qcow2_co_readahead_entry(void *opaque)
+{
+    Qcow2ReadaheadCo *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+
+    compressed_cache_fill(bs, ra->entry);
+    g_free(ra);
+
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Start decompressing the compressed clusters that follow the one at guest
+ * offset @offset, up to QCOW2_COMPRESSED_READAHEAD clusters ahead.
+ */
+static void coroutine_fn
+qcow2_co_compressed_readahead(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    uint64_t cluster_start = start_of_cluster(s, offset);
+    uint64_t start, end;
+    uint64_t off;
+
+    start = MAX(cluster_start + s->cluster_size, c->readahead_end);
+    end = MIN(cluster_start +
+              (uint64_t) (QCOW2_COMPRESSED_READAHEAD + 1) * s->cluster_size,
+              bs->total_sectors * BDRV_SECTOR_SIZE);
+    if (start >= end) {
+        return;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    for (off = start; off < end; off += s->cluster_size) {
+        unsigned int bytes = s->cluster_size;
+        uint64_t l2_entry;
+        QCow2SubclusterType type;
+        Qcow2DecompressedCluster *e;
+        Qcow2ReadaheadCo *ra;
+        Coroutine *co;
+        int ret;
+
+        ret = qcow2_get_cluster_offset(bs, off, &bytes, &l2_entry, &type);
+        if (ret < 0) {
+            break;
+        }
+        if (type != QCOW2_SUBCLUSTER_COMPRESSED ||
+            compressed_cache_find(c, l2_entry))
+        {
+            continue;
+        }
+
+        e = compressed_cache_alloc(bs, c, l2_entry);
+        if (!e) {
+            break;
+        }
+
+        trace_qcow2_compressed_readahead(qemu_coroutine_self(), off);
+
+        ra = g_new(Qcow2ReadaheadCo, 1);
+        *ra = (Qcow2ReadaheadCo) {
+            .bs = bs,
+            .entry = e,
+        };
+        bdrv_inc_in_flight(bs);
+        co = qemu_coroutine_create(qcow2_co_readahead_entry, ra);
+        aio_co_schedule(bdrv_get_aio_context(bs), co);
+    }
+    c->readahead_end = off;
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+/*
+ * qcow2_co_preadv_compressed:
+ *
+ * Read @bytes bytes at guest offset @offset from the compressed cluster
+ * described by @l2_entry into @qiov, going through the decompressed
+ * cluster cache.
+ */
+int coroutine_fn
+qcow2_co_preadv_compressed(BlockDriverState *bs, uint64_t l2_entry,
+                           uint64_t offset, uint64_t bytes,
+                           QEMUIOVector *qiov)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = compressed_cache_get(s);
+    Qcow2DecompressedCluster *e;
+    int offset_in_cluster = offset_into_cluster(s, offset);
+    int ret;
+
+    /* Start read-ahead first, so that it runs in parallel with this read */
+    if (offset == c->next_offset) {
+        qcow2_co_compressed_readahead(bs, offset);
+    } else {
+        c->readahead_end = 0;
+    }
+    c->next_offset = offset + bytes;
+
+    for (;;) {
+        e = compressed_cache_find(c, l2_entry);
+        if (!e || !e->in_flight) {
+            break;
+        }
+        qemu_co_queue_wait(&e->wait_queue, NULL);
+    }
+
+    if (e) {
+        trace_qcow2_compressed_cache_hit(qemu_coroutine_self(), offset);
+    } else {
+        trace_qcow2_compressed_cache_miss(qemu_coroutine_self(), offset);
+
+        e = compressed_cache_alloc(bs, c, l2_entry);
+        if (!e) {
+            /* Every entry is busy, bypass the cache */
+            uint8_t *out_buf = qemu_try_blockalign(bs, s->cluster_size);
+
+            if (!out_buf) {
+                return -ENOMEM;
+            }
+            ret = qcow2_co_load_compressed(bs, l2_entry, out_buf);
+            if (ret == 0) {
+                qemu_iovec_from_buf(qiov, 0, out_buf + offset_in_cluster,
+                                    bytes);
+            }
+            qemu_vfree(out_buf);
+            return ret;
+        }
+
+        ret = compressed_cache_fill(bs, e);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    qemu_iovec_from_buf(qiov, 0, e->data + offset_in_cluster, bytes);
+    if (e->l2_entry) {
+        e->lru_counter = ++c->lru_counter;
+    }
+
+    return 0;
+}
+
+/*
+ * Forget the cached data of compressed clusters that overlap the host range
+ * [@offset, @offset + @bytes), which is being freed.
+ */
+void qcow2_compressed_cache_discard(BlockDriverState *bs, uint64_t offset,
+                                    uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    int i;
+
+    if (!c) {
+        return;
+    }
+
+    for (i = 0; i < c->nb_entries; i++) {
+        Qcow2DecompressedCluster *e = &c->entries[i];
+        uint64_t coffset;
+        int csize;
+
+        if (!e->l2_entry) {
+            continue;
+        }
+
+        compressed_cluster_range(s, e->l2_entry, &coffset, &csize);
+        if (coffset >= offset + bytes || coffset + csize <= offset) {
+            continue;
+        }
+
+        if (e->in_flight) {
+            e->discarded = true;
+        } else {
+            compressed_cache_drop_entry(e);
+        }
+    }
+}
+
+/* Drop all entries that are not in use and free their memory */
+void qcow2_compressed_cache_clean(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    int i;
+
+    if (!c) {
+        return;
+    }
+
+    for (i = 0; i < c->nb_entries; i++) {
+        Qcow2DecompressedCluster *e = &c->entries[i];
+
+        if (e->in_flight) {
+            e->discarded = true;
+            continue;
+        }
+        compressed_cache_drop_entry(e);
+        qemu_vfree(e->data);
+        e->data = NULL;
+    }
+    c->readahead_end = 0;
+}
+
+void qcow2_compressed_cache_destroy(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    int i;
+
+    if (!c) {
+        return;
+    }
+
+    for (i = 0; i < c->nb_entries; i++) {
+        assert(!c->entries[i].in_flight);
+        qemu_vfree(c->entries[i].data);
+    }
+
+    g_free(c->entries);
+    g_free(c);
+    s->compressed_cache = NULL;
+}
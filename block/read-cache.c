@@ -0,0 +1,803 @@
+/*
+ * Read cache filter block driver
+ *
+ * Keeps recently read data of the child node in memory, within a fixed
+ * budget, and reads ahead of sequential readers.  This is meant for images
+ * opened with cache.direct=on, so that their data is cached by QEMU with a
+ * known memory footprint and eviction policy instead of by the host page
+ * cache.
+ *
+ * By default all read-cache nodes on top of the same child node share one
+ * cache, so many guests booting from the same base image only keep a single
+ * copy of its hot data in memory.  Writes to the child node, through any of
+ * these nodes or by its other parents, drop the overlapping cached data.
+ * Resizing the child is left to read-cache nodes only.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "qemu/host-utils.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "trace.h"
+
+#define READ_CACHE_OPT_SIZE         "size"
+#define READ_CACHE_OPT_CHUNK_SIZE   "chunk-size"
+#define READ_CACHE_OPT_PREFETCH     "prefetch"
+#define READ_CACHE_OPT_SHARED       "shared"
+
+#define READ_CACHE_DEFAULT_SIZE         (32 * MiB)
+#define READ_CACHE_DEFAULT_CHUNK_SIZE   (64 * KiB)
+#define READ_CACHE_DEFAULT_PREFETCH     4
+
+typedef struct ReadCacheChunk {
+    /* Offset in the child node, aligned to the chunk size */
+    uint64_t offset;
+    /* Number of valid bytes, less than the chunk size at the end of the
+     * image */
+    uint64_t bytes;
+    uint8_t *data;
+    /* The data is being read from the child node */
+    bool filling;
+    /* A write overlapped the chunk while it was being filled */
+    bool invalidated;
+    /* Coroutines waiting for the chunk to leave the filling state */
+    CoQueue wait_queue;
+    /* Only chunks that are not being filled are on the LRU list */
+    QTAILQ_ENTRY(ReadCacheChunk) lru_entry;
+} ReadCacheChunk;
+
+typedef struct BDRVReadCacheState BDRVReadCacheState;
+
+typedef struct ReadCache {
+    /* The child node whose data is cached, NULL for unshared caches */
+    BlockDriverState *key;
+    /* The read-cache nodes using the cache, protected by the BQL */
+    QLIST_HEAD(, BDRVReadCacheState) users;
+    uint64_t chunk_size;
+    /* The largest budget of the users */
+    uint64_t max_chunks;
+
+    /* Protects the fields below */
+    QemuMutex lock;
+    GHashTable *chunks;
+    uint64_t nb_chunks;
+    QTAILQ_HEAD(, ReadCacheChunk) lru;  /* most recently used first */
+
+    /* Drops the cached data overwritten in the child node */
+    NotifierWithReturn before_write;
+
+    QLIST_ENTRY(ReadCache) next;
+} ReadCache;
+
+/* Shared caches, protected by the BQL */
+static QLIST_HEAD(, ReadCache) read_caches =
+    QLIST_HEAD_INITIALIZER(read_caches);
+
+struct BDRVReadCacheState {
+    ReadCache *cache;
+    QLIST_ENTRY(BDRVReadCacheState) cache_user;
+    /* Number of chunks this node asks the cache to keep */
+    uint64_t max_chunks;
+    unsigned prefetch;
+
+    /* Offset right after the last read */
+    uint64_t next_offset;
+    /* Offset up to which prefetching has been started */
+    uint64_t prefetch_end;
+};
+
+typedef struct ReadCacheOpts {
+    uint64_t size;
+    uint64_t chunk_size;
+    unsigned prefetch;
+    bool shared;
+} ReadCacheOpts;
+
+typedef struct ReadCachePrefetchCo {
+    BlockDriverState *bs;
+    ReadCacheChunk *chunk;
+} ReadCachePrefetchCo;
+
+static QemuOptsList read_cache_runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(read_cache_runtime_opts.head),
+    .desc = {
+        {
+            .name = READ_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of cached data (in bytes)",
+        },
+        {
+            .name = READ_CACHE_OPT_CHUNK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Granularity of the cache (in bytes)",
+        },
+        {
+            .name = READ_CACHE_OPT_PREFETCH,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of chunks read ahead of sequential readers",
+        },
+        {
+            .name = READ_CACHE_OPT_SHARED,
+            .type = QEMU_OPT_BOOL,
+            .help = "Share the cache with other read-cache nodes on top of "
+                    "the same node",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void read_cache_free_chunk(ReadCache *c, ReadCacheChunk *chunk)
+{
+    qemu_vfree(chunk->data);
+    g_free(chunk);
+    c->nb_chunks--;
+}
+
+/* Called with c->lock held */
+static void read_cache_drop_chunk(ReadCache *c, ReadCacheChunk *chunk)
+{
+    assert(!chunk->filling);
+    g_hash_table_remove(c->chunks, &chunk->offset);
+    QTAILQ_REMOVE(&c->lru, chunk, lru_entry);
+    read_cache_free_chunk(c, chunk);
+}
+
+/*
+ * Create a chunk for @offset in the filling state, evicting the least
+ * recently used chunk if the cache is full.  Returns NULL if all chunks are
+ * being filled or memory could not be allocated.
+ *
+ * Called with c->lock held.
+ */
+static ReadCacheChunk *read_cache_alloc_chunk(BlockDriverState *bs,
+                                              ReadCache *c, uint64_t offset)
+{
+    ReadCacheChunk *chunk;
+    uint8_t *data = NULL;
+
+    if (c->nb_chunks >= c->max_chunks) {
+        ReadCacheChunk *victim = QTAILQ_LAST(&c->lru);
+
+        if (!victim) {
+            return NULL;
+        }
+
+        g_hash_table_remove(c->chunks, &victim->offset);
+        QTAILQ_REMOVE(&c->lru, victim, lru_entry);
+        data = victim->data;
+        g_free(victim);
+        c->nb_chunks--;
+    } else {
+        data = qemu_try_blockalign(bs->file->bs, c->chunk_size);
+        if (!data) {
+            return NULL;
+        }
+    }
+
+    chunk = g_new0(ReadCacheChunk, 1);
+    chunk->offset = offset;
+    chunk->data = data;
+    chunk->filling = true;
+    qemu_co_queue_init(&chunk->wait_queue);
+
+    g_hash_table_insert(c->chunks, &chunk->offset, chunk);
+    c->nb_chunks++;
+
+    return chunk;
+}
+
+/* Whether a write overlapping [@offset, @offset + @bytes) of @bs is running */
+static bool coroutine_fn read_cache_write_in_flight(BlockDriverState *bs,
+                                                    uint64_t offset,
+                                                    uint64_t bytes)
+{
+    BdrvTrackedRequest *req;
+    bool found = false;
+
+    qemu_co_mutex_lock(&bs->reqs_lock);
+    QLIST_FOREACH(req, &bs->tracked_requests, list) {
+        if (req->type != BDRV_TRACKED_READ &&
+            offset < req->offset + req->bytes &&
+            req->offset < offset + bytes) {
+            found = true;
+            break;
+        }
+    }
+    qemu_co_mutex_unlock(&bs->reqs_lock);
+
+    return found;
+}
+
+/*
+ * Read the data of a chunk returned by read_cache_alloc_chunk() and wake up
+ * everyone waiting for it.  If @qiov is not NULL, @bytes bytes at
+ * @offset_in_chunk are copied to @qiov at @qiov_offset.  On failure the chunk
+ * is dropped again, so that waiters retry the read themselves and see the
+ * error.
+ */
+static int coroutine_fn read_cache_co_fill(BlockDriverState *bs,
+                                           ReadCacheChunk *chunk,
+                                           QEMUIOVector *qiov,
+                                           size_t qiov_offset,
+                                           uint64_t offset_in_chunk,
+                                           uint64_t bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCache *c = s->cache;
+    int64_t len;
+    int ret;
+
+    /* Writes that start from now on invalidate the chunk, but one that is
+     * already running may complete under our read */
+    if (read_cache_write_in_flight(bs->file->bs, chunk->offset,
+                                   c->chunk_size)) {
+        qemu_mutex_lock(&c->lock);
+        chunk->invalidated = true;
+        qemu_mutex_unlock(&c->lock);
+    }
+
+    len = bdrv_getlength(bs->file->bs);
+    if (len < 0) {
+        ret = len;
+    } else {
+        chunk->bytes = MIN(c->chunk_size, MAX(len, chunk->offset) -
+                                          chunk->offset);
+        ret = bdrv_co_pread(bs->file, chunk->offset, chunk->bytes,
+                            chunk->data, 0);
+    }
+
+    qemu_mutex_lock(&c->lock);
+    chunk->filling = false;
+    if (ret >= 0 && qiov) {
+        if (offset_in_chunk + bytes > chunk->bytes) {
+            /* The image shrank under the request */
+            ret = -EIO;
+        } else {
+            qemu_iovec_from_buf(qiov, qiov_offset,
+                                chunk->data + offset_in_chunk, bytes);
+        }
+    }
+    qemu_co_queue_restart_all(&chunk->wait_queue);
+    if (ret < 0 || chunk->invalidated) {
+        g_hash_table_remove(c->chunks, &chunk->offset);
+        read_cache_free_chunk(c, chunk);
+    } else {
+        QTAILQ_INSERT_HEAD(&c->lru, chunk, lru_entry);
+    }
+    qemu_mutex_unlock(&c->lock);
+
+    return ret < 0 ? ret : 0;
+}
+
+static void coroutine_fn read_cache_co_prefetch_entry(void *opaque)
+{
+    ReadCachePrefetchCo *pf = opaque;
+    BlockDriverState *bs = pf->bs;
+
+    read_cache_co_fill(bs, pf->chunk, NULL, 0, 0, 0);
+    g_free(pf);
+
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Start reading the chunks that follow a sequential read ending at @end, up
+ * to s->prefetch chunks ahead.
+ */
+static void read_cache_prefetch(BlockDriverState *bs, uint64_t end)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCache *c = s->cache;
+    uint64_t start, limit, off;
+
+    start = MAX(QEMU_ALIGN_UP(end, c->chunk_size), s->prefetch_end);
+    limit = MIN(QEMU_ALIGN_UP(end, c->chunk_size) + s->prefetch * c->chunk_size,
+                bs->total_sectors * BDRV_SECTOR_SIZE);
+    if (start >= limit) {
+        return;
+    }
+
+    qemu_mutex_lock(&c->lock);
+    for (off = start; off < limit; off += c->chunk_size) {
+        ReadCacheChunk *chunk;
+        ReadCachePrefetchCo *pf;
+        Coroutine *co;
+
+        if (g_hash_table_lookup(c->chunks, &off)) {
+            continue;
+        }
+
+        chunk = read_cache_alloc_chunk(bs, c, off);
+        if (!chunk) {
+            break;
+        }
+
+        trace_read_cache_prefetch(bs, off);
+
+        pf = g_new(ReadCachePrefetchCo, 1);
+        *pf = (ReadCachePrefetchCo) {
+            .bs = bs,
+            .chunk = chunk,
+        };
+        bdrv_inc_in_flight(bs);
+        co = qemu_coroutine_create(read_cache_co_prefetch_entry, pf);
+        aio_co_schedule(bdrv_get_aio_context(bs), co);
+    }
+    s->prefetch_end = off;
+    qemu_mutex_unlock(&c->lock);
+}
+
+/* Read [@offset, @offset + @bytes) of a single chunk into @qiov */
+static int coroutine_fn read_cache_co_read_chunk(BlockDriverState *bs,
+                                                 uint64_t offset,
+                                                 uint64_t bytes,
+                                                 QEMUIOVector *qiov,
+                                                 size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCache *c = s->cache;
+    uint64_t chunk_offset = QEMU_ALIGN_DOWN(offset, c->chunk_size);
+    ReadCacheChunk *chunk;
+    QEMUIOVector local_qiov;
+    int ret;
+
+    qemu_mutex_lock(&c->lock);
+    for (;;) {
+        chunk = g_hash_table_lookup(c->chunks, &chunk_offset);
+        if (!chunk || !chunk->filling) {
+            break;
+        }
+        qemu_co_queue_wait(&chunk->wait_queue, &c->lock);
+    }
+
+    if (chunk && offset + bytes <= chunk->offset + chunk->bytes) {
+        trace_read_cache_hit(bs, offset, bytes);
+        QTAILQ_REMOVE(&c->lru, chunk, lru_entry);
+        QTAILQ_INSERT_HEAD(&c->lru, chunk, lru_entry);
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            chunk->data + (offset - chunk_offset), bytes);
+        qemu_mutex_unlock(&c->lock);
+        return 0;
+    }
+
+    trace_read_cache_miss(bs, offset, bytes);
+    if (chunk) {
+        /* The image grew after the chunk was read */
+        read_cache_drop_chunk(c, chunk);
+    }
+    chunk = read_cache_alloc_chunk(bs, c, chunk_offset);
+    qemu_mutex_unlock(&c->lock);
+
+    if (chunk) {
+        return read_cache_co_fill(bs, chunk, qiov, qiov_offset,
+                                  offset - chunk_offset, bytes);
+    }
+
+    /* Every chunk is being filled, bypass the cache */
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_iovec_concat(&local_qiov, qiov, qiov_offset, bytes);
+    ret = bdrv_co_preadv(bs->file, offset, bytes, &local_qiov, 0);
+    qemu_iovec_destroy(&local_qiov);
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_preadv(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCache *c = s->cache;
+    size_t qiov_offset = 0;
+    int ret;
+
+    /* Start prefetching first, so that it runs in parallel with this read */
+    if (s->prefetch && offset == s->next_offset) {
+        read_cache_prefetch(bs, offset + bytes);
+    } else if (offset != s->next_offset) {
+        s->prefetch_end = 0;
+    }
+    s->next_offset = offset + bytes;
+
+    while (bytes) {
+        uint64_t n = MIN(bytes, c->chunk_size - offset % c->chunk_size);
+
+        ret = read_cache_co_read_chunk(bs, offset, n, qiov, qiov_offset);
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += n;
+        bytes -= n;
+        qiov_offset += n;
+    }
+
+    return 0;
+}
+
+/* Drop the cached data that overlaps [@offset, @offset + @bytes) */
+static void read_cache_invalidate(ReadCache *c, uint64_t offset,
+                                  uint64_t bytes)
+{
+    uint64_t end = bytes > UINT64_MAX - offset ? UINT64_MAX : offset + bytes;
+    uint64_t off;
+
+    qemu_mutex_lock(&c->lock);
+    if ((end - offset) / c->chunk_size < c->nb_chunks) {
+        for (off = QEMU_ALIGN_DOWN(offset, c->chunk_size); off < end;
+             off += c->chunk_size)
+        {
+            ReadCacheChunk *chunk = g_hash_table_lookup(c->chunks, &off);
+
+            if (!chunk) {
+                continue;
+            }
+            if (chunk->filling) {
+                chunk->invalidated = true;
+            } else {
+                read_cache_drop_chunk(c, chunk);
+            }
+        }
+    } else {
+        GHashTableIter iter;
+        ReadCacheChunk *chunk;
+
+        g_hash_table_iter_init(&iter, c->chunks);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &chunk)) {
+            if (chunk->offset + c->chunk_size <= offset ||
+                chunk->offset >= end) {
+                continue;
+            }
+            if (chunk->filling) {
+                chunk->invalidated = true;
+            } else {
+                g_hash_table_iter_remove(&iter);
+                QTAILQ_REMOVE(&c->lru, chunk, lru_entry);
+                read_cache_free_chunk(c, chunk);
+            }
+        }
+    }
+    qemu_mutex_unlock(&c->lock);
+}
+
+/*
+ * Called for every write, write_zeroes and discard request to the child
+ * node, whoever issues it, before the data changes.
+ */
+static int coroutine_fn read_cache_before_write_notify(
+        NotifierWithReturn *notifier, void *opaque)
+{
+    ReadCache *c = container_of(notifier, ReadCache, before_write);
+    BdrvTrackedRequest *req = opaque;
+
+    read_cache_invalidate(c, req->offset, req->bytes);
+    return 0;
+}
+
+static int coroutine_fn read_cache_co_pwritev(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov, int flags)
+{
+    return bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+}
+
+static int coroutine_fn read_cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                    int64_t offset, int bytes,
+                                                    BdrvRequestFlags flags)
+{
+    return bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+}
+
+static int coroutine_fn read_cache_co_pdiscard(BlockDriverState *bs,
+                                               int64_t offset, int bytes)
+{
+    return bdrv_co_pdiscard(bs->file, offset, bytes);
+}
+
+static int coroutine_fn read_cache_co_truncate(BlockDriverState *bs,
+                                               int64_t offset,
+                                               PreallocMode prealloc,
+                                               Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_co_truncate(bs->file, offset, prealloc, errp);
+    read_cache_invalidate(s->cache, offset, UINT64_MAX);
+    return ret;
+}
+
+static int64_t read_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static ReadCache *read_cache_new(BlockDriverState *child_bs,
+                                 BlockDriverState *key, uint64_t chunk_size)
+{
+    ReadCache *c = g_new0(ReadCache, 1);
+
+    c->key = key;
+    QLIST_INIT(&c->users);
+    c->chunk_size = chunk_size;
+    qemu_mutex_init(&c->lock);
+    c->chunks = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&c->lru);
+
+    c->before_write.notify = read_cache_before_write_notify;
+    bdrv_add_before_write_notifier(child_bs, &c->before_write);
+
+    if (key) {
+        QLIST_INSERT_HEAD(&read_caches, c, next);
+    }
+    return c;
+}
+
+/* Size the cache for the user that needs the most chunks */
+static void read_cache_update_max_chunks(ReadCache *c)
+{
+    BDRVReadCacheState *s;
+    ReadCacheChunk *chunk;
+    uint64_t max_chunks = 1;
+
+    QLIST_FOREACH(s, &c->users, cache_user) {
+        max_chunks = MAX(max_chunks, s->max_chunks);
+    }
+
+    qemu_mutex_lock(&c->lock);
+    c->max_chunks = max_chunks;
+    while (c->nb_chunks > c->max_chunks &&
+           (chunk = QTAILQ_LAST(&c->lru))) {
+        read_cache_drop_chunk(c, chunk);
+    }
+    qemu_mutex_unlock(&c->lock);
+}
+
+static void read_cache_add_user(ReadCache *c, BDRVReadCacheState *s)
+{
+    s->cache = c;
+    QLIST_INSERT_HEAD(&c->users, s, cache_user);
+    read_cache_update_max_chunks(c);
+}
+
+static void read_cache_remove_user(ReadCache *c, BDRVReadCacheState *s)
+{
+    ReadCacheChunk *chunk, *next;
+
+    QLIST_REMOVE(s, cache_user);
+    s->cache = NULL;
+    if (!QLIST_EMPTY(&c->users)) {
+        read_cache_update_max_chunks(c);
+        return;
+    }
+
+    if (c->key) {
+        QLIST_REMOVE(c, next);
+    }
+    notifier_with_return_remove(&c->before_write);
+
+    QTAILQ_FOREACH_SAFE(chunk, &c->lru, lru_entry, next) {
+        read_cache_drop_chunk(c, chunk);
+    }
+    assert(c->nb_chunks == 0);
+    g_hash_table_destroy(c->chunks);
+    qemu_mutex_destroy(&c->lock);
+    g_free(c);
+}
+
+static int read_cache_parse_opts(QDict *options, ReadCacheOpts *o,
+                                 Error **errp)
+{
+    Error *local_err = NULL;
+    QemuOpts *opts;
+    int ret;
+
+    opts = qemu_opts_create(&read_cache_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    o->size = qemu_opt_get_size(opts, READ_CACHE_OPT_SIZE,
+                                READ_CACHE_DEFAULT_SIZE);
+    o->chunk_size = qemu_opt_get_size(opts, READ_CACHE_OPT_CHUNK_SIZE,
+                                      READ_CACHE_DEFAULT_CHUNK_SIZE);
+    o->prefetch = qemu_opt_get_number(opts, READ_CACHE_OPT_PREFETCH,
+                                      READ_CACHE_DEFAULT_PREFETCH);
+    o->shared = qemu_opt_get_bool(opts, READ_CACHE_OPT_SHARED, true);
+
+    if (o->chunk_size < BDRV_SECTOR_SIZE || o->chunk_size > 64 * MiB ||
+        !is_power_of_2(o->chunk_size)) {
+        error_setg(errp, "chunk-size must be a power of two between %d "
+                   "and %d", BDRV_SECTOR_SIZE, 64 * MiB);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (o->prefetch > 1024) {
+        error_setg(errp, "prefetch must be at most 1024");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    ret = 0;
+fail:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheOpts o;
+    ReadCache *c = NULL;
+    int ret;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file, false,
+                               errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    ret = read_cache_parse_opts(options, &o, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    s->prefetch = o.prefetch;
+    s->max_chunks = MAX(o.size / o.chunk_size, 1);
+
+    if (o.shared) {
+        QLIST_FOREACH(c, &read_caches, next) {
+            if (c->key == bs->file->bs) {
+                break;
+            }
+        }
+    }
+
+    if (c) {
+        if (c->chunk_size != o.chunk_size) {
+            error_setg(errp, "The cache shared with other read-cache nodes "
+                       "on '%s' uses a chunk-size of %" PRIu64,
+                       bdrv_get_node_name(bs->file->bs), c->chunk_size);
+            return -EINVAL;
+        }
+    } else {
+        c = read_cache_new(bs->file->bs, o.shared ? bs->file->bs : NULL,
+                           o.chunk_size);
+    }
+    read_cache_add_user(c, s);
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    return 0;
+}
+
+static int read_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                     BlockReopenQueue *queue, Error **errp)
+{
+    BDRVReadCacheState *s = reopen_state->bs->opaque;
+    ReadCache *c = s->cache;
+    ReadCacheOpts *o = g_new(ReadCacheOpts, 1);
+    int ret;
+
+    ret = read_cache_parse_opts(reopen_state->options, o, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (o->chunk_size != c->chunk_size) {
+        error_setg(errp, "Cannot change the chunk-size of a read-cache node");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (o->shared != !!c->key) {
+        error_setg(errp, "Cannot change whether a read-cache node is shared");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    reopen_state->opaque = o;
+    return 0;
+
+fail:
+    g_free(o);
+    return ret;
+}
+
+static void read_cache_reopen_commit(BDRVReopenState *reopen_state)
+{
+    BDRVReadCacheState *s = reopen_state->bs->opaque;
+    ReadCache *c = s->cache;
+    ReadCacheOpts *o = reopen_state->opaque;
+
+    s->prefetch = o->prefetch;
+    s->prefetch_end = 0;
+
+    /* A shared cache may still keep the budget of its other users */
+    s->max_chunks = MAX(o->size / o->chunk_size, 1);
+    read_cache_update_max_chunks(c);
+
+    g_free(reopen_state->opaque);
+    reopen_state->opaque = NULL;
+}
+
+static void read_cache_reopen_abort(BDRVReopenState *reopen_state)
+{
+    g_free(reopen_state->opaque);
+    reopen_state->opaque = NULL;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    read_cache_remove_user(s->cache, s);
+}
+
+static void read_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                  const BdrvChildRole *role,
+                                  BlockReopenQueue *reopen_queue,
+                                  uint64_t perm, uint64_t shared,
+                                  uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_filter_default_perms(bs, c, role, reopen_queue, perm, shared,
+                              nperm, nshared);
+
+    /* Writes by other parents invalidate the cached data, see
+     * read_cache_before_write_notify(), but resizing would not */
+    *nperm |= BLK_PERM_CONSISTENT_READ;
+    *nshared &= ~BLK_PERM_RESIZE;
+}
+
+static bool read_cache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                   BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static BlockDriver bdrv_read_cache = {
+    .format_name                        = "read-cache",
+    .instance_size                      = sizeof(BDRVReadCacheState),
+
+    .bdrv_open                          = read_cache_open,
+    .bdrv_close                         = read_cache_close,
+    .bdrv_reopen_prepare                = read_cache_reopen_prepare,
+    .bdrv_reopen_commit                 = read_cache_reopen_commit,
+    .bdrv_reopen_abort                  = read_cache_reopen_abort,
+    .bdrv_child_perm                    = read_cache_child_perm,
+
+    .bdrv_getlength                     = read_cache_getlength,
+    .bdrv_co_truncate                   = read_cache_co_truncate,
+
+    .bdrv_co_preadv                     = read_cache_co_preadv,
+    .bdrv_co_pwritev                    = read_cache_co_pwritev,
+    .bdrv_co_pwrite_zeroes              = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = read_cache_co_pdiscard,
+
+    .bdrv_co_block_status               = bdrv_co_block_status_from_file,
+
+    .bdrv_recurse_is_first_non_filter   = read_cache_recurse_is_first_non_filter,
+
+    .has_variable_length                = true,
+    .is_filter                          = true,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
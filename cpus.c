@@ -57,6 +57,9 @@
 #include "hw/nmi.h"
 #include "sysemu/replay.h"
 #include "hw/boards.h"
+#include "exec/memory.h"
+#include "qemu/plugin.h"
+#include "trace-root.h"
 
 #ifdef CONFIG_LINUX
 
@@ -87,6 +90,21 @@ static unsigned int throttle_percentage;
 #define CPU_THROTTLE_PCT_MAX 99
 #define CPU_THROTTLE_TIMESLICE_NS 10000000
 
+static QEMUTimer *dirty_limit_timer;
+/* Per-vCPU dirty page rate limit in MB/s, 0 if the limit is off */
+static uint64_t dirty_limit_quota;
+static int64_t dirty_limit_last_ms;
+
+#define CPU_DIRTY_LIMIT_PERIOD_MS 1000
+/*
+ * Longest sleep per full dirty ring.  It keeps vCPUs responsive, but also
+ * means that no vCPU can be slowed down below about four rings' worth of
+ * dirty pages per second.
+ */
+#define CPU_DIRTY_LIMIT_SLEEP_MAX_US 250000
+/* The sleep is cut short if the vCPU is stopped or kicked meanwhile */
+#define CPU_DIRTY_LIMIT_SLEEP_SLICE_US 10000
+
 bool cpu_is_stopped(CPUState *cpu)
 {
     return cpu->stopped || !runstate_is_running();
@@ -207,6 +225,8 @@ static bool default_mttcg_enabled(void)
 void qemu_tcg_configure(QemuOpts *opts, Error **errp)
 {
     const char *t = qemu_opt_get(opts, "thread");
+    uint64_t threshold;
+
     if (t) {
         if (strcmp(t, "multi") == 0) {
             if (TCG_OVERSIZED_GUEST) {
@@ -233,6 +253,14 @@ void qemu_tcg_configure(QemuOpts *opts, Error **errp)
     } else {
         mttcg_enabled = default_mttcg_enabled();
     }
+
+    threshold = qemu_opt_get_number(opts, "trace-threshold", 0);
+    if (threshold > INT32_MAX) {
+        error_setg(errp, "Invalid 'trace-threshold' setting %" PRIu64,
+                   threshold);
+        return;
+    }
+    tb_trace_threshold = threshold;
 }
 
 /* The current number of executed instructions is based on what we
@@ -843,6 +871,132 @@ int cpu_throttle_get_percentage(void)
     return atomic_read(&throttle_percentage);
 }
 
+/*
+ * A vCPU under the dirty limit sleeps each time its dirty ring fills up,
+ * so its dirty rate is ring_bytes / (fill_us + sleep_us), where fill_us
+ * is the time it needs to fill the ring when running unthrottled.  From
+ * the rate measured with the current sleep we derive fill_us, and from
+ * that the sleep which brings the rate to the quota.  The reaper thread
+ * keeps emptying the rings meanwhile, so vCPUs that dirty less than a
+ * ring per second never sleep at all.
+ */
+static void cpu_dirty_limit_adjust(CPUState *cpu, uint64_t rate)
+{
+    int64_t ring_bytes = (int64_t)kvm_dirty_ring_size() *
+                         qemu_real_host_page_size;
+    int64_t quota = atomic_read(&dirty_limit_quota) << 20;
+    int64_t sleep_us = cpu->throttle_us_per_full;
+    int64_t target_us, fill_us;
+
+    if (!rate) {
+        /* Idle (or asleep for the whole period): back off */
+        sleep_us /= 2;
+    } else {
+        fill_us = ring_bytes * G_USEC_PER_SEC / rate - sleep_us;
+        target_us = ring_bytes * G_USEC_PER_SEC / quota - MAX(fill_us, 0);
+        /* Move halfway to the target to damp oscillations */
+        sleep_us = (sleep_us + MAX(target_us, 0)) / 2;
+    }
+
+    sleep_us = MIN(sleep_us, CPU_DIRTY_LIMIT_SLEEP_MAX_US);
+    atomic_set(&cpu->throttle_us_per_full, sleep_us);
+}
+
+static void cpu_dirty_limit_timer_tick(void *opaque)
+{
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t period = now - dirty_limit_last_ms;
+    CPUState *cpu;
+
+    if (!cpu_dirty_limit_active()) {
+        return;
+    }
+
+    /* Collect the dirty rings, which accounts the pages to each vCPU */
+    memory_global_dirty_log_sync();
+
+    CPU_FOREACH(cpu) {
+        uint64_t pages = cpu->dirty_pages - cpu->dirty_pages_prev;
+        uint64_t rate = 0;
+
+        cpu->dirty_pages_prev = cpu->dirty_pages;
+        if (period > 0) {
+            rate = pages * qemu_real_host_page_size * 1000 / period;
+        }
+        cpu_dirty_limit_adjust(cpu, rate);
+        trace_cpu_dirty_limit_adjust(cpu->cpu_index, rate >> 20,
+                                     cpu->throttle_us_per_full);
+    }
+
+    dirty_limit_last_ms = now;
+    timer_mod(dirty_limit_timer, now + CPU_DIRTY_LIMIT_PERIOD_MS);
+}
+
+void cpu_dirty_limit_start(uint64_t quota)
+{
+    CPUState *cpu;
+
+    assert(quota);
+
+    if (!cpu_dirty_limit_active()) {
+        CPU_FOREACH(cpu) {
+            cpu->dirty_pages_prev = cpu->dirty_pages;
+            atomic_set(&cpu->throttle_us_per_full, 0);
+        }
+        dirty_limit_last_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        timer_mod(dirty_limit_timer,
+                  dirty_limit_last_ms + CPU_DIRTY_LIMIT_PERIOD_MS);
+    }
+
+    trace_cpu_dirty_limit_start(quota);
+    atomic_set(&dirty_limit_quota, quota);
+}
+
+void cpu_dirty_limit_stop(void)
+{
+    CPUState *cpu;
+
+    if (!cpu_dirty_limit_active()) {
+        return;
+    }
+
+    trace_cpu_dirty_limit_stop();
+    atomic_set(&dirty_limit_quota, 0);
+    timer_del(dirty_limit_timer);
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->throttle_us_per_full, 0);
+    }
+}
+
+bool cpu_dirty_limit_active(void)
+{
+    return atomic_read(&dirty_limit_quota) != 0;
+}
+
+static bool cpu_dirty_limit_interrupted(CPUState *cpu)
+{
+    return atomic_read(&cpu->stop) || atomic_read(&cpu->exit_request) ||
+           atomic_read(&cpu->queued_work_first);
+}
+
+void cpu_dirty_limit_throttle(CPUState *cpu)
+{
+    int64_t sleep_us;
+
+    if (!cpu_dirty_limit_active()) {
+        return;
+    }
+
+    sleep_us = atomic_read(&cpu->throttle_us_per_full);
+    if (sleep_us) {
+        trace_cpu_dirty_limit_throttle(cpu->cpu_index, sleep_us);
+    }
+    while (sleep_us > 0 && !cpu_dirty_limit_interrupted(cpu)) {
+        g_usleep(MIN(sleep_us, CPU_DIRTY_LIMIT_SLEEP_SLICE_US));
+        sleep_us -= CPU_DIRTY_LIMIT_SLEEP_SLICE_US;
+    }
+}
+
 void cpu_ticks_init(void)
 {
     seqlock_init(&timers_state.vm_clock_seqlock);
@@ -850,6 +1004,8 @@ void cpu_ticks_init(void)
     vmstate_register(NULL, 0, &vmstate_timers, &timers_state);
     throttle_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL_RT,
                                            cpu_throttle_timer_tick, NULL);
+    dirty_limit_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                     cpu_dirty_limit_timer_tick, NULL);
 }
 
 void configure_icount(QemuOpts *opts, Error **errp)
@@ -1960,6 +2116,7 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
     if (!tcg_region_inited) {
         tcg_region_inited = 1;
         tcg_region_init();
+        tb_cache_load();
     }
 
     if (qemu_tcg_mttcg_enabled() || !single_tcg_cpu_thread) {
@@ -2098,6 +2255,7 @@ void qemu_init_vcpu(CPUState *cpu)
     } else if (hvf_enabled()) {
         qemu_hvf_start_vcpu(cpu);
     } else if (tcg_enabled()) {
+        qemu_plugin_vcpu_init_hook(cpu);
         qemu_tcg_init_vcpu(cpu);
     } else if (whpx_enabled()) {
         qemu_whpx_start_vcpu(cpu);
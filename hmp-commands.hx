@@ -1155,6 +1155,22 @@ STEXI
 @findex migrate_start_postcopy
 Switch in-progress migration to postcopy mode. Ignored after the end of
 migration (or once already in postcopy).
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "second:l",
+        .params     = "second",
+        .help       = "start measuring the guest dirty page rate for "
+                      "'second' seconds",
+        .cmd        = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{second}
+@findex calc_dirty_rate
+Start measuring the rate at which the guest dirties its memory, over
+@var{second} seconds.  Use @code{info dirty_rate} for the result.
 ETEXI
 
     {
@@ -1,6 +1,15 @@
 /*
  * Dedicated thread for virtio-blk I/O processing
  *
+ * With the "iothreads" property (a colon-separated list of IOThread ids) the
+ * virtqueues are spread across several IOThreads: virtqueue i is served by
+ * the (i % n)-th IOThread of the list.  The BlockBackend still lives in a
+ * single AioContext, the "home" context (the one of the "iothread" property,
+ * or of the first IOThread in the list).  Requests popped by a remote
+ * IOThread are submitted to the home context and their completions are
+ * forwarded back to the IOThread serving the virtqueue, so that each vring is
+ * only ever touched by a single thread.
+ *
  * Copyright 2012 IBM, Corp.
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -25,6 +34,17 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
+typedef struct VirtIOBlockDataPlaneVq {
+    VirtIOBlockDataPlane *s;
+    VirtQueue *vq;
+    AioContext *ctx;                /* AioContext serving this virtqueue */
+
+    /* Completions forwarded from the home AioContext, only used if @ctx is
+     * not the home AioContext */
+    QEMUBH *complete_bh;
+    QSLIST_HEAD(, VirtIOBlockReq) complete_reqs;
+} VirtIOBlockDataPlaneVq;
+
 struct VirtIOBlockDataPlane {
     bool starting;
     bool stopping;
@@ -42,6 +62,12 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    IOThread **iothreads;           /* "iothreads" property, may be NULL */
+    unsigned num_iothreads;
+    AioContext **ctxs;              /* distinct AioContexts, home first */
+    unsigned num_ctxs;
+    VirtIOBlockDataPlaneVq *vqs;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
@@ -66,7 +92,7 @@ static void notify_guest_bh(void *opaque)
     memset(s->batch_notify_vqs, 0, sizeof(bitmap));
 
     for (j = 0; j < nvqs; j += BITS_PER_LONG) {
-        unsigned long bits = bitmap[j];
+        unsigned long bits = bitmap[j / BITS_PER_LONG];
 
         while (bits != 0) {
             unsigned i = j + ctzl(bits);
@@ -79,6 +105,84 @@ static void notify_guest_bh(void *opaque)
     }
 }
 
+/* Push completions forwarded from the home AioContext onto the vring
+ *
+ * Context: BH in the IOThread serving the virtqueue
+ */
+static void virtio_blk_data_plane_complete_bh(void *opaque)
+{
+    VirtIOBlockDataPlaneVq *dvq = opaque;
+    QSLIST_HEAD(, VirtIOBlockReq) reqs;
+    VirtIOBlockReq *req, *next;
+
+    QSLIST_MOVE_ATOMIC(&reqs, &dvq->complete_reqs);
+    if (QSLIST_EMPTY(&reqs)) {
+        return;
+    }
+
+    QSLIST_FOREACH_SAFE(req, &reqs, complete_next, next) {
+        virtqueue_push(dvq->vq, &req->elem, req->in_len);
+        g_free(req);
+    }
+    virtio_notify_irqfd(dvq->s->vdev, dvq->vq);
+}
+
+/* Hand a completed request over to the IOThread serving its virtqueue.
+ * Returns false if the virtqueue is served by the home AioContext, in which
+ * case the caller completes the request itself.
+ *
+ * Context: home AioContext acquired
+ */
+bool virtio_blk_data_plane_forward_complete(VirtIOBlockDataPlane *s,
+                                            VirtIOBlockReq *req)
+{
+    VirtIOBlockDataPlaneVq *dvq = &s->vqs[virtio_get_queue_index(req->vq)];
+
+    if (dvq->ctx == s->ctx) {
+        return false;
+    }
+
+    QSLIST_INSERT_HEAD_ATOMIC(&dvq->complete_reqs, req, complete_next);
+    qemu_bh_schedule(dvq->complete_bh);
+    return true;
+}
+
+/* Resolve the colon-separated "iothreads" property */
+static bool virtio_blk_data_plane_get_iothreads(VirtIOBlkConf *conf,
+                                                IOThread ***iothreads,
+                                                unsigned *num_iothreads,
+                                                Error **errp)
+{
+    gchar **ids = g_strsplit(conf->iothreads, ":", -1);
+    unsigned n = g_strv_length(ids);
+    unsigned i;
+
+    *iothreads = NULL;
+    *num_iothreads = 0;
+
+    if (n == 0) {
+        error_setg(errp, "iothreads must list at least one IOThread");
+        g_strfreev(ids);
+        return false;
+    }
+
+    *iothreads = g_new0(IOThread *, n);
+    for (i = 0; i < n; i++) {
+        (*iothreads)[i] = iothread_by_id(ids[i]);
+        if (!(*iothreads)[i]) {
+            error_setg(errp, "IOThread '%s' not found", ids[i]);
+            g_free(*iothreads);
+            *iothreads = NULL;
+            g_strfreev(ids);
+            return false;
+        }
+    }
+
+    *num_iothreads = n;
+    g_strfreev(ids);
+    return true;
+}
+
 /* Context: QEMU global mutex held */
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -87,18 +191,29 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    IOThread **iothreads = NULL;
+    unsigned num_iothreads = 0;
+    unsigned i, j;
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothreads &&
+        !virtio_blk_data_plane_get_iothreads(conf, &iothreads, &num_iothreads,
+                                             errp)) {
+        return false;
+    }
+
+    if (conf->iothread || iothreads) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
                        "(transport does not support notifiers)");
+            g_free(iothreads);
             return false;
         }
         if (!virtio_device_ioeventfd_enabled(vdev)) {
             error_setg(errp, "ioeventfd is required for iothread");
+            g_free(iothreads);
             return false;
         }
 
@@ -107,6 +222,7 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
          */
         if (blk_op_is_blocked(conf->conf.blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
             error_prepend(errp, "cannot start virtio-blk dataplane: ");
+            g_free(iothreads);
             return false;
         }
     }
@@ -119,8 +235,8 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s->vdev = vdev;
     s->conf = conf;
 
-    if (conf->iothread) {
-        s->iothread = conf->iothread;
+    if (conf->iothread || iothreads) {
+        s->iothread = conf->iothread ? conf->iothread : iothreads[0];
         object_ref(OBJECT(s->iothread));
         s->ctx = iothread_get_aio_context(s->iothread);
     } else {
@@ -129,6 +245,40 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
 
+    s->iothreads = iothreads;
+    s->num_iothreads = num_iothreads;
+    for (i = 0; i < num_iothreads; i++) {
+        object_ref(OBJECT(iothreads[i]));
+    }
+
+    s->ctxs = g_new(AioContext *, conf->num_queues + 1);
+    s->ctxs[s->num_ctxs++] = s->ctx;
+    s->vqs = g_new0(VirtIOBlockDataPlaneVq, conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        VirtIOBlockDataPlaneVq *dvq = &s->vqs[i];
+
+        dvq->s = s;
+        dvq->vq = virtio_get_queue(vdev, i);
+        dvq->ctx = iothreads ?
+                   iothread_get_aio_context(iothreads[i % num_iothreads]) :
+                   s->ctx;
+        QSLIST_INIT(&dvq->complete_reqs);
+        if (dvq->ctx != s->ctx) {
+            dvq->complete_bh = aio_bh_new(dvq->ctx,
+                                          virtio_blk_data_plane_complete_bh,
+                                          dvq);
+        }
+
+        for (j = 0; j < s->num_ctxs; j++) {
+            if (s->ctxs[j] == dvq->ctx) {
+                break;
+            }
+        }
+        if (j == s->num_ctxs) {
+            s->ctxs[s->num_ctxs++] = dvq->ctx;
+        }
+    }
+
     *dataplane = s;
 
     return true;
@@ -138,6 +288,7 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
     VirtIOBlock *vblk;
+    unsigned i;
 
     if (!s) {
         return;
@@ -145,6 +296,18 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
+    for (i = 0; i < s->conf->num_queues; i++) {
+        if (s->vqs[i].complete_bh) {
+            assert(QSLIST_EMPTY(&s->vqs[i].complete_reqs));
+            qemu_bh_delete(s->vqs[i].complete_bh);
+        }
+    }
+    g_free(s->vqs);
+    g_free(s->ctxs);
+    for (i = 0; i < s->num_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
+    }
+    g_free(s->iothreads);
     g_free(s->batch_notify_vqs);
     qemu_bh_delete(s->bh);
     if (s->iothread) {
@@ -227,14 +390,14 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
-        VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        VirtIOBlockDataPlaneVq *dvq = &s->vqs[i];
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(dvq->ctx);
+        virtio_queue_aio_set_host_notifier_handler(dvq->vq, dvq->ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(dvq->ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -244,19 +407,38 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     return -ENOSYS;
 }
 
-/* Stop notifications for new requests from guest.
+/* Stop notifications for new requests from guest on the virtqueues served
+ * by the current AioContext.
  *
  * Context: BH in IOThread
  */
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
     unsigned i;
 
     for (i = 0; i < s->conf->num_queues; i++) {
-        VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        if (s->vqs[i].ctx == ctx) {
+            virtio_queue_aio_set_host_notifier_handler(s->vqs[i].vq, ctx, NULL);
+        }
+    }
+}
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+/* Push the completions that were forwarded while draining.
+ *
+ * Context: BH in IOThread
+ */
+static void virtio_blk_data_plane_flush_bh(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+    unsigned i;
+
+    for (i = 0; i < s->conf->num_queues; i++) {
+        if (s->vqs[i].ctx == ctx) {
+            virtio_blk_data_plane_complete_bh(&s->vqs[i]);
+        }
     }
 }
 
@@ -283,8 +465,13 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    for (i = 0; i < s->num_ctxs; i++) {
+        aio_context_acquire(s->ctxs[i]);
+        aio_wait_bh_oneshot(s->ctxs[i], virtio_blk_data_plane_stop_bh, s);
+        aio_context_release(s->ctxs[i]);
+    }
+
     aio_context_acquire(s->ctx);
-    aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
 
     /* Drain and try to switch bs back to the QEMU main loop. If other users
      * keep the BlockBackend in the iothread, that's ok */
@@ -292,6 +479,14 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
 
     aio_context_release(s->ctx);
 
+    /* Completions of the drained requests may still be queued for the other
+     * IOThreads */
+    for (i = 1; i < s->num_ctxs; i++) {
+        aio_context_acquire(s->ctxs[i]);
+        aio_wait_bh_oneshot(s->ctxs[i], virtio_blk_data_plane_flush_bh, s);
+        aio_context_release(s->ctxs[i]);
+    }
+
     for (i = 0; i < nvqs; i++) {
         virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
         virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
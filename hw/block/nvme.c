@@ -19,10 +19,15 @@
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>, \
  *              cmb_size_mb=<cmb_size_mb[optional]>, \
- *              num_queues=<N[optional]>
+ *              num_queues=<N[optional]>, iothread=<iothread_id[optional]>
  *
  * Note cmb_size_mb denotes size of CMB in MB. CMB is assumed to be at
  * offset 0 in BAR2 and supports only WDS, RDS and SQS for now.
+ *
+ * With iothread, I/O queues are processed in that IOThread's AioContext.
+ * Once the guest has configured shadow doorbells with the Doorbell Buffer
+ * Config command, I/O submission queue doorbells are bound to ioeventfds
+ * and handled there too; the admin queue always runs in the main loop.
  */
 
 #include "qemu/osdep.h"
@@ -39,9 +44,16 @@
 #include "qemu/log.h"
 #include "qemu/module.h"
 #include "qemu/cutils.h"
+#include "qemu/main-loop.h"
+#include "block/aio-wait.h"
 #include "trace.h"
 #include "nvme.h"
 
+/* Descriptors read from guest memory at once while walking an SGL segment */
+#define NVME_SGL_SEGMENT_DESCRS 256
+/* Upper bound on the number of descriptors in a single SGL */
+#define NVME_SGL_MAX_DESCRS     4096
+
 #define NVME_GUEST_ERR(trace, fmt, ...) \
     do { \
         (trace_##trace)(__VA_ARGS__); \
@@ -51,10 +63,15 @@
 
 static void nvme_process_sq(void *opaque);
 
+static bool nvme_addr_is_cmb(NvmeCtrl *n, hwaddr addr)
+{
+    return n->cmbsz && addr >= n->ctrl_mem.addr &&
+        addr < (n->ctrl_mem.addr + int128_get64(n->ctrl_mem.size));
+}
+
 static void nvme_addr_read(NvmeCtrl *n, hwaddr addr, void *buf, int size)
 {
-    if (n->cmbsz && addr >= n->ctrl_mem.addr &&
-                addr < (n->ctrl_mem.addr + int128_get64(n->ctrl_mem.size))) {
+    if (nvme_addr_is_cmb(n, addr)) {
         memcpy(buf, (void *)&n->cmbuf[addr - n->ctrl_mem.addr], size);
     } else {
         pci_dma_read(&n->parent_obj, addr, buf, size);
@@ -220,6 +237,166 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, QEMUIOVector *iov, uint64_t prp1,
     return NVME_INVALID_FIELD | NVME_DNR;
 }
 
+static uint16_t nvme_map_sgl_data(NvmeCtrl *n, QEMUSGList *qsg,
+                                  QEMUIOVector *iov, NvmeSglDescriptor *desc,
+                                  uint32_t *len, bool *mapped)
+{
+    uint64_t addr = le64_to_cpu(desc->addr);
+    uint32_t trans_len = MIN(*len, le32_to_cpu(desc->len));
+    bool cmb = nvme_addr_is_cmb(n, addr);
+
+    if (unlikely(NVME_SGL_SUBTYPE(desc->type))) {
+        trace_nvme_err_invalid_sgl_descr(desc->type);
+        return NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+    }
+    if (!trans_len) {
+        return NVME_SUCCESS;
+    }
+
+    /* As with PRPs, a transfer is either entirely in the CMB or not at all */
+    if (!*mapped) {
+        if (cmb) {
+            qsg->nsg = 0;
+            qemu_iovec_init(iov, 1);
+        } else {
+            pci_dma_sglist_init(qsg, &n->parent_obj, 1);
+        }
+        *mapped = true;
+    } else if (unlikely(cmb != !qsg->nsg)) {
+        trace_nvme_err_invalid_sgl_cmb(addr);
+        return NVME_INVALID_USE_OF_CMB | NVME_DNR;
+    }
+
+    if (cmb) {
+        if (unlikely(!nvme_addr_is_cmb(n, addr + trans_len - 1))) {
+            trace_nvme_err_invalid_sgl_cmb(addr);
+            return NVME_INVALID_USE_OF_CMB | NVME_DNR;
+        }
+        qemu_iovec_add(iov, (void *)&n->cmbuf[addr - n->ctrl_mem.addr],
+                       trans_len);
+    } else {
+        qemu_sglist_add(qsg, addr, trans_len);
+    }
+    *len -= trans_len;
+    return NVME_SUCCESS;
+}
+
+/*
+ * Walk the scatter gather list starting at @sgl, the descriptor embedded in
+ * the command, and map @len bytes of data blocks into @qsg or @iov.  Bit
+ * bucket descriptors are not supported.  The number of descriptors is
+ * bounded so that a list that loops back onto itself cannot stall the
+ * queue.
+ */
+static uint16_t nvme_map_sgl(NvmeCtrl *n, QEMUSGList *qsg, QEMUIOVector *iov,
+                             NvmeSglDescriptor *sgl, uint32_t len)
+{
+    NvmeSglDescriptor segment[NVME_SGL_SEGMENT_DESCRS];
+    NvmeSglDescriptor desc = *sgl;
+    uint32_t remaining = len;
+    uint32_t ndescs = 0;
+    bool mapped = false;
+    uint16_t status = NVME_SUCCESS;
+
+    trace_nvme_map_sgl(NVME_SGL_TYPE(desc.type), len);
+
+    for (;;) {
+        uint8_t type = NVME_SGL_TYPE(desc.type);
+        uint64_t addr = le64_to_cpu(desc.addr);
+        uint32_t nsgld = le32_to_cpu(desc.len) / sizeof(NvmeSglDescriptor);
+        bool last_segment = type == NVME_SGL_DESCR_TYPE_LAST_SEGMENT;
+        bool chained = false;
+
+        if (type == NVME_SGL_DESCR_TYPE_DATA_BLOCK) {
+            status = nvme_map_sgl_data(n, qsg, iov, &desc, &remaining, &mapped);
+            break;
+        }
+        if (unlikely(type != NVME_SGL_DESCR_TYPE_SEGMENT && !last_segment)) {
+            trace_nvme_err_invalid_sgl_descr(desc.type);
+            status = NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+            break;
+        }
+        if (unlikely(!nsgld ||
+                     le32_to_cpu(desc.len) % sizeof(NvmeSglDescriptor) ||
+                     ndescs + nsgld > NVME_SGL_MAX_DESCRS)) {
+            trace_nvme_err_invalid_sgl_segment(addr, le32_to_cpu(desc.len));
+            status = NVME_INVALID_NUM_SGL_DESCRS | NVME_DNR;
+            break;
+        }
+        ndescs += nsgld;
+
+        while (nsgld && !chained && !status) {
+            uint32_t nread = MIN(nsgld, NVME_SGL_SEGMENT_DESCRS);
+            int i;
+
+            nvme_addr_read(n, addr, segment, nread * sizeof(*segment));
+            for (i = 0; i < nread; i++) {
+                type = NVME_SGL_TYPE(segment[i].type);
+                if (type == NVME_SGL_DESCR_TYPE_DATA_BLOCK) {
+                    status = nvme_map_sgl_data(n, qsg, iov, &segment[i],
+                                               &remaining, &mapped);
+                    if (status) {
+                        break;
+                    }
+                    continue;
+                }
+
+                /* Only the last descriptor of a segment may chain */
+                if (!last_segment && nread == nsgld && i == nread - 1 &&
+                    (type == NVME_SGL_DESCR_TYPE_SEGMENT ||
+                     type == NVME_SGL_DESCR_TYPE_LAST_SEGMENT)) {
+                    desc = segment[i];
+                    chained = true;
+                    break;
+                }
+
+                trace_nvme_err_invalid_sgl_descr(segment[i].type);
+                status = NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+                break;
+            }
+            nsgld -= nread;
+            addr += nread * sizeof(*segment);
+        }
+
+        if (status || !chained) {
+            break;
+        }
+    }
+
+    if (!status && remaining) {
+        trace_nvme_err_invalid_sgl_length(len, len - remaining);
+        status = NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+    }
+    if (status && mapped) {
+        if (qsg->nsg) {
+            qemu_sglist_destroy(qsg);
+        } else {
+            qemu_iovec_destroy(iov);
+        }
+    }
+    return status;
+}
+
+static uint16_t nvme_map_dptr(NvmeCtrl *n, NvmeRwCmd *rw, QEMUSGList *qsg,
+                              QEMUIOVector *iov, uint32_t len)
+{
+    uint8_t psdt = NVME_CMD_FLAGS_PSDT(rw->flags);
+
+    switch (psdt) {
+    case NVME_PSDT_PRP:
+        if (nvme_map_prp(qsg, iov, le64_to_cpu(rw->prp1),
+                         le64_to_cpu(rw->prp2), len, n)) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        return NVME_SUCCESS;
+    case NVME_PSDT_SGL_MPTR_CONTIGUOUS:
+        return nvme_map_sgl(n, qsg, iov, &rw->sgl, len);
+    default:
+        trace_nvme_err_invalid_psdt(psdt);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+}
+
 static uint16_t nvme_dma_write_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
                                    uint64_t prp1, uint64_t prp2)
 {
@@ -272,16 +449,63 @@ static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     return status;
 }
 
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    uint32_t v;
+
+    pci_dma_read(&cq->ctrl->parent_obj, cq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (unlikely(v >= cq->size)) {
+        trace_nvme_err_invalid_shadow_cqhead(cq->cqid, v);
+        return;
+    }
+    cq->head = v;
+}
+
+static void nvme_update_cq_eventidx(NvmeCQueue *cq)
+{
+    uint32_t v = cpu_to_le32(cq->head);
+
+    pci_dma_write(&cq->ctrl->parent_obj, cq->ei_addr, &v, sizeof(v));
+}
+
+static void nvme_irq_bh(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+    NvmeCtrl *n = cq->ctrl;
+
+    aio_context_acquire(n->ctx);
+    if (cq->tail != cq->head) {
+        nvme_irq_assert(n, cq);
+    }
+    aio_context_release(n->ctx);
+}
+
 static void nvme_post_cqes(void *opaque)
 {
     NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
 
+    aio_context_acquire(n->ctx);
+    if (cq->db_addr) {
+        nvme_update_cq_head(cq);
+    }
+
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
         hwaddr addr;
 
+        if (nvme_cq_full(cq) && cq->ei_addr) {
+            /*
+             * The guest only rings the doorbell once it moves the head
+             * past the event index, so ask to be kicked when it does.
+             * It may have moved the head before the event index became
+             * visible, so read the head again afterwards.
+             */
+            nvme_update_cq_eventidx(cq);
+            nvme_update_cq_head(cq);
+        }
         if (nvme_cq_full(cq)) {
             break;
         }
@@ -298,8 +522,14 @@ static void nvme_post_cqes(void *opaque)
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
     }
     if (cq->tail != cq->head) {
-        nvme_irq_assert(n, cq);
+        /* Interrupts are raised from the main loop */
+        if (cq->irq_bh) {
+            qemu_bh_schedule(cq->irq_bh);
+        } else {
+            nvme_irq_assert(n, cq);
+        }
     }
+    aio_context_release(n->ctx);
 }
 
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
@@ -307,7 +537,7 @@ static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
     assert(cq->cqid == req->sq->cqid);
     QTAILQ_REMOVE(&req->sq->out_req_list, req, entry);
     QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
-    timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    qemu_bh_schedule(cq->bh);
 }
 
 static void nvme_rw_cb(void *opaque, int ret)
@@ -317,6 +547,7 @@ static void nvme_rw_cb(void *opaque, int ret)
     NvmeCtrl *n = sq->ctrl;
     NvmeCQueue *cq = n->cq[sq->cqid];
 
+    aio_context_acquire(n->ctx);
     if (!ret) {
         block_acct_done(blk_get_stats(n->conf.blk), &req->acct);
         req->status = NVME_SUCCESS;
@@ -328,6 +559,7 @@ static void nvme_rw_cb(void *opaque, int ret)
         qemu_sglist_destroy(&req->qsg);
     }
     nvme_enqueue_req_completion(cq, req);
+    aio_context_release(n->ctx);
 }
 
 static uint16_t nvme_flush(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
@@ -371,8 +603,6 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
     uint32_t nlb  = le32_to_cpu(rw->nlb) + 1;
     uint64_t slba = le64_to_cpu(rw->slba);
-    uint64_t prp1 = le64_to_cpu(rw->prp1);
-    uint64_t prp2 = le64_to_cpu(rw->prp2);
 
     uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
     uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
@@ -380,6 +610,7 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     uint64_t data_offset = slba << data_shift;
     int is_write = rw->opcode == NVME_CMD_WRITE ? 1 : 0;
     enum BlockAcctType acct = is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ;
+    uint16_t status;
 
     trace_nvme_rw(is_write ? "write" : "read", nlb, data_size, slba);
 
@@ -389,9 +620,10 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
         return NVME_LBA_RANGE | NVME_DNR;
     }
 
-    if (nvme_map_prp(&req->qsg, &req->iov, prp1, prp2, data_size, n)) {
+    status = nvme_map_dptr(n, rw, &req->qsg, &req->iov, data_size);
+    if (status) {
         block_acct_invalid(blk_get_stats(n->conf.blk), acct);
-        return NVME_INVALID_FIELD | NVME_DNR;
+        return status;
     }
 
     dma_acct_start(n->conf.blk, &req->acct, &req->qsg, acct);
@@ -439,17 +671,96 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     }
 }
 
-static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
+static AioContext *nvme_queue_aio_context(NvmeCtrl *n, uint16_t qid)
 {
-    n->sq[sq->sqid] = NULL;
-    timer_del(sq->timer);
-    timer_free(sq->timer);
+    /* Admin commands reconfigure the device and need the BQL */
+    return qid ? n->ctx : qemu_get_aio_context();
+}
+
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_process_sq(sq);
+    }
+}
+
+/*
+ * With shadow doorbells the tail is read from guest memory, so writes to
+ * the doorbell register only need to wake us up and can go through an
+ * ioeventfd instead of exiting to the MMIO handler.
+ */
+static void nvme_init_sq_ioeventfd(NvmeSQueue *sq)
+{
+    NvmeCtrl *n = sq->ctrl;
+
+    if (sq->ioeventfd_enabled || event_notifier_init(&sq->notifier, 0) < 0) {
+        return;
+    }
+    aio_set_event_notifier(n->ctx, &sq->notifier, true, nvme_sq_notifier,
+                           NULL);
+    memory_region_add_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4, false,
+                              0, &sq->notifier);
+    sq->ioeventfd_enabled = true;
+}
+
+static void nvme_free_sq_ioeventfd(NvmeSQueue *sq)
+{
+    NvmeCtrl *n = sq->ctrl;
+
+    if (!sq->ioeventfd_enabled) {
+        return;
+    }
+    memory_region_del_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4, false,
+                              0, &sq->notifier);
+    aio_set_event_notifier(n->ctx, &sq->notifier, true, NULL, NULL);
+    event_notifier_cleanup(&sq->notifier);
+    sq->ioeventfd_enabled = false;
+}
+
+static void nvme_init_sq_dbbuf(NvmeSQueue *sq, NvmeCtrl *n)
+{
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    pci_dma_write(&n->parent_obj, sq->db_addr, &v, sizeof(v));
+    nvme_init_sq_ioeventfd(sq);
+}
+
+static void nvme_init_cq_dbbuf(NvmeCQueue *cq, NvmeCtrl *n)
+{
+    uint32_t v = cpu_to_le32(cq->head);
+
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+    pci_dma_write(&n->parent_obj, cq->db_addr, &v, sizeof(v));
+}
+
+static void nvme_free_sq_bh(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+
+    qemu_bh_delete(sq->bh);
     g_free(sq->io_req);
     if (sq->sqid) {
         g_free(sq);
     }
 }
 
+static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
+{
+    n->sq[sq->sqid] = NULL;
+    nvme_free_sq_ioeventfd(sq);
+    if (sq->sqid && n->iothread) {
+        /* Its BH may be about to run in the IOThread, so free it there */
+        aio_wait_bh_oneshot(n->ctx, nvme_free_sq_bh, sq);
+    } else {
+        nvme_free_sq_bh(sq);
+    }
+}
+
 static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd)
 {
     NvmeDeleteQ *c = (NvmeDeleteQ *)cmd;
@@ -465,12 +776,17 @@ static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd)
 
     trace_nvme_del_sq(qid);
 
+    /*
+     * Stop fetching commands from the queue.  blk_aio_cancel() cannot wait
+     * for requests in an IOThread, so let outstanding commands complete
+     * instead of aborting them.
+     */
     sq = n->sq[qid];
-    while (!QTAILQ_EMPTY(&sq->out_req_list)) {
-        req = QTAILQ_FIRST(&sq->out_req_list);
-        assert(req->aiocb);
-        blk_aio_cancel(req->aiocb);
+    n->sq[qid] = NULL;
+    if (!QTAILQ_EMPTY(&sq->out_req_list)) {
+        blk_drain(n->conf.blk);
     }
+    assert(QTAILQ_EMPTY(&sq->out_req_list));
     if (!nvme_check_cqid(n, sq->cqid)) {
         cq = n->cq[sq->cqid];
         QTAILQ_REMOVE(&cq->sq_list, sq, entry);
@@ -508,12 +824,18 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    sq->bh = aio_bh_new(nvme_queue_aio_context(n, sqid), nvme_process_sq, sq);
+    sq->db_addr = sq->ei_addr = 0;
+    sq->ioeventfd_enabled = false;
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+
+    if (sqid && n->dbbuf_enabled) {
+        nvme_init_sq_dbbuf(sq, n);
+    }
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -554,14 +876,27 @@ static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
     return NVME_SUCCESS;
 }
 
+static void nvme_free_cq_bh(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    qemu_bh_delete(cq->bh);
+    if (cq->cqid) {
+        g_free(cq);
+    }
+}
+
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     n->cq[cq->cqid] = NULL;
-    timer_del(cq->timer);
-    timer_free(cq->timer);
+    if (cq->irq_bh) {
+        qemu_bh_delete(cq->irq_bh);
+    }
     msix_vector_unuse(&n->parent_obj, cq->vector);
-    if (cq->cqid) {
-        g_free(cq);
+    if (cq->cqid && n->iothread) {
+        aio_wait_bh_oneshot(n->ctx, nvme_free_cq_bh, cq);
+    } else {
+        nvme_free_cq_bh(cq);
     }
 }
 
@@ -602,7 +937,16 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    cq->bh = aio_bh_new(nvme_queue_aio_context(n, cqid), nvme_post_cqes, cq);
+    cq->irq_bh = NULL;
+    if (cqid && n->iothread) {
+        cq->irq_bh = qemu_bh_new(nvme_irq_bh, cq);
+    }
+    cq->db_addr = cq->ei_addr = 0;
+
+    if (cqid && n->dbbuf_enabled) {
+        nvme_init_cq_dbbuf(cq, n);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -843,6 +1187,37 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     return NVME_SUCCESS;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    trace_nvme_dbbuf_config(dbs_addr, eis_addr);
+
+    if (unlikely(!dbs_addr || dbs_addr & (n->page_size - 1) ||
+                 !eis_addr || eis_addr & (n->page_size - 1))) {
+        trace_nvme_err_invalid_dbbuf(dbs_addr, eis_addr);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+
+    /* The admin queue keeps using the doorbell registers */
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->cq[i]) {
+            nvme_init_cq_dbbuf(n->cq[i], n);
+        }
+        if (n->sq[i]) {
+            nvme_init_sq_dbbuf(n->sq[i], n);
+        }
+    }
+
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -860,23 +1235,57 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         trace_nvme_err_invalid_admin_opc(cmd->opcode);
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
 }
 
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t v;
+
+    pci_dma_read(&sq->ctrl->parent_obj, sq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (unlikely(v >= sq->size)) {
+        trace_nvme_err_invalid_shadow_sqtail(sq->sqid, v);
+        return;
+    }
+    sq->tail = v;
+}
+
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    pci_dma_write(&sq->ctrl->parent_obj, sq->ei_addr, &v, sizeof(v));
+}
+
 static void nvme_process_sq(void *opaque)
 {
     NvmeSQueue *sq = opaque;
     NvmeCtrl *n = sq->ctrl;
-    NvmeCQueue *cq = n->cq[sq->cqid];
+    NvmeCQueue *cq;
 
     uint16_t status;
     hwaddr addr;
     NvmeCmd cmd;
     NvmeRequest *req;
 
+    aio_context_acquire(n->ctx);
+    if (unlikely(!NVME_CC_EN(n->bar.cc) || n->sq[sq->sqid] != sq)) {
+        /* The queue is being deleted */
+        aio_context_release(n->ctx);
+        return;
+    }
+
+    cq = n->cq[sq->cqid];
+    if (sq->db_addr) {
+        nvme_update_sq_tail(sq);
+    }
+
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
         nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd));
@@ -894,13 +1303,26 @@ static void nvme_process_sq(void *opaque)
             req->status = status;
             nvme_enqueue_req_completion(cq, req);
         }
+
+        /*
+         * Publish how far we got, then pick up entries that the guest
+         * queued meanwhile without ringing the doorbell.
+         */
+        if (sq->db_addr) {
+            nvme_update_sq_eventidx(sq);
+            nvme_update_sq_tail(sq);
+        }
     }
+    aio_context_release(n->ctx);
 }
 
 static void nvme_clear_ctrl(NvmeCtrl *n)
 {
     int i;
 
+    aio_context_acquire(n->ctx);
+    /* Stop fetching commands before waiting for the ones in flight */
+    n->bar.cc = 0;
     blk_drain(n->conf.blk);
 
     for (i = 0; i < n->num_queues; i++) {
@@ -913,9 +1335,11 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
             nvme_free_cq(n->cq[i], n);
         }
     }
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
+    n->dbbuf_enabled = false;
+    aio_context_release(n->ctx);
 
     blk_flush(n->conf.blk);
-    n->bar.cc = 0;
 }
 
 static int nvme_start_ctrl(NvmeCtrl *n)
@@ -1220,9 +1644,9 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         if (start_sqs) {
             NvmeSQueue *sq;
             QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+                qemu_bh_schedule(sq->bh);
             }
-            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+            qemu_bh_schedule(cq->bh);
         }
 
         if (cq->tail == cq->head) {
@@ -1254,7 +1678,7 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         }
 
         sq->tail = new_tail;
-        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        qemu_bh_schedule(sq->bh);
     }
 }
 
@@ -1265,7 +1689,9 @@ static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
     if (addr < sizeof(n->bar)) {
         nvme_write_bar(n, addr, data, size);
     } else if (addr >= 0x1000) {
+        aio_context_acquire(n->ctx);
         nvme_process_db(n, addr, data);
+        aio_context_release(n->ctx);
     }
 }
 
@@ -1337,6 +1763,15 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
         return;
     }
 
+    if (n->iothread) {
+        n->ctx = iothread_get_aio_context(n->iothread);
+        if (blk_set_aio_context(n->conf.blk, n->ctx, errp) < 0) {
+            return;
+        }
+    } else {
+        n->ctx = qemu_get_aio_context();
+    }
+
     pci_conf = pci_dev->config;
     pci_conf[PCI_INTERRUPT_PIN] = 1;
     pci_config_set_prog_interface(pci_dev->config, 0x2);
@@ -1367,13 +1802,14 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
     id->cqes = (0x4 << 4) | 0x4;
     id->nn = cpu_to_le32(n->num_namespaces);
     id->oncs = cpu_to_le16(NVME_ONCS_WRITE_ZEROS | NVME_ONCS_TIMESTAMP);
+    id->sgls = cpu_to_le32(NVME_SGLS_SUPPORTED);
     id->psd[0].mp = cpu_to_le16(0x9c4);
     id->psd[0].enlat = cpu_to_le32(0x10);
     id->psd[0].exlat = cpu_to_le32(0x4);
@@ -1438,6 +1874,11 @@ static void nvme_exit(PCIDevice *pci_dev)
     NvmeCtrl *n = NVME(pci_dev);
 
     nvme_clear_ctrl(n);
+    if (n->iothread) {
+        aio_context_acquire(n->ctx);
+        blk_set_aio_context(n->conf.blk, qemu_get_aio_context(), NULL);
+        aio_context_release(n->ctx);
+    }
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
@@ -1453,6 +1894,8 @@ static Property nvme_props[] = {
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
     DEFINE_PROP_UINT32("cmb_size_mb", NvmeCtrl, cmb_size_mb, 0),
     DEFINE_PROP_UINT32("num_queues", NvmeCtrl, num_queues, 64),
+    DEFINE_PROP_LINK("iothread", NvmeCtrl, iothread, TYPE_IOTHREAD,
+                     IOThread *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
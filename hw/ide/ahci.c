@@ -1024,6 +1024,7 @@ static void ncq_cb(void *opaque, int ret)
 
     ncq_tfs->aiocb = NULL;
     if (ret == -ECANCELED) {
+        block_acct_cancel(blk_get_stats(ide_state->blk), &ncq_tfs->acct);
         return;
     }
 
@@ -1034,6 +1035,8 @@ static void ncq_cb(void *opaque, int ret)
         if (action == BLOCK_ERROR_ACTION_STOP) {
             ncq_tfs->halt = true;
             ide_state->bus->error_status = IDE_RETRY_HBA;
+            /* The restarted command is accounted again */
+            block_acct_cancel(blk_get_stats(ide_state->blk), &ncq_tfs->acct);
         } else if (action == BLOCK_ERROR_ACTION_REPORT) {
             ncq_err(ncq_tfs);
         }
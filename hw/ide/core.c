@@ -723,6 +723,7 @@ static void ide_sector_read_cb(void *opaque, int ret)
     s->status &= ~BUSY_STAT;
 
     if (ret == -ECANCELED) {
+        block_acct_cancel(blk_get_stats(s->blk), &s->acct);
         return;
     }
     if (ret != 0) {
@@ -818,6 +819,8 @@ int ide_handle_rw_error(IDEState *s, int error, int op)
     if (action == BLOCK_ERROR_ACTION_STOP) {
         assert(s->bus->retry_unit == s->unit);
         s->bus->error_status = op;
+        /* The restarted request is accounted again */
+        block_acct_cancel(blk_get_stats(s->blk), &s->acct);
     } else if (action == BLOCK_ERROR_ACTION_REPORT) {
         block_acct_failed(blk_get_stats(s->blk), &s->acct);
         if (IS_IDE_RETRY_DMA(op)) {
@@ -841,6 +844,7 @@ static void ide_dma_cb(void *opaque, int ret)
     bool stay_active = false;
 
     if (ret == -ECANCELED) {
+        block_acct_cancel(blk_get_stats(s->blk), &s->acct);
         return;
     }
 
@@ -976,6 +980,7 @@ static void ide_sector_write_cb(void *opaque, int ret)
     int n;
 
     if (ret == -ECANCELED) {
+        block_acct_cancel(blk_get_stats(s->blk), &s->acct);
         return;
     }
 
@@ -1059,6 +1064,7 @@ static void ide_flush_cb(void *opaque, int ret)
     s->pio_aiocb = NULL;
 
     if (ret == -ECANCELED) {
+        block_acct_cancel(blk_get_stats(s->blk), &s->acct);
         return;
     }
     if (ret < 0) {
@@ -184,6 +184,10 @@ static void scsi_disk_load_request(QEMUFile *f, SCSIRequest *req)
 static bool scsi_disk_req_check_error(SCSIDiskReq *r, int ret, bool acct_failed)
 {
     if (r->req.io_canceled) {
+        if (acct_failed) {
+            SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+            block_acct_cancel(blk_get_stats(s->qdev.conf.blk), &r->acct);
+        }
         scsi_req_cancel_complete(&r->req);
         return true;
     }
@@ -476,6 +480,9 @@ static bool scsi_handle_rw_error(SCSIDiskReq *r, int error, bool acct_failed)
             scsi_check_condition(r, SENSE_CODE(IO_ERROR));
             break;
         }
+    } else if (acct_failed) {
+        /* Ignored requests are not accounted, stopped ones are restarted */
+        block_acct_cancel(blk_get_stats(s->qdev.conf.blk), &r->acct);
     }
 
     blk_error_action(s->qdev.conf.blk, action, is_read, error);
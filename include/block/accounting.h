@@ -39,9 +39,45 @@ enum BlockAcctType {
     BLOCK_MAX_IOTYPE,
 };
 
+/* Log-linear (HDR-style) histogram.  Values below
+ * BLOCK_ACCT_HIST_SUB_BUCKETS get a bucket each, every following power of two
+ * is split into BLOCK_ACCT_HIST_SUB_BUCKETS buckets of equal width.  A value
+ * read back from the histogram is therefore off by less than
+ * 1 / BLOCK_ACCT_HIST_SUB_BUCKETS (6.25%), over the whole range from 1ns to
+ * 2^BLOCK_ACCT_HIST_MAX_BITS ns (~137s).  Larger values share the last bucket.
+ */
+#define BLOCK_ACCT_HIST_SUB_BITS    4
+#define BLOCK_ACCT_HIST_SUB_BUCKETS (1 << BLOCK_ACCT_HIST_SUB_BITS)
+#define BLOCK_ACCT_HIST_MAX_BITS    37
+#define BLOCK_ACCT_HIST_NBUCKETS \
+    ((BLOCK_ACCT_HIST_MAX_BITS - BLOCK_ACCT_HIST_SUB_BITS + 1) * \
+     BLOCK_ACCT_HIST_SUB_BUCKETS)
+
+typedef struct BlockAcctLogHistogram {
+    uint64_t count;
+    uint64_t buckets[BLOCK_ACCT_HIST_NBUCKETS];
+} BlockAcctLogHistogram;
+
+/* Log-linear histogram over a sliding window, using the same two staggered
+ * windows as TimedAverage */
+typedef struct BlockAcctTimedHistogram {
+    BlockAcctLogHistogram windows[2];
+    int64_t expiration[2];
+    unsigned current;           /* the oldest window */
+    uint64_t period;            /* in nanoseconds */
+    QEMUClockType clock_type;
+} BlockAcctTimedHistogram;
+
+typedef struct BlockAcctPercentiles {
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+} BlockAcctPercentiles;
+
 struct BlockAcctTimedStats {
     BlockAcctStats *stats;
     TimedAverage latency[BLOCK_MAX_IOTYPE];
+    BlockAcctTimedHistogram latency_log_histogram[BLOCK_MAX_IOTYPE];
     unsigned interval_length; /* in seconds */
     QSLIST_ENTRY(BlockAcctTimedStats) entries;
 };
@@ -89,12 +125,19 @@ struct BlockAcctStats {
     bool account_invalid;
     bool account_failed;
     BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
+
+    /* Always enabled, unlike @latency_histogram */
+    BlockAcctLogHistogram latency_log_histogram[BLOCK_MAX_IOTYPE];
+    /* Number of requests in flight (including the new one) at submission */
+    BlockAcctLogHistogram queue_depth_histogram[BLOCK_MAX_IOTYPE];
+    unsigned in_flight[BLOCK_MAX_IOTYPE];
 };
 
 typedef struct BlockAcctCookie {
     int64_t bytes;
     int64_t start_time_ns;
     enum BlockAcctType type;
+    bool in_flight;
 } BlockAcctCookie;
 
 void block_acct_init(BlockAcctStats *stats);
@@ -108,6 +151,7 @@ void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type);
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie);
 void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie);
+void block_acct_cancel(BlockAcctStats *stats, BlockAcctCookie *cookie);
 void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type);
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                            int num_requests);
@@ -117,5 +161,14 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
 int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
+bool block_acct_latency_percentiles(BlockAcctStats *stats,
+                                    enum BlockAcctType type,
+                                    BlockAcctPercentiles *p);
+bool block_acct_timed_latency_percentiles(BlockAcctTimedStats *stats,
+                                          enum BlockAcctType type,
+                                          BlockAcctPercentiles *p);
+int block_acct_queue_depth_histogram(BlockAcctStats *stats,
+                                     enum BlockAcctType type,
+                                     uint64_t **boundaries, uint64_t **bins);
 
 #endif
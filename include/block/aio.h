@@ -49,6 +49,8 @@ typedef void IOHandler(void *opaque);
 struct Coroutine;
 struct ThreadPool;
 struct LinuxAioState;
+struct LuringState;
+struct io_uring;
 
 struct AioContext {
     GSource source;
@@ -122,12 +124,26 @@ struct AioContext {
      */
     struct LinuxAioState *linux_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    /*
+     * State for Linux io_uring.  Uses aio_context_acquire/release for
+     * locking.
+     */
+    struct LuringState *linux_io_uring;
+#endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
      * locking.
      */
     QEMUTimerListGroup tlg;
 
+    /* Plug scope depth and functions deferred until the outermost
+     * aio_io_unplug(), see aio_io_plug().  Only accessed from the home
+     * thread.
+     */
+    unsigned int io_plugged;
+    GArray *io_plug_calls;
+
     int external_disable_cnt;
 
     /* Number of AioHandlers without .io_poll() */
@@ -146,6 +162,22 @@ struct AioContext {
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+
+#ifdef CONFIG_LINUX_IO_URING
+    /* io_uring(7) ring used for fd monitoring instead of ppoll/epoll, or
+     * NULL if it could not be set up for this AioContext.
+     */
+    struct io_uring *fdmon_io_uring;
+
+    /* AioHandlers whose IORING_OP_POLL_ADD/POLL_REMOVE requests still have
+     * to be placed on the submission queue.  Updated with atomic
+     * primitives because handlers may change from other threads.
+     */
+    QSLIST_HEAD(, AioHandler) fdmon_io_uring_submit_list;
+
+    /* Deleted AioHandlers still referenced by in-flight polls */
+    int fdmon_io_uring_deferred_frees;
+#endif
 };
 
 /**
@@ -386,6 +418,77 @@ struct LinuxAioState *aio_setup_linux_aio(AioContext *ctx, Error **errp);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
+/* Setup the LuringState bound to this AioContext */
+struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
+
+/* Return the LuringState bound to this AioContext */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
+/**
+ * aio_io_plug:
+ * @ctx: the aio context
+ *
+ * Open a plug scope.  Until the matching aio_io_unplug(), I/O engines bound
+ * to @ctx queue new requests instead of submitting them, and submit
+ * everything at once when the outermost scope is closed.  aio_poll() and
+ * aio_dispatch() open a plug scope around each round of callbacks, so all
+ * requests issued by the devices served by @ctx during the round share one
+ * submission.
+ *
+ * Plug scopes nest.  Calls from outside the home thread of @ctx are ignored.
+ */
+void aio_io_plug(AioContext *ctx);
+
+/**
+ * aio_io_unplug:
+ * @ctx: the aio context
+ *
+ * Close a plug scope opened by aio_io_plug().  Closing the outermost scope
+ * runs the functions deferred with aio_io_plug_call().
+ */
+void aio_io_unplug(AioContext *ctx);
+
+/**
+ * aio_io_plugged:
+ * @ctx: the aio context
+ *
+ * Return whether the caller runs inside a plug scope of @ctx.
+ */
+bool aio_io_plugged(AioContext *ctx);
+
+/**
+ * aio_io_plug_call:
+ * @ctx: the aio context
+ * @fn: the function to call
+ * @opaque: the argument of @fn
+ *
+ * Call @fn(@opaque) when the outermost plug scope of @ctx is closed, or right
+ * away if the caller is not inside a plug scope of @ctx.  A function that is
+ * already deferred with the same @opaque is only called once.
+ */
+void aio_io_plug_call(AioContext *ctx, void (*fn)(void *), void *opaque);
+
+/**
+ * aio_io_plug_cancel:
+ * @ctx: the aio context
+ * @fn: the function passed to aio_io_plug_call()
+ * @opaque: the argument passed to aio_io_plug_call()
+ *
+ * Drop a call deferred with aio_io_plug_call(), for example because @opaque
+ * is about to be detached from @ctx.
+ */
+void aio_io_plug_cancel(AioContext *ctx, void (*fn)(void *), void *opaque);
+
+/**
+ * aio_io_plug_flush:
+ * @ctx: the aio context
+ *
+ * Run the functions deferred with aio_io_plug_call() without closing the plug
+ * scope.  This must be done before blocking inside a plug scope, or the
+ * requests that are waited for could still be queued.
+ */
+void aio_io_plug_flush(AioContext *ctx);
+
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -350,6 +350,8 @@ struct TranslationBlock {
 #define CF_USE_ICOUNT  0x00020000
 #define CF_INVALID     0x00040000 /* TB is stale. Set with @jmp_lock held */
 #define CF_PARALLEL    0x00080000 /* Generate code for a parallel context */
+#define CF_HOST_PTRS   0x00100000 /* Code embeds host pointers */
+#define CF_TRACE       0x00200000 /* Trace of several hot blocks */
 #define CF_CLUSTER_MASK 0xff000000 /* Top 8 bits are cluster ID */
 #define CF_CLUSTER_SHIFT 24
 /* cflags' mask for hashing/comparison */
@@ -359,6 +361,9 @@ struct TranslationBlock {
     /* Per-vCPU dynamic tracing state used to generate this TB */
     uint32_t trace_vcpu_dstate;
 
+    /* Executions left before the TB is retranslated as a trace */
+    int32_t exec_count;
+
     struct tb_tc tc;
 
     /* original tb when cflags has CF_NOCACHE */
@@ -383,6 +388,26 @@ struct TranslationBlock {
 #define TB_JMP_RESET_OFFSET_INVALID 0xffff /* indicates no jump generated */
     uintptr_t jmp_target_arg[2];  /* target address or offset */
 
+    /*
+     * Cross-TB liveness.  Every TB leaves all guest globals in
+     * CPUArchState, because the next one may exit to the main loop
+     * before running a single insn.  A jump that skips the next TB's
+     * exit request check, though, can leave stale the globals that TB
+     * overwrites before reading them.
+     *
+     * @entry_offset is the offset in the code of the point right after
+     * the exit request check, or 0 if there is none; @dead_in are the
+     * globals (bit i for tcg_ctx->temps[i]) that are dead from there.
+     * @jmp_skip[n] are the globals that jump n does not store when it is
+     * chained.  Such a jump may only be chained to the @entry_offset of
+     * a TB that has them all in @dead_in, and only forward (to a higher
+     * pc), so that any loop of chained TBs still checks for exit
+     * requests.
+     */
+    uint16_t entry_offset;
+    uint64_t dead_in;
+    uint64_t jmp_skip[2];
+
     /*
      * Each TB has a NULL-terminated list (jmp_list_head) of incoming jumps.
      * Each TB can have two outgoing jumps, and therefore can participate
@@ -406,6 +431,7 @@ struct TranslationBlock {
 };
 
 extern bool parallel_cpus;
+extern uint32_t tb_trace_threshold;
 
 /* Hide the atomic_read to make code a little easier on the eyes */
 static inline uint32_t tb_cflags(const TranslationBlock *tb)
@@ -7,10 +7,41 @@
 
 static TCGOp *icount_start_insn;
 
+/*
+ * Count down tb->exec_count, and ask for the TB to be retranslated as
+ * a trace when it reaches zero.
+ */
+static inline void gen_tb_exec_count(TranslationBlock *tb)
+{
+    TCGv_ptr ptr = tcg_temp_new_ptr();
+    TCGv_i32 count = tcg_temp_new_i32();
+    TCGLabel *cold = gen_new_label();
+
+    /*
+     * Not tcg_const_ptr(): this points at the TB itself, which is always
+     * restored together with its code.
+     */
+    tcg_gen_movi_ptr(ptr, (intptr_t)tb);
+    tcg_gen_ld_i32(count, ptr, offsetof(TranslationBlock, exec_count));
+    tcg_gen_subi_i32(count, count, 1);
+    tcg_gen_st_i32(count, ptr, offsetof(TranslationBlock, exec_count));
+    tcg_gen_brcondi_i32(TCG_COND_NE, count, 0, cold);
+    gen_helper_tb_hot(cpu_env, ptr);
+    gen_set_label(cold);
+
+    tcg_temp_free_i32(count);
+    tcg_temp_free_ptr(ptr);
+}
+
 static inline void gen_tb_start(TranslationBlock *tb)
 {
     TCGv_i32 count, imm;
 
+    /* Blocks inlined into a trace run under the checks of its first block */
+    if (tcg_ctx->tb_trace_block) {
+        return;
+    }
+
     tcg_ctx->exitreq_label = gen_new_label();
     if (tb_cflags(tb) & CF_USE_ICOUNT) {
         count = tcg_temp_local_new_i32();
@@ -35,6 +66,9 @@ static inline void gen_tb_start(TranslationBlock *tb)
     }
 
     tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, tcg_ctx->exitreq_label);
+    if (!(tb_cflags(tb) & CF_USE_ICOUNT)) {
+        tcg_ctx->tb_entry_op = tcg_last_op();
+    }
 
     if (tb_cflags(tb) & CF_USE_ICOUNT) {
         tcg_gen_st16_i32(count, cpu_env,
@@ -43,10 +77,21 @@ static inline void gen_tb_start(TranslationBlock *tb)
     }
 
     tcg_temp_free_i32(count);
+
+    if (tb_trace_threshold &&
+        !(tb_cflags(tb) & (CF_NOCACHE | CF_USE_ICOUNT | CF_TRACE))) {
+        gen_tb_exec_count(tb);
+    }
+    /* Nothing above touches the globals after the check */
+    tcg_ctx->tb_body_op = tcg_last_op();
 }
 
 static inline void gen_tb_end(TranslationBlock *tb, int num_insns)
 {
+    if (tcg_ctx->tb_trace_block) {
+        return;
+    }
+
     if (tb_cflags(tb) & CF_USE_ICOUNT) {
         /* Update the num_insn immediate parameter now that we know
          * the actual insn count.  */
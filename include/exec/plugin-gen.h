@@ -0,0 +1,43 @@
+/*
+ * Instrumentation of translated code for TCG plugins
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_PLUGIN_GEN_H
+#define QEMU_PLUGIN_GEN_H
+
+#include "qemu/plugin.h"
+#include "tcg/tcg.h"
+
+struct DisasContextBase;
+
+#ifdef CONFIG_PLUGIN
+bool plugin_gen_tb_start(CPUState *cpu, const TranslationBlock *tb);
+void plugin_gen_tb_end(CPUState *cpu);
+void plugin_gen_insn_start(CPUState *cpu, const struct DisasContextBase *db);
+void plugin_gen_insn_end(CPUState *cpu, const struct DisasContextBase *db);
+void plugin_gen_mem_record(TCGv vaddr, TCGMemOp memop, bool is_store);
+#else
+static inline bool plugin_gen_tb_start(CPUState *cpu,
+                                       const TranslationBlock *tb)
+{
+    return false;
+}
+
+static inline void plugin_gen_tb_end(CPUState *cpu)
+{
+}
+
+static inline void plugin_gen_insn_start(CPUState *cpu,
+                                         const struct DisasContextBase *db)
+{
+}
+
+static inline void plugin_gen_insn_end(CPUState *cpu,
+                                       const struct DisasContextBase *db)
+{
+}
+#endif
+
+#endif /* QEMU_PLUGIN_GEN_H */
@@ -34,6 +34,7 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    char *iothreads;
     char *serial;
     uint32_t request_merging;
     uint16_t num_queues;
@@ -72,6 +73,7 @@ typedef struct VirtIOBlockReq {
     size_t in_len;
     struct VirtIOBlockReq *next;
     struct VirtIOBlockReq *mr_next;
+    QSLIST_ENTRY(VirtIOBlockReq) complete_next;
     BlockAcctCookie acct;
 } VirtIOBlockReq;
 
@@ -0,0 +1,72 @@
+/*
+ * QEMU TCG plugin support, QEMU side
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_PLUGIN_H
+#define QEMU_PLUGIN_H
+
+#include "qemu/qemu-plugin.h"
+#include "qemu/option.h"
+
+/* Layout of qemu_plugin_meminfo_t */
+#define PLUGIN_MEMINFO_SHIFT_MASK   0xf
+#define PLUGIN_MEMINFO_SIGN_EXTEND  (1 << 4)
+#define PLUGIN_MEMINFO_BIG_ENDIAN   (1 << 5)
+#define PLUGIN_MEMINFO_STORE        (1 << 6)
+
+enum plugin_dyn_cb_type {
+    PLUGIN_CB_REGULAR,
+    PLUGIN_CB_INLINE,
+    PLUGIN_CB_MEM,
+};
+
+/* A callback or inline op registered on a TB or an instruction */
+struct qemu_plugin_dyn_cb {
+    enum plugin_dyn_cb_type type;
+    void *f;
+    void *userp;
+    enum qemu_plugin_op op;
+    uint64_t imm;
+    enum qemu_plugin_mem_rw rw;
+};
+
+/*
+ * These are kept per TCGContext and reused from one translation to the
+ * next; see accel/tcg/plugin-gen.c.
+ */
+struct qemu_plugin_insn {
+    GByteArray *data;
+    uint64_t vaddr;
+    struct TCGOp *start_op;  /* the insn_start op */
+    GArray *exec_cbs;        /* of struct qemu_plugin_dyn_cb */
+    GArray *mem_cbs;         /* of struct qemu_plugin_dyn_cb */
+    GArray *mem_ops;         /* guest accesses, private to plugin-gen.c */
+};
+
+struct qemu_plugin_tb {
+    GPtrArray *insns;
+    size_t n;
+    uint64_t vaddr;
+    GArray *exec_cbs;
+};
+
+#ifdef CONFIG_PLUGIN
+extern QemuOptsList qemu_plugin_opts;
+
+void qemu_plugin_load_list(int max_vcpus, Error **errp);
+void qemu_plugin_vcpu_init_hook(CPUState *cpu);
+bool qemu_plugin_tb_trans_enabled(void);
+void qemu_plugin_tb_trans_cb(struct qemu_plugin_tb *tb);
+#else
+static inline void qemu_plugin_load_list(int max_vcpus, Error **errp)
+{
+}
+
+static inline void qemu_plugin_vcpu_init_hook(CPUState *cpu)
+{
+}
+#endif
+
+#endif /* QEMU_PLUGIN_H */
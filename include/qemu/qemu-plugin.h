@@ -0,0 +1,153 @@
+/*
+ * QEMU TCG plugin API
+ *
+ * This is the only header a plugin includes.  It does not depend on any
+ * other QEMU header, so that plugins can be built out of tree.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_PLUGIN_API_H
+#define QEMU_PLUGIN_API_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define QEMU_PLUGIN_EXPORT __attribute__((visibility("default")))
+
+/*
+ * Bumped whenever a change to this file breaks plugins built against an
+ * earlier version.  A plugin declares the version it was built against:
+ *
+ *     QEMU_PLUGIN_EXPORT int qemu_plugin_version = QEMU_PLUGIN_VERSION;
+ *
+ * and QEMU refuses to load it if that does not match its own.
+ */
+#define QEMU_PLUGIN_VERSION 1
+
+typedef uint64_t qemu_plugin_id_t;
+
+typedef struct qemu_info_t {
+    const char *target_name;  /* e.g. "aarch64" */
+    int version;              /* QEMU_PLUGIN_VERSION of the running QEMU */
+    bool system_emulation;
+    int max_vcpus;            /* only valid for system emulation */
+} qemu_info_t;
+
+/**
+ * qemu_plugin_install() - entry point of a plugin
+ * @id: identifier of this plugin, to be passed to the register functions
+ * @info: information about the running QEMU
+ * @argc: number of arguments
+ * @argv: the "arg=" values given with -plugin, in order
+ *
+ * Callbacks that are not attached to a TB or instruction can only be
+ * registered from here.
+ *
+ * Returns 0 on success, anything else makes QEMU exit with an error.
+ */
+QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id,
+                                           const qemu_info_t *info,
+                                           int argc, char **argv);
+
+typedef void (*qemu_plugin_udata_cb_t)(qemu_plugin_id_t id, void *userdata);
+typedef void (*qemu_plugin_vcpu_simple_cb_t)(qemu_plugin_id_t id,
+                                             unsigned int vcpu_index);
+typedef void (*qemu_plugin_vcpu_udata_cb_t)(unsigned int vcpu_index,
+                                            void *userdata);
+
+/* Called once for every vCPU, before it starts running */
+void qemu_plugin_register_vcpu_init_cb(qemu_plugin_id_t id,
+                                       qemu_plugin_vcpu_simple_cb_t cb);
+
+/* Called when QEMU exits */
+void qemu_plugin_register_atexit_cb(qemu_plugin_id_t id,
+                                    qemu_plugin_udata_cb_t cb,
+                                    void *userdata);
+
+/*
+ * Translation time
+ *
+ * The TB translation callback runs every time guest code is translated,
+ * possibly in several vCPU threads at once.  Its struct qemu_plugin_tb and
+ * the struct qemu_plugin_insn it returns are only valid until it returns;
+ * the execution callbacks it registers on them are compiled into the
+ * translated code, and cost nothing for code they are not registered on.
+ */
+struct qemu_plugin_tb;
+struct qemu_plugin_insn;
+
+typedef void (*qemu_plugin_vcpu_tb_trans_cb_t)(qemu_plugin_id_t id,
+                                               struct qemu_plugin_tb *tb);
+
+void qemu_plugin_register_vcpu_tb_trans_cb(qemu_plugin_id_t id,
+                                           qemu_plugin_vcpu_tb_trans_cb_t cb);
+
+size_t qemu_plugin_tb_n_insns(const struct qemu_plugin_tb *tb);
+uint64_t qemu_plugin_tb_vaddr(const struct qemu_plugin_tb *tb);
+struct qemu_plugin_insn *
+qemu_plugin_tb_get_insn(const struct qemu_plugin_tb *tb, size_t idx);
+
+/* Guest bytes of the instruction */
+const void *qemu_plugin_insn_data(const struct qemu_plugin_insn *insn);
+size_t qemu_plugin_insn_size(const struct qemu_plugin_insn *insn);
+uint64_t qemu_plugin_insn_vaddr(const struct qemu_plugin_insn *insn);
+
+/*
+ * Execution time
+ *
+ * Callbacks are called from the vCPU thread that runs the code, with
+ * @vcpu_index identifying the vCPU.  Inline operations are emitted
+ * directly as TCG ops; they are not atomic, so under MTTCG use one
+ * counter per vCPU or accept lost updates.
+ */
+enum qemu_plugin_op {
+    QEMU_PLUGIN_INLINE_ADD_U64,  /* *(uint64_t *)ptr += imm */
+};
+
+void qemu_plugin_register_vcpu_tb_exec_cb(struct qemu_plugin_tb *tb,
+                                          qemu_plugin_vcpu_udata_cb_t cb,
+                                          void *userdata);
+void qemu_plugin_register_vcpu_tb_exec_inline(struct qemu_plugin_tb *tb,
+                                              enum qemu_plugin_op op,
+                                              void *ptr, uint64_t imm);
+void qemu_plugin_register_vcpu_insn_exec_cb(struct qemu_plugin_insn *insn,
+                                            qemu_plugin_vcpu_udata_cb_t cb,
+                                            void *userdata);
+void qemu_plugin_register_vcpu_insn_exec_inline(struct qemu_plugin_insn *insn,
+                                                enum qemu_plugin_op op,
+                                                void *ptr, uint64_t imm);
+
+/*
+ * Memory accesses
+ *
+ * Called after each guest load or store done by the instruction, with
+ * the guest virtual address.  Accesses made by helpers (atomics, string
+ * instructions of some targets, ...) are not reported.
+ */
+enum qemu_plugin_mem_rw {
+    QEMU_PLUGIN_MEM_R = 1,
+    QEMU_PLUGIN_MEM_W,
+    QEMU_PLUGIN_MEM_RW,
+};
+
+typedef uint32_t qemu_plugin_meminfo_t;
+
+typedef void (*qemu_plugin_vcpu_mem_cb_t)(unsigned int vcpu_index,
+                                          qemu_plugin_meminfo_t info,
+                                          uint64_t vaddr,
+                                          void *userdata);
+
+void qemu_plugin_register_vcpu_mem_cb(struct qemu_plugin_insn *insn,
+                                      qemu_plugin_vcpu_mem_cb_t cb,
+                                      enum qemu_plugin_mem_rw rw,
+                                      void *userdata);
+
+/* log2 of the access size in bytes */
+unsigned int qemu_plugin_mem_size_shift(qemu_plugin_meminfo_t info);
+bool qemu_plugin_mem_is_sign_extended(qemu_plugin_meminfo_t info);
+bool qemu_plugin_mem_is_big_endian(qemu_plugin_meminfo_t info);
+bool qemu_plugin_mem_is_store(qemu_plugin_meminfo_t info);
+
+#endif /* QEMU_PLUGIN_API_H */
@@ -269,6 +269,7 @@ struct CPUWatchpoint {
 
 struct KVMState;
 struct kvm_run;
+struct kvm_dirty_gfn;
 
 struct hax_vcpu_state;
 
@@ -335,11 +336,14 @@ struct qemu_work_item;
  * @gdb_regs: Additional GDB registers.
  * @gdb_num_regs: Number of total registers accessible to GDB.
  * @gdb_num_g_regs: Number of registers in GDB 'g' packets.
+ * @hot_tb: TB that became hot and is to be retranslated as a trace.
  * @next_cpu: Next CPU sharing TB cache.
  * @opaque: User data.
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @mem_io_vaddr: Target virtual address at which the memory was accessed.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @kvm_dirty_gfns: Dirty ring shared with KVM, if enabled.
+ * @kvm_fetch_index: Next entry of @kvm_dirty_gfns to collect.
  * @work_mutex: Lock to prevent multiple access to queued_work_*.
  * @queued_work_first: First asynchronous work pending.
  * @trace_dstate_delayed: Delayed changes to trace_dstate (includes all changes
@@ -395,6 +399,7 @@ struct CPUState {
 
     /* Accessed in parallel; all accesses must be atomic */
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    struct TranslationBlock *hot_tb;
 
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
@@ -424,6 +429,8 @@ struct CPUState {
     int kvm_fd;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate_delayed, CPU_TRACE_DSTATE_MAX_EVENTS);
@@ -444,6 +451,16 @@ struct CPUState {
      */
     bool throttle_thread_scheduled;
 
+    /* Pages collected from the KVM dirty ring of this vCPU */
+    uint64_t dirty_pages;
+    /* Value of @dirty_pages when the dirty limit last looked at it */
+    uint64_t dirty_pages_prev;
+    /*
+     * Time to sleep each time the KVM dirty ring of this vCPU fills up,
+     * in microseconds, while the dirty limit is active
+     */
+    int64_t throttle_us_per_full;
+
     bool ignore_memory_transaction_failures;
 
     struct hax_vcpu_state *hax_vcpu;
@@ -852,6 +869,44 @@ bool cpu_throttle_active(void);
  */
 int cpu_throttle_get_percentage(void);
 
+/**
+ * cpu_dirty_limit_start:
+ * @quota: Dirty page rate limit of each vcpu, in MB/s.
+ *
+ * Throttles the vcpus that dirty memory faster than @quota, leaving the
+ * others alone.  Each vcpu is measured separately, and a vcpu over the
+ * limit sleeps whenever its KVM dirty ring fills up, for as long as
+ * needed to bring its rate down to @quota.  Requires the KVM dirty ring
+ * and dirty logging to be active, e.g. during migration.
+ *
+ * cpu_dirty_limit_start can be called again to change @quota.  The
+ * limit remains in effect until cpu_dirty_limit_stop is called.
+ */
+void cpu_dirty_limit_start(uint64_t quota);
+
+/**
+ * cpu_dirty_limit_stop:
+ *
+ * Stops the vcpu throttling started by cpu_dirty_limit_start.
+ */
+void cpu_dirty_limit_stop(void);
+
+/**
+ * cpu_dirty_limit_active:
+ *
+ * Returns: %true if the dirty limit is active, %false otherwise.
+ */
+bool cpu_dirty_limit_active(void);
+
+/**
+ * cpu_dirty_limit_throttle:
+ * @cpu: The vcpu whose KVM dirty ring is full.
+ *
+ * Sleeps for the time computed for @cpu by the dirty limit, if active.
+ * Must be called by the vcpu thread, without holding the iothread lock.
+ */
+void cpu_dirty_limit_throttle(CPUState *cpu);
+
 #ifndef CONFIG_USER_ONLY
 
 typedef void (*CPUInterruptHandler)(CPUState *, int);
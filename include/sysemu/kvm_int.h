@@ -18,6 +18,8 @@ typedef struct KVMSlot
     hwaddr start_addr;
     ram_addr_t memory_size;
     void *ram;
+    /* Offset of the slot in the ram_addr_t space */
+    ram_addr_t ram_start_offset;
     int slot;
     int flags;
     int old_flags;
@@ -10,6 +10,7 @@
 
 extern bool tcg_allowed;
 void tcg_exec_init(unsigned long tb_size);
+void tb_cache_load(void);
 #ifdef CONFIG_TCG
 #define tcg_enabled() (tcg_allowed)
 #else
@@ -44,6 +44,7 @@
 #include "target_elf.h"
 #include "cpu_loop-common.h"
 #include "crypto/init.h"
+#include "qemu/plugin.h"
 
 char *exec_path;
 
@@ -387,6 +388,15 @@ static void handle_arg_trace(const char *arg)
     trace_file = trace_opt_parse(arg);
 }
 
+#ifdef CONFIG_PLUGIN
+static void handle_arg_plugin(const char *arg)
+{
+    if (!qemu_opts_parse_noisily(qemu_find_opts("plugin"), arg, true)) {
+        exit(EXIT_FAILURE);
+    }
+}
+#endif
+
 struct qemu_argument {
     const char *argv;
     const char *env;
@@ -438,6 +448,10 @@ static const struct qemu_argument arg_table[] = {
      "",           "Seed for pseudo-random number generator"},
     {"trace",      "QEMU_TRACE",       true,  handle_arg_trace,
      "",           "[[enable=]<pattern>][,events=<file>][,file=<file>]"},
+#ifdef CONFIG_PLUGIN
+    {"plugin",     "QEMU_PLUGIN",      true,  handle_arg_plugin,
+     "",           "[file=]<file>[,arg=<string>]"},
+#endif
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
      "",           "display version information and exit"},
     {NULL, NULL, false, NULL, NULL, NULL}
@@ -628,6 +642,9 @@ int main(int argc, char **argv, char **envp)
     cpu_model = NULL;
 
     qemu_add_opts(&qemu_trace_opts);
+#ifdef CONFIG_PLUGIN
+    qemu_add_opts(&qemu_plugin_opts);
+#endif
 
     optind = parse_args(argc, argv);
 
@@ -665,6 +682,7 @@ int main(int argc, char **argv, char **envp)
 
     /* init tcg before creating CPUs and to get qemu_host_page_size */
     tcg_exec_init(0);
+    qemu_plugin_load_list(1, &error_fatal);
 
     /* Reserving *too* much vm space via mmap can run into problems
        with rlimits, oom due to page table creation, etc.  We will still try it,
@@ -0,0 +1,260 @@
+/*
+ * Dirty page rate measurement
+ *
+ * Estimate how fast the guest dirties its memory without starting a
+ * migration: hash a random sample of the pages of every RAMBlock, wait
+ * for the requested time and count how many of the sampled pages have
+ * changed.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "exec/cpu-common.h"
+#include "exec/target_page.h"
+#include "dirtyrate.h"
+#include "trace.h"
+
+typedef struct DirtyRateStat {
+    /* measurement window, in seconds */
+    int64_t calc_time;
+    /* start of the measurement, in seconds since the epoch */
+    int64_t start_time;
+    /* sampled RAMBlocks */
+    RAMBlockDirtyInfo *block_info;
+    int block_count;
+    int block_count_max;
+    /* total dirty rate, in MB/s */
+    int64_t dirty_rate;
+} DirtyRateStat;
+
+static int dirty_rate_status = DIRTY_RATE_STATUS_UNSTARTED;
+/*
+ * Written by the measuring thread while the status is
+ * DIRTY_RATE_STATUS_MEASURING, read by the monitor otherwise.
+ */
+static DirtyRateStat dirty_stat;
+
+static void dirtyrate_free_block_info(DirtyRateStat *stat)
+{
+    int i;
+
+    for (i = 0; i < stat->block_count; i++) {
+        g_free(stat->block_info[i].idstr);
+        g_free(stat->block_info[i].sample_page_vfn);
+        g_free(stat->block_info[i].hash_result);
+    }
+    g_free(stat->block_info);
+    stat->block_info = NULL;
+    stat->block_count = 0;
+    stat->block_count_max = 0;
+}
+
+static uint32_t dirtyrate_page_hash(RAMBlock *block, uint64_t vfn)
+{
+    size_t page_size = qemu_target_page_size();
+    uint8_t *host = qemu_ram_get_host_addr(block);
+
+    return crc32(0, host + vfn * page_size, page_size);
+}
+
+/* Pick a random page among @total_pages, which may not fit in 32 bits */
+static uint64_t dirtyrate_random_page(uint64_t total_pages)
+{
+    uint64_t r = ((uint64_t)g_random_int() << 32) | g_random_int();
+
+    return r % total_pages;
+}
+
+static int dirtyrate_count_blocks(RAMBlock *block, void *opaque)
+{
+    int *count = opaque;
+
+    if (qemu_ram_is_migratable(block)) {
+        (*count)++;
+    }
+    return 0;
+}
+
+static int dirtyrate_sample_block(RAMBlock *block, void *opaque)
+{
+    DirtyRateStat *stat = opaque;
+    RAMBlockDirtyInfo *info;
+    uint64_t used_length = qemu_ram_get_used_length(block);
+    uint64_t total_pages = used_length >> qemu_target_page_bits();
+    uint64_t sample_pages;
+    uint32_t i;
+
+    if (!qemu_ram_is_migratable(block) || !total_pages) {
+        return 0;
+    }
+
+    /* The block list may have grown since we counted it */
+    if (stat->block_count == stat->block_count_max) {
+        return 1;
+    }
+
+    sample_pages = (used_length >> 30) * DIRTYRATE_SAMPLE_PAGES_PER_GB;
+    sample_pages = MAX(sample_pages, DIRTYRATE_MIN_SAMPLE_PAGES);
+    sample_pages = MIN(sample_pages, total_pages);
+
+    info = &stat->block_info[stat->block_count++];
+    info->idstr = g_strdup(qemu_ram_get_idstr(block));
+    info->used_length = used_length;
+    info->sample_pages_count = sample_pages;
+    info->sample_dirty_count = 0;
+    info->sample_page_vfn = g_new(uint64_t, sample_pages);
+    info->hash_result = g_new(uint32_t, sample_pages);
+
+    for (i = 0; i < sample_pages; i++) {
+        info->sample_page_vfn[i] = dirtyrate_random_page(total_pages);
+        info->hash_result[i] = dirtyrate_page_hash(block,
+                                                   info->sample_page_vfn[i]);
+    }
+
+    trace_dirtyrate_sample_block(info->idstr, used_length, sample_pages);
+    return 0;
+}
+
+static void dirtyrate_compare_block(RAMBlockDirtyInfo *info)
+{
+    RAMBlock *block = qemu_ram_block_by_name(info->idstr);
+    uint32_t i;
+
+    /* Blocks that were removed or resized meanwhile report no rate */
+    if (!block || qemu_ram_get_used_length(block) != info->used_length) {
+        info->sample_dirty_count = 0;
+        info->sample_pages_count = 0;
+        return;
+    }
+
+    for (i = 0; i < info->sample_pages_count; i++) {
+        if (dirtyrate_page_hash(block, info->sample_page_vfn[i]) !=
+            info->hash_result[i]) {
+            info->sample_dirty_count++;
+        }
+    }
+}
+
+/* Estimated number of bytes of a RAMBlock dirtied during the window */
+static uint64_t dirtyrate_block_dirty_bytes(RAMBlockDirtyInfo *info)
+{
+    if (!info->sample_pages_count) {
+        return 0;
+    }
+
+    return info->used_length * info->sample_dirty_count /
+           info->sample_pages_count;
+}
+
+/* Convert dirtied bytes over the window into MB/s */
+static int64_t dirtyrate_to_mbps(uint64_t dirty_bytes, int64_t calc_time)
+{
+    return (dirty_bytes >> 20) / calc_time;
+}
+
+static void *get_dirtyrate_thread(void *opaque)
+{
+    DirtyRateStat *stat = &dirty_stat;
+    uint64_t dirty_bytes = 0;
+    int count = 0;
+    int i;
+
+    rcu_register_thread();
+
+    rcu_read_lock();
+    qemu_ram_foreach_block(dirtyrate_count_blocks, &count);
+    stat->block_info = g_new0(RAMBlockDirtyInfo, count);
+    stat->block_count_max = count;
+    qemu_ram_foreach_block(dirtyrate_sample_block, stat);
+    rcu_read_unlock();
+
+    g_usleep(stat->calc_time * G_USEC_PER_SEC);
+
+    rcu_read_lock();
+    for (i = 0; i < stat->block_count; i++) {
+        dirtyrate_compare_block(&stat->block_info[i]);
+        dirty_bytes += dirtyrate_block_dirty_bytes(&stat->block_info[i]);
+    }
+    rcu_read_unlock();
+
+    stat->dirty_rate = dirtyrate_to_mbps(dirty_bytes, stat->calc_time);
+    trace_dirtyrate_measured(stat->dirty_rate);
+    atomic_mb_set(&dirty_rate_status, DIRTY_RATE_STATUS_MEASURED);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+{
+    static QemuThread thread;
+    int status = atomic_read(&dirty_rate_status);
+
+    if (status == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "the dirty rate is already being measured");
+        return;
+    }
+
+    if (calc_time < DIRTYRATE_MIN_CALC_TIME ||
+        calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, "calc-time is out of range [%d, %d]",
+                   DIRTYRATE_MIN_CALC_TIME, DIRTYRATE_MAX_CALC_TIME);
+        return;
+    }
+
+    /* The previous measurement, if any, is finished: drop its results */
+    dirtyrate_free_block_info(&dirty_stat);
+    dirty_stat.calc_time = calc_time;
+    dirty_stat.start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
+    dirty_stat.dirty_rate = 0;
+    atomic_mb_set(&dirty_rate_status, DIRTY_RATE_STATUS_MEASURING);
+
+    trace_dirtyrate_calc(calc_time);
+    qemu_thread_create(&thread, "get_dirtyrate", get_dirtyrate_thread,
+                       NULL, QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+    RAMBlockDirtyRateList *head = NULL, **tail = &head;
+    int i;
+
+    info->status = atomic_mb_read(&dirty_rate_status);
+    info->start_time = dirty_stat.start_time;
+    info->calc_time = dirty_stat.calc_time;
+
+    if (info->status != DIRTY_RATE_STATUS_MEASURED) {
+        return info;
+    }
+
+    info->has_dirty_rate = true;
+    info->dirty_rate = dirty_stat.dirty_rate;
+
+    for (i = 0; i < dirty_stat.block_count; i++) {
+        RAMBlockDirtyInfo *block = &dirty_stat.block_info[i];
+        RAMBlockDirtyRateList *entry = g_new0(RAMBlockDirtyRateList, 1);
+
+        entry->value = g_new0(RAMBlockDirtyRate, 1);
+        entry->value->id = g_strdup(block->idstr);
+        entry->value->size = block->used_length;
+        entry->value->dirty_rate =
+            dirtyrate_to_mbps(dirtyrate_block_dirty_bytes(block),
+                              dirty_stat.calc_time);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    info->has_ramblocks = true;
+    info->ramblocks = head;
+
+    return info;
+}
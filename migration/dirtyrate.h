@@ -0,0 +1,37 @@
+/*
+ * Dirty page rate measurement
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_DIRTYRATE_H
+#define QEMU_MIGRATION_DIRTYRATE_H
+
+/* Number of pages sampled in each GiB of a RAMBlock */
+#define DIRTYRATE_SAMPLE_PAGES_PER_GB       512
+
+/* Sample at least this many pages from each RAMBlock */
+#define DIRTYRATE_MIN_SAMPLE_PAGES          64
+
+/* Bounds of the measurement window, in seconds */
+#define DIRTYRATE_MIN_CALC_TIME             1
+#define DIRTYRATE_MAX_CALC_TIME             60
+
+/* Sampled pages of one RAMBlock */
+typedef struct RAMBlockDirtyInfo {
+    /* name of the RAMBlock */
+    char *idstr;
+    /* used length of the RAMBlock when it was sampled */
+    uint64_t used_length;
+    /* number of sampled pages */
+    uint32_t sample_pages_count;
+    /* number of sampled pages found dirty */
+    uint32_t sample_dirty_count;
+    /* offset in pages of each sampled page */
+    uint64_t *sample_page_vfn;
+    /* crc32 of each sampled page */
+    uint32_t *hash_result;
+} RAMBlockDirtyInfo;
+
+#endif
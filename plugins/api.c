@@ -0,0 +1,137 @@
+/*
+ * QEMU TCG plugins: translation time API
+ *
+ * Everything here is called from a TB translation callback, on the
+ * per-TCGContext state of the translating thread, and needs no locking.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/plugin.h"
+
+size_t qemu_plugin_tb_n_insns(const struct qemu_plugin_tb *tb)
+{
+    return tb->n;
+}
+
+uint64_t qemu_plugin_tb_vaddr(const struct qemu_plugin_tb *tb)
+{
+    return tb->vaddr;
+}
+
+struct qemu_plugin_insn *
+qemu_plugin_tb_get_insn(const struct qemu_plugin_tb *tb, size_t idx)
+{
+    if (idx >= tb->n) {
+        return NULL;
+    }
+    return g_ptr_array_index(tb->insns, idx);
+}
+
+const void *qemu_plugin_insn_data(const struct qemu_plugin_insn *insn)
+{
+    return insn->data->data;
+}
+
+size_t qemu_plugin_insn_size(const struct qemu_plugin_insn *insn)
+{
+    return insn->data->len;
+}
+
+uint64_t qemu_plugin_insn_vaddr(const struct qemu_plugin_insn *insn)
+{
+    return insn->vaddr;
+}
+
+static void plugin_register_dyn_cb(GArray *cbs, void *f, void *userp)
+{
+    struct qemu_plugin_dyn_cb cb = {
+        .type = PLUGIN_CB_REGULAR,
+        .f = f,
+        .userp = userp,
+    };
+
+    g_array_append_val(cbs, cb);
+}
+
+static void plugin_register_inline_op(GArray *cbs, enum qemu_plugin_op op,
+                                      void *ptr, uint64_t imm)
+{
+    struct qemu_plugin_dyn_cb cb = {
+        .type = PLUGIN_CB_INLINE,
+        .userp = ptr,
+        .op = op,
+        .imm = imm,
+    };
+
+    if (op != QEMU_PLUGIN_INLINE_ADD_U64) {
+        error_report("plugin: unknown inline operation %d", op);
+        return;
+    }
+    g_array_append_val(cbs, cb);
+}
+
+void qemu_plugin_register_vcpu_tb_exec_cb(struct qemu_plugin_tb *tb,
+                                          qemu_plugin_vcpu_udata_cb_t cb,
+                                          void *userdata)
+{
+    plugin_register_dyn_cb(tb->exec_cbs, cb, userdata);
+}
+
+void qemu_plugin_register_vcpu_tb_exec_inline(struct qemu_plugin_tb *tb,
+                                              enum qemu_plugin_op op,
+                                              void *ptr, uint64_t imm)
+{
+    plugin_register_inline_op(tb->exec_cbs, op, ptr, imm);
+}
+
+void qemu_plugin_register_vcpu_insn_exec_cb(struct qemu_plugin_insn *insn,
+                                            qemu_plugin_vcpu_udata_cb_t cb,
+                                            void *userdata)
+{
+    plugin_register_dyn_cb(insn->exec_cbs, cb, userdata);
+}
+
+void qemu_plugin_register_vcpu_insn_exec_inline(struct qemu_plugin_insn *insn,
+                                                enum qemu_plugin_op op,
+                                                void *ptr, uint64_t imm)
+{
+    plugin_register_inline_op(insn->exec_cbs, op, ptr, imm);
+}
+
+void qemu_plugin_register_vcpu_mem_cb(struct qemu_plugin_insn *insn,
+                                      qemu_plugin_vcpu_mem_cb_t cb,
+                                      enum qemu_plugin_mem_rw rw,
+                                      void *userdata)
+{
+    struct qemu_plugin_dyn_cb dyn = {
+        .type = PLUGIN_CB_MEM,
+        .f = cb,
+        .userp = userdata,
+        .rw = rw,
+    };
+
+    g_array_append_val(insn->mem_cbs, dyn);
+}
+
+unsigned int qemu_plugin_mem_size_shift(qemu_plugin_meminfo_t info)
+{
+    return info & PLUGIN_MEMINFO_SHIFT_MASK;
+}
+
+bool qemu_plugin_mem_is_sign_extended(qemu_plugin_meminfo_t info)
+{
+    return !!(info & PLUGIN_MEMINFO_SIGN_EXTEND);
+}
+
+bool qemu_plugin_mem_is_big_endian(qemu_plugin_meminfo_t info)
+{
+    return !!(info & PLUGIN_MEMINFO_BIG_ENDIAN);
+}
+
+bool qemu_plugin_mem_is_store(qemu_plugin_meminfo_t info)
+{
+    return !!(info & PLUGIN_MEMINFO_STORE);
+}
@@ -0,0 +1,283 @@
+/*
+ * QEMU TCG plugins: loading and global callbacks
+ *
+ * Plugins are loaded and install their global callbacks before any guest
+ * code runs, and are never unloaded.  After that the callback lists are
+ * only read, so the vCPU threads walk them without taking any lock.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <gmodule.h>
+#include "qapi/error.h"
+#include "qemu/config-file.h"
+#include "qemu/error-report.h"
+#include "qemu/option.h"
+#include "qemu/plugin.h"
+#include "qom/cpu.h"
+
+typedef int (*qemu_plugin_install_func_t)(qemu_plugin_id_t id,
+                                          const qemu_info_t *info,
+                                          int argc, char **argv);
+
+typedef struct QemuPluginCtx {
+    GModule *handle;
+    qemu_plugin_id_t id;
+    char *path;
+} QemuPluginCtx;
+
+typedef struct QemuPluginCb {
+    qemu_plugin_id_t id;
+    void *f;
+    void *userdata;
+} QemuPluginCb;
+
+static struct {
+    GPtrArray *ctxs;
+    GArray *vcpu_init_cbs;
+    GArray *tb_trans_cbs;
+    GArray *atexit_cbs;
+    /* the plugin whose qemu_plugin_install() is running, if any */
+    QemuPluginCtx *installing;
+} plugin;
+
+QemuOptsList qemu_plugin_opts = {
+    .name = "plugin",
+    .implied_opt_name = "file",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_plugin_opts.head),
+    .desc = {
+        {
+            .name = "file",
+            .type = QEMU_OPT_STRING,
+            .help = "Path of the plugin shared library",
+        }, {
+            .name = "arg",
+            .type = QEMU_OPT_STRING,
+            .help = "Argument passed to the plugin, may be repeated",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void plugin_register_cb(GArray *cbs, qemu_plugin_id_t id,
+                               void *f, void *userdata)
+{
+    QemuPluginCb cb = {
+        .id = id,
+        .f = f,
+        .userdata = userdata,
+    };
+
+    if (!plugin.installing || plugin.installing->id != id) {
+        error_report("plugin %" PRIu64 ": global callbacks can only be "
+                     "registered from qemu_plugin_install()", id);
+        return;
+    }
+    g_array_append_val(cbs, cb);
+}
+
+static void plugin_unregister_cbs(GArray *cbs, qemu_plugin_id_t id)
+{
+    guint i = 0;
+
+    while (i < cbs->len) {
+        if (g_array_index(cbs, QemuPluginCb, i).id == id) {
+            g_array_remove_index(cbs, i);
+        } else {
+            i++;
+        }
+    }
+}
+
+void qemu_plugin_register_vcpu_init_cb(qemu_plugin_id_t id,
+                                       qemu_plugin_vcpu_simple_cb_t cb)
+{
+    plugin_register_cb(plugin.vcpu_init_cbs, id, cb, NULL);
+}
+
+void qemu_plugin_register_atexit_cb(qemu_plugin_id_t id,
+                                    qemu_plugin_udata_cb_t cb,
+                                    void *userdata)
+{
+    plugin_register_cb(plugin.atexit_cbs, id, cb, userdata);
+}
+
+void qemu_plugin_register_vcpu_tb_trans_cb(qemu_plugin_id_t id,
+                                           qemu_plugin_vcpu_tb_trans_cb_t cb)
+{
+    plugin_register_cb(plugin.tb_trans_cbs, id, cb, NULL);
+}
+
+void qemu_plugin_vcpu_init_hook(CPUState *cpu)
+{
+    guint i;
+
+    if (!plugin.vcpu_init_cbs) {
+        return;
+    }
+    for (i = 0; i < plugin.vcpu_init_cbs->len; i++) {
+        QemuPluginCb *cb = &g_array_index(plugin.vcpu_init_cbs,
+                                          QemuPluginCb, i);
+        qemu_plugin_vcpu_simple_cb_t f = cb->f;
+
+        f(cb->id, cpu->cpu_index);
+    }
+}
+
+bool qemu_plugin_tb_trans_enabled(void)
+{
+    return plugin.tb_trans_cbs && plugin.tb_trans_cbs->len;
+}
+
+void qemu_plugin_tb_trans_cb(struct qemu_plugin_tb *tb)
+{
+    guint i;
+
+    for (i = 0; i < plugin.tb_trans_cbs->len; i++) {
+        QemuPluginCb *cb = &g_array_index(plugin.tb_trans_cbs,
+                                          QemuPluginCb, i);
+        qemu_plugin_vcpu_tb_trans_cb_t f = cb->f;
+
+        f(cb->id, tb);
+    }
+}
+
+static void plugin_atexit(void)
+{
+    guint i;
+
+    for (i = 0; i < plugin.atexit_cbs->len; i++) {
+        QemuPluginCb *cb = &g_array_index(plugin.atexit_cbs, QemuPluginCb, i);
+        qemu_plugin_udata_cb_t f = cb->f;
+
+        f(cb->id, cb->userdata);
+    }
+}
+
+static void plugin_load(const char *path, int argc, char **argv,
+                        const qemu_info_t *info, Error **errp)
+{
+    QemuPluginCtx *ctx;
+    qemu_plugin_install_func_t install;
+    int *version;
+    int rc;
+
+    ctx = g_new0(QemuPluginCtx, 1);
+    ctx->handle = g_module_open(path, G_MODULE_BIND_LOCAL);
+    if (!ctx->handle) {
+        error_setg(errp, "Could not load plugin %s: %s", path,
+                   g_module_error());
+        g_free(ctx);
+        return;
+    }
+
+    if (!g_module_symbol(ctx->handle, "qemu_plugin_version",
+                         (gpointer *)&version)) {
+        error_setg(errp, "Plugin %s does not define qemu_plugin_version",
+                   path);
+        goto err;
+    }
+    if (*version != QEMU_PLUGIN_VERSION) {
+        error_setg(errp, "Plugin %s was built for plugin API version %d, "
+                   "this QEMU provides version %d", path, *version,
+                   QEMU_PLUGIN_VERSION);
+        goto err;
+    }
+    if (!g_module_symbol(ctx->handle, "qemu_plugin_install",
+                         (gpointer *)&install)) {
+        error_setg(errp, "Plugin %s does not define qemu_plugin_install()",
+                   path);
+        goto err;
+    }
+
+    ctx->id = plugin.ctxs->len;
+    ctx->path = g_strdup(path);
+    g_ptr_array_add(plugin.ctxs, ctx);
+
+    plugin.installing = ctx;
+    rc = install(ctx->id, info, argc, argv);
+    plugin.installing = NULL;
+    if (rc) {
+        error_setg(errp, "Plugin %s failed to install (%d)", path, rc);
+        plugin_unregister_cbs(plugin.vcpu_init_cbs, ctx->id);
+        plugin_unregister_cbs(plugin.tb_trans_cbs, ctx->id);
+        plugin_unregister_cbs(plugin.atexit_cbs, ctx->id);
+        g_ptr_array_remove_index(plugin.ctxs, ctx->id);
+        g_free(ctx->path);
+        goto err;
+    }
+    return;
+
+err:
+    g_module_close(ctx->handle);
+    g_free(ctx);
+}
+
+static int plugin_add_arg(void *opaque, const char *name, const char *value,
+                          Error **errp)
+{
+    GPtrArray *args = opaque;
+
+    if (!strcmp(name, "arg")) {
+        g_ptr_array_add(args, g_strdup(value));
+    }
+    return 0;
+}
+
+static int plugin_load_opts(void *opaque, QemuOpts *opts, Error **errp)
+{
+    const qemu_info_t *info = opaque;
+    const char *path = qemu_opt_get(opts, "file");
+    GPtrArray *args;
+    Error *local_err = NULL;
+
+    if (!path) {
+        error_setg(errp, "-plugin: missing file name");
+        return -1;
+    }
+
+    args = g_ptr_array_new_with_free_func(g_free);
+    qemu_opt_foreach(opts, plugin_add_arg, args, &error_abort);
+    g_ptr_array_add(args, NULL);
+
+    plugin_load(path, args->len - 1, (char **)args->pdata, info, &local_err);
+    g_ptr_array_free(args, true);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return -1;
+    }
+    return 0;
+}
+
+/* Load the plugins given with -plugin, in command line order */
+void qemu_plugin_load_list(int max_vcpus, Error **errp)
+{
+    qemu_info_t info = {
+        .target_name = TARGET_NAME,
+        .version = QEMU_PLUGIN_VERSION,
+#ifdef CONFIG_SOFTMMU
+        .system_emulation = true,
+#endif
+        .max_vcpus = max_vcpus,
+    };
+    QemuOptsList *list = qemu_find_opts("plugin");
+
+    if (QTAILQ_EMPTY(&list->head)) {
+        return;
+    }
+    if (!g_module_supported()) {
+        error_setg(errp, "Plugins are not supported on this host");
+        return;
+    }
+
+    plugin.ctxs = g_ptr_array_new();
+    plugin.vcpu_init_cbs = g_array_new(false, false, sizeof(QemuPluginCb));
+    plugin.tb_trans_cbs = g_array_new(false, false, sizeof(QemuPluginCb));
+    plugin.atexit_cbs = g_array_new(false, false, sizeof(QemuPluginCb));
+
+    if (qemu_opts_foreach(list, plugin_load_opts, &info, errp)) {
+        return;
+    }
+    atexit(plugin_atexit);
+}
@@ -1581,6 +1581,9 @@ typedef struct ImgConvertState {
     bool target_has_backing;
     int64_t target_backing_sectors; /* negative if unknown */
     bool wr_in_order;
+    /* With wr_in_order, only the submission of writes is ordered; set for
+     * compressed targets, which allocate clusters in submission order */
+    bool wr_submit_in_order;
     bool copy_range;
     bool salvage;
     bool quiet;
@@ -1850,6 +1853,30 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+/*
+ * Let the coroutine waiting to write at @wr_offs continue.  It only runs
+ * once the caller yields, so if the caller is about to submit a write, that
+ * write is started first.
+ */
+static void coroutine_fn convert_co_wake_next(ImgConvertState *s,
+                                              int64_t wr_offs)
+{
+    int i;
+
+    s->wr_offs = wr_offs;
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] == wr_offs) {
+            /*
+             * A -> B -> A cannot occur because A has
+             * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+             * B will never enter A during this time window.
+             */
+            aio_co_wake(s->co[i]);
+            break;
+        }
+    }
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -1923,6 +1950,13 @@ retry:
                 qemu_coroutine_yield();
             }
             s->wait_sector_num[index] = -1;
+
+            /* The target takes care of ordering the writes from here on,
+             * while this request is being compressed the next one can be
+             * submitted */
+            if (s->wr_submit_in_order) {
+                convert_co_wake_next(s, sector_num + n);
+            }
         }
 
         if (s->ret == -EINPROGRESS) {
@@ -1942,21 +1976,10 @@ retry:
             }
         }
 
-        if (s->wr_in_order) {
+        if (s->wr_in_order && !s->wr_submit_in_order) {
             /* reenter the coroutine that might have waited
              * for this write to complete */
-            s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
-                    /*
-                     * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
-                     * B will never enter A during this time window.
-                     */
-                    qemu_coroutine_enter(s->co[i]);
-                    break;
-                }
-            }
+            convert_co_wake_next(s, sector_num + n);
         }
     }
 
@@ -1998,6 +2021,13 @@ static int convert_do_copy(ImgConvertState *s)
         s->buf_sectors = s->cluster_sectors;
     }
 
+    /* Compressed writes are compressed in a thread pool, and get their
+     * clusters allocated in the order in which they were submitted.  Only
+     * keep the submission in order so that several clusters can be
+     * compressed at once.  Other writes, encrypted ones included, may
+     * still allocate clusters out of order and have to complete in order. */
+    s->wr_submit_in_order = s->compressed;
+
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
@@ -184,6 +184,7 @@ struct tcg_region_state {
     /* fields protected by the lock */
     size_t current; /* current region index */
     size_t agg_size_full; /* aggregate size of full regions */
+    void *reserved; /* end of the code kept out of the regions, if any */
 };
 
 static struct tcg_region_state region;
@@ -537,6 +538,9 @@ static void tcg_region_assign(TCGContext *s, size_t curr_region)
     void *start, *end;
 
     tcg_region_bounds(curr_region, &start, &end);
+    if (start < region.reserved) {
+        start = region.reserved;
+    }
 
     s->code_gen_buffer = start;
     s->code_gen_ptr = start;
@@ -546,6 +550,16 @@ static void tcg_region_assign(TCGContext *s, size_t curr_region)
 
 static bool tcg_region_alloc__locked(TCGContext *s)
 {
+    void *start, *end;
+
+    /* Skip the regions that are entirely reserved */
+    while (region.current < region.n) {
+        tcg_region_bounds(region.current, &start, &end);
+        if (region.reserved < end - TCG_HIGHWATER) {
+            break;
+        }
+        region.current++;
+    }
     if (region.current == region.n) {
         return true;
     }
@@ -591,6 +605,7 @@ void tcg_region_reset_all(void)
     qemu_mutex_lock(&region.lock);
     region.current = 0;
     region.agg_size_full = 0;
+    region.reserved = NULL;
 
     for (i = 0; i < n_ctxs; i++) {
         TCGContext *s = atomic_read(&tcg_ctxs[i]);
@@ -729,6 +744,22 @@ void tcg_region_init(void)
 #endif
 }
 
+/*
+ * Keep the code below @end out of the regions handed out to TCG contexts,
+ * so that code loaded by the TB cache is not overwritten.  The reservation
+ * is dropped by tcg_region_reset_all().
+ *
+ * Must be called after tcg_region_init() and before any context allocates a
+ * region, i.e. before the vCPU threads are started.
+ */
+void tcg_region_reserve(void *end)
+{
+    qemu_mutex_lock(&region.lock);
+    g_assert(region.current == 0);
+    region.reserved = end;
+    qemu_mutex_unlock(&region.lock);
+}
+
 /*
  * All TCG threads except the parent (i.e. the one that called tcg_context_init
  * and registered the target's TCG globals) must register with this function
@@ -1106,6 +1137,17 @@ void tcg_func_start(TCGContext *s)
     s->nb_ops = 0;
     s->nb_labels = 0;
     s->current_frame_offset = s->frame_start;
+    s->tb_host_ptrs = false;
+    s->tb_trace_block = false;
+    s->tb_entry_op = NULL;
+    s->tb_body_op = NULL;
+    s->tb_entry_offset = 0;
+    s->tb_dead_in = 0;
+    s->tb_jmp_skip[0] = 0;
+    s->tb_jmp_skip[1] = 0;
+#ifdef CONFIG_PLUGIN
+    s->plugin_insn = NULL;
+#endif
 
 #ifdef CONFIG_DEBUG_TCG
     s->goto_tb_issue_mask = 0;
@@ -2484,6 +2526,37 @@ static void la_global_kill(TCGContext *s, int ng)
     }
 }
 
+/* liveness analysis: goto_tb stores the globals in @skip only on its
+   fall-through path, so they stay live in registers up to it.  */
+static void la_goto_tb(TCGContext *s, uint64_t skip)
+{
+    int i;
+
+    for (i = 0; i < s->nb_globals && i < 64; i++) {
+        if (skip & (1ull << i)) {
+            s->temps[i].state = 0;
+            la_reset_pref(&s->temps[i]);
+        }
+    }
+}
+
+/* liveness analysis: globals that are neither read nor synced before
+   being written, i.e. whose value the following code ignores.  */
+static uint64_t la_dead_globals(TCGContext *s)
+{
+    uint64_t dead = 0;
+    int i;
+
+    for (i = 0; i < s->nb_globals && i < 64; i++) {
+        TCGTemp *ts = &s->temps[i];
+
+        if (ts->state == TS_DEAD && !ts->fixed_reg && !ts->indirect_reg) {
+            dead |= 1ull << i;
+        }
+    }
+    return dead;
+}
+
 /* liveness analysis: note live globals crossing calls.  */
 static void la_cross_call(TCGContext *s, int nt)
 {
@@ -2534,6 +2607,10 @@ static void liveness_pass_1(TCGContext *s)
         TCGOpcode opc = op->opc;
         const TCGOpDef *def = &tcg_op_defs[opc];
 
+        if (op == s->tb_body_op) {
+            s->tb_dead_in = la_dead_globals(s);
+        }
+
         switch (opc) {
         case INDEX_op_call:
             {
@@ -2749,6 +2826,9 @@ static void liveness_pass_1(TCGContext *s)
             /* If end of basic block, update.  */
             if (def->flags & TCG_OPF_BB_EXIT) {
                 la_func_end(s, nb_globals, nb_temps);
+                if (opc == INDEX_op_goto_tb) {
+                    la_goto_tb(s, s->tb_jmp_skip[op->args[0]]);
+                }
             } else if (def->flags & TCG_OPF_BB_END) {
                 la_bb_end(s, nb_globals, nb_temps);
             } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
@@ -3299,6 +3379,37 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
     save_globals(s, allocated_regs);
 }
 
+/* Whether a TB may be entered past its start, see tb->entry_offset */
+static inline bool tcg_can_enter_mid_tb(void)
+{
+#ifdef USE_REG_TB
+    /* TCG_REG_TB must hold the address of the start of the TB */
+    return !USE_REG_TB;
+#else
+    return true;
+#endif
+}
+
+/*
+ * goto_tb stores the globals that its jump skips (s->tb_jmp_skip) after
+ * the jump instruction, i.e. on the path that reaches exit_tb when the
+ * jump is not chained.
+ */
+static void tcg_reg_alloc_goto_tb(TCGContext *s, const TCGOp *op)
+{
+    uint64_t skip = s->tb_jmp_skip[op->args[0]];
+    int const_args[TCG_MAX_OP_ARGS] = { 0 };
+    int i;
+
+    tcg_out_op(s, INDEX_op_goto_tb, op->args, const_args);
+    for (i = 0; i < s->nb_globals && i < 64; i++) {
+        if (skip & (1ull << i)) {
+            temp_sync(s, &s->temps[i], s->reserved_regs, 0, 1);
+        }
+    }
+    tcg_reg_alloc_bb_end(s, s->reserved_regs);
+}
+
 /*
  * Specialized code generation for INDEX_op_movi_*.
  */
@@ -4145,6 +4256,9 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
         case INDEX_op_call:
             tcg_reg_alloc_call(s, op);
             break;
+        case INDEX_op_goto_tb:
+            tcg_reg_alloc_goto_tb(s, op);
+            break;
         default:
             /* Sanity check that we've not introduced any unhandled opcodes. */
             tcg_debug_assert(tcg_op_supported(opc));
@@ -4154,6 +4268,9 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
             tcg_reg_alloc_op(s, op);
             break;
         }
+        if (op == s->tb_entry_op && tcg_can_enter_mid_tb()) {
+            s->tb_entry_offset = tcg_current_code_size(s);
+        }
 #ifdef CONFIG_DEBUG_TCG
         check_regs(s);
 #endif
@@ -678,8 +678,17 @@ struct TCGContext {
     uintptr_t *tb_jmp_insn_offset; /* tb->jmp_target_arg if direct_jump */
     uintptr_t *tb_jmp_target_addr; /* tb->jmp_target_arg if !direct_jump */
 
+    /* Cross-TB liveness, see struct TranslationBlock */
+    TCGOp *tb_entry_op;        /* exit request check */
+    TCGOp *tb_body_op;         /* last op emitted by gen_tb_start */
+    uint16_t tb_entry_offset;  /* tb->entry_offset */
+    uint64_t tb_dead_in;       /* tb->dead_in */
+    uint64_t tb_jmp_skip[2];   /* tb->jmp_skip */
+
     TCGRegSet reserved_regs;
     uint32_t tb_cflags; /* cflags of the current TB */
+    bool tb_host_ptrs; /* the current TB embeds host pointers */
+    bool tb_trace_block; /* translating a block inlined into a trace */
     intptr_t current_frame_offset;
     intptr_t frame_start;
     intptr_t frame_end;
@@ -726,6 +735,12 @@ struct TCGContext {
 
     TCGLabel *exitreq_label;
 
+#ifdef CONFIG_PLUGIN
+    /* Plugin state of the TB and insn being translated, see plugin-gen.c */
+    struct qemu_plugin_tb *plugin_tb;
+    struct qemu_plugin_insn *plugin_insn;
+#endif
+
     TCGTempSet free_temps[TCG_TYPE_COUNT * 2];
     TCGTemp temps[TCG_MAX_TEMPS]; /* globals first, temps after */
 
@@ -882,6 +897,7 @@ void tcg_pool_reset(TCGContext *s);
 TranslationBlock *tcg_tb_alloc(TCGContext *s);
 
 void tcg_region_init(void);
+void tcg_region_reserve(void *end);
 void tcg_region_reset_all(void);
 
 size_t tcg_code_size(void);
@@ -1104,12 +1120,28 @@ TCGv_vec tcg_const_ones_vec(TCGType);
 TCGv_vec tcg_const_zeros_vec_matching(TCGv_vec);
 TCGv_vec tcg_const_ones_vec_matching(TCGv_vec);
 
+/*
+ * Host pointers are only valid in the current process, so code that embeds
+ * them must not be saved by the TB cache.
+ */
+static inline intptr_t tcg_host_ptr(intptr_t ptr)
+{
+    if (ptr) {
+        tcg_ctx->tb_host_ptrs = true;
+    }
+    return ptr;
+}
+
 #if UINTPTR_MAX == UINT32_MAX
-# define tcg_const_ptr(x)        ((TCGv_ptr)tcg_const_i32((intptr_t)(x)))
-# define tcg_const_local_ptr(x)  ((TCGv_ptr)tcg_const_local_i32((intptr_t)(x)))
+# define tcg_const_ptr(x)        \
+    ((TCGv_ptr)tcg_const_i32(tcg_host_ptr((intptr_t)(x))))
+# define tcg_const_local_ptr(x)  \
+    ((TCGv_ptr)tcg_const_local_i32(tcg_host_ptr((intptr_t)(x))))
 #else
-# define tcg_const_ptr(x)        ((TCGv_ptr)tcg_const_i64((intptr_t)(x)))
-# define tcg_const_local_ptr(x)  ((TCGv_ptr)tcg_const_local_i64((intptr_t)(x)))
+# define tcg_const_ptr(x)        \
+    ((TCGv_ptr)tcg_const_i64(tcg_host_ptr((intptr_t)(x))))
+# define tcg_const_local_ptr(x)  \
+    ((TCGv_ptr)tcg_const_local_i64(tcg_host_ptr((intptr_t)(x))))
 #endif
 
 TCGLabel *gen_new_label(void);
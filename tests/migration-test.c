@@ -15,6 +15,7 @@
 #include "libqtest.h"
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qlist.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
@@ -442,6 +443,31 @@ static void migrate_set_parameter(QTestState *who, const char *parameter,
     migrate_check_parameter(who, parameter, value);
 }
 
+static void migrate_check_parameter_str(QTestState *who, const char *parameter,
+                                        const char *value)
+{
+    QDict *rsp, *rsp_return;
+
+    rsp = wait_command(who, "{ 'execute': 'query-migrate-parameters' }");
+    rsp_return = qdict_get_qdict(rsp, "return");
+    g_assert_cmpstr(qdict_get_str(rsp_return, parameter), ==, value);
+    qobject_unref(rsp);
+}
+
+static void migrate_set_parameter_str(QTestState *who, const char *parameter,
+                                      const char *value)
+{
+    QDict *rsp;
+
+    rsp = qtest_qmp(who,
+                    "{ 'execute': 'migrate-set-parameters',"
+                    "'arguments': { %s: %s } }",
+                    parameter, value);
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+    migrate_check_parameter_str(who, parameter, value);
+}
+
 static void migrate_pause(QTestState *who)
 {
     QDict *rsp;
@@ -1044,6 +1070,171 @@ static void test_precopy_tcp(void)
     g_free(uri);
 }
 
+static void test_multifd_tcp(const char *method, bool zero_page)
+{
+    QTestState *from, *to;
+    QDict *rsp;
+    char *uri;
+
+    if (test_migrate_start(&from, &to, "defer", false, false)) {
+        return;
+    }
+
+    /*
+     * We want to pick a speed slow enough that the test completes
+     * quickly, but that it doesn't complete precopy even on a slow
+     * machine, so also set the downtime.
+     */
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter(from, "max-bandwidth", 1000000000);
+
+    migrate_set_parameter(from, "multifd-channels", 4);
+    migrate_set_parameter(to, "multifd-channels", 4);
+
+    migrate_set_parameter_str(from, "multifd-compression", method);
+    migrate_set_parameter_str(to, "multifd-compression", method);
+
+    migrate_set_capability(from, "multifd", true);
+    migrate_set_capability(to, "multifd", true);
+
+    /* Most of the guest RAM outside the test area is never written */
+    migrate_set_capability(from, "multifd-zero-page", zero_page);
+    migrate_set_capability(to, "multifd-zero-page", zero_page);
+
+    /* The multifd capabilities must be set before listening */
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
+    qobject_unref(rsp);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    uri = migrate_get_socket_address(to, "socket-address");
+
+    migrate(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300ms should converge */
+    migrate_set_parameter(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    g_assert_cmpint(read_ram_property_int(from, "duplicate"), >, 0);
+    g_assert_cmpint(read_ram_property_int(from, "multifd-bytes"), >, 0);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_multifd_tcp_none(void)
+{
+    test_multifd_tcp("none", false);
+}
+
+static void test_multifd_tcp_zero_page(void)
+{
+    test_multifd_tcp("none", true);
+}
+
+static void test_multifd_tcp_zlib(void)
+{
+    test_multifd_tcp("zlib", false);
+}
+
+#ifdef CONFIG_ZSTD
+static void test_multifd_tcp_zstd(void)
+{
+    test_multifd_tcp("zstd", false);
+}
+#endif
+
+/* Wait for the measurement started on @who and return its results */
+static QDict *wait_for_dirty_rate(QTestState *who)
+{
+    QDict *rsp_return;
+
+    for (;;) {
+        rsp_return = wait_command(who, "{ 'execute': 'query-dirty-rate' }");
+        if (!strcmp(qdict_get_str(rsp_return, "status"), "measured")) {
+            return rsp_return;
+        }
+        g_assert_cmpstr(qdict_get_str(rsp_return, "status"), ==,
+                        "measuring");
+        qobject_unref(rsp_return);
+        usleep(100 * 1000);
+    }
+}
+
+static void test_dirty_rate(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *from, *to;
+    QDict *rsp, *rsp_return;
+    QList *ramblocks;
+    char *out;
+
+    if (test_migrate_start(&from, &to, uri, false, false)) {
+        return;
+    }
+
+    rsp = wait_command(from, "{ 'execute': 'query-dirty-rate' }");
+    g_assert_cmpstr(qdict_get_str(rsp, "status"), ==, "unstarted");
+    g_assert(!qdict_haskey(rsp, "dirty-rate"));
+    qobject_unref(rsp);
+
+    rsp = qtest_qmp(from, "{ 'execute': 'calc-dirty-rate',"
+                          "  'arguments': { 'calc-time': 0 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    /* The guest keeps dirtying all of its RAM */
+    wait_for_serial("src_serial");
+
+    rsp = wait_command(from, "{ 'execute': 'calc-dirty-rate',"
+                             "  'arguments': { 'calc-time': 1 } }");
+    qobject_unref(rsp);
+
+    rsp = qtest_qmp(from, "{ 'execute': 'calc-dirty-rate',"
+                          "  'arguments': { 'calc-time': 1 } }");
+    if (qdict_haskey(rsp, "error")) {
+        /* Refused while the first measurement is still running */
+        rsp_return = qdict_get_qdict(rsp, "error");
+        g_assert(strstr(qdict_get_str(rsp_return, "desc"), "already"));
+    }
+    qobject_unref(rsp);
+
+    rsp_return = wait_for_dirty_rate(from);
+    g_assert_cmpint(qdict_get_int(rsp_return, "calc-time"), ==, 1);
+    g_assert_cmpint(qdict_get_int(rsp_return, "dirty-rate"), >, 0);
+    ramblocks = qdict_get_qlist(rsp_return, "ramblocks");
+    g_assert(ramblocks && !qlist_empty(ramblocks));
+    qobject_unref(rsp_return);
+
+    /* Same through HMP */
+    out = qtest_hmp(from, "calc_dirty_rate 1");
+    g_assert(strstr(out, "Measuring the dirty rate"));
+    g_free(out);
+    qobject_unref(wait_for_dirty_rate(from));
+
+    out = qtest_hmp(from, "info dirty_rate");
+    g_assert(strstr(out, "Status: measured"));
+    g_assert(strstr(out, "Calc time: 1 s"));
+    g_assert(strstr(out, "Dirty rate: "));
+    g_free(out);
+
+    test_migrate_end(from, to, false);
+    g_free(uri);
+}
+
 static void test_migrate_fd_proto(void)
 {
     QTestState *from, *to;
@@ -1182,7 +1373,15 @@ int main(int argc, char **argv)
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
+    qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
+    qtest_add_func("/migration/multifd/tcp/zero-page",
+                   test_multifd_tcp_zero_page);
+    qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
+#ifdef CONFIG_ZSTD
+    qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
+#endif
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
+    qtest_add_func("/migration/dirty_rate", test_dirty_rate);
 
     ret = g_test_run();
 
@@ -10,9 +10,14 @@
 #include "qemu/osdep.h"
 #include "qemu/module.h"
 #include "qemu/units.h"
+#include "qemu/cutils.h"
 #include "libqtest.h"
 #include "libqos/qgraph.h"
 #include "libqos/pci.h"
+#include "block/nvme.h"
+
+#define NVME_TEST_QSIZE         4
+#define NVME_TEST_TIMEOUT_US    (5 * 1000 * 1000)
 
 typedef struct QNvme QNvme;
 
@@ -66,11 +71,379 @@ static void nvmetest_oob_cmb_test(void *obj, void *data, QGuestAllocator *alloc)
     g_assert_cmpint(qpci_io_readl(pdev, bar, cmb_bar_size - 1), !=, 0x44332211);
 }
 
+typedef struct NvmeTestQueue {
+    uint16_t qid;
+    uint16_t sq_size;
+    uint16_t cq_size;
+    uint64_t sq;
+    uint64_t cq;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint16_t phase;
+    uint16_t cid;
+} NvmeTestQueue;
+
+typedef struct NvmeTestCtrl {
+    QPCIDevice *dev;
+    QPCIBar bar;
+    QGuestAllocator *alloc;
+    NvmeTestQueue admin;
+    NvmeTestQueue io;
+    /* Shadow doorbell and EventIdx buffers, 0 until configured */
+    uint64_t dbs;
+    uint64_t eis;
+} NvmeTestCtrl;
+
+/*
+ * The tests below let the controller DMA to buffers from the libqos
+ * allocator, which sPAPR would first have to map in its TCE tables.
+ */
+static bool nvmetest_skip_dma(void)
+{
+    if (!strcmp(qtest_get_arch(), "ppc64")) {
+        g_test_skip("PCI DMA goes through the sPAPR IOMMU");
+        return true;
+    }
+    return false;
+}
+
+static void nvmetest_queue_init(NvmeTestCtrl *c, NvmeTestQueue *q,
+                                uint16_t qid, uint16_t sq_size,
+                                uint16_t cq_size)
+{
+    q->qid = qid;
+    q->sq_size = sq_size;
+    q->cq_size = cq_size;
+    q->sq = guest_alloc(c->alloc, sq_size * sizeof(NvmeCmd));
+    q->cq = guest_alloc(c->alloc, cq_size * sizeof(NvmeCqe));
+    qtest_memset(global_qtest, q->cq, 0, cq_size * sizeof(NvmeCqe));
+    q->sq_tail = 0;
+    q->cq_head = 0;
+    q->phase = 1;
+    q->cid = 0;
+}
+
+/* Queue @cmd without ringing the doorbell */
+static void nvmetest_queue_cmd(NvmeTestCtrl *c, NvmeTestQueue *q,
+                               NvmeCmd *cmd)
+{
+    cmd->cid = cpu_to_le16(q->cid++);
+    memwrite(q->sq + q->sq_tail * sizeof(*cmd), cmd, sizeof(*cmd));
+    q->sq_tail = (q->sq_tail + 1) % q->sq_size;
+}
+
+static void nvmetest_ring_sq(NvmeTestCtrl *c, NvmeTestQueue *q)
+{
+    if (q->qid && c->dbs) {
+        uint32_t v = cpu_to_le32(q->sq_tail);
+
+        memwrite(c->dbs + q->qid * 8, &v, sizeof(v));
+    }
+    qpci_io_writel(c->dev, c->bar, 0x1000 + q->qid * 8, q->sq_tail);
+}
+
+/*
+ * With shadow doorbells, only ring the doorbell when the head moves past
+ * the EventIdx published by the controller, like Linux does.
+ */
+static void nvmetest_ring_cq(NvmeTestCtrl *c, NvmeTestQueue *q,
+                             uint16_t old_head)
+{
+    if (q->qid && c->dbs) {
+        uint32_t v = cpu_to_le32(q->cq_head);
+        uint32_t ei;
+
+        memwrite(c->dbs + q->qid * 8 + 4, &v, sizeof(v));
+        memread(c->eis + q->qid * 8 + 4, &ei, sizeof(ei));
+        ei = le32_to_cpu(ei);
+        if ((uint16_t)(q->cq_head - ei - 1) >=
+            (uint16_t)(q->cq_head - old_head)) {
+            return;
+        }
+    }
+    qpci_io_writel(c->dev, c->bar, 0x1000 + q->qid * 8 + 4, q->cq_head);
+}
+
+/* Wait for the next completion and return its status */
+static uint16_t nvmetest_wait(NvmeTestCtrl *c, NvmeTestQueue *q)
+{
+    gint64 end = g_get_monotonic_time() + NVME_TEST_TIMEOUT_US;
+    uint16_t old_head = q->cq_head;
+    NvmeCqe cqe;
+
+    for (;;) {
+        memread(q->cq + q->cq_head * sizeof(cqe), &cqe, sizeof(cqe));
+        if ((le16_to_cpu(cqe.status) & 1) == q->phase) {
+            break;
+        }
+        g_assert(g_get_monotonic_time() < end);
+        clock_step(100);
+    }
+
+    q->cq_head = (q->cq_head + 1) % q->cq_size;
+    if (!q->cq_head) {
+        q->phase ^= 1;
+    }
+    nvmetest_ring_cq(c, q, old_head);
+    return le16_to_cpu(cqe.status) >> 1;
+}
+
+static uint16_t nvmetest_cmd(NvmeTestCtrl *c, NvmeTestQueue *q, NvmeCmd *cmd)
+{
+    nvmetest_queue_cmd(c, q, cmd);
+    nvmetest_ring_sq(c, q);
+    return nvmetest_wait(c, q);
+}
+
+static void nvmetest_start(NvmeTestCtrl *c, QNvme *nvme,
+                           QGuestAllocator *alloc)
+{
+    gint64 end = g_get_monotonic_time() + NVME_TEST_TIMEOUT_US;
+    uint32_t cc;
+
+    memset(c, 0, sizeof(*c));
+    c->dev = &nvme->dev;
+    c->alloc = alloc;
+    qpci_device_enable(c->dev);
+    c->bar = qpci_iomap(c->dev, 0, NULL);
+
+    nvmetest_queue_init(c, &c->admin, 0, NVME_TEST_QSIZE, NVME_TEST_QSIZE);
+    qpci_io_writel(c->dev, c->bar, 0x24,
+                   (NVME_TEST_QSIZE - 1) << 16 | (NVME_TEST_QSIZE - 1));
+    qpci_io_writel(c->dev, c->bar, 0x28, c->admin.sq);
+    qpci_io_writel(c->dev, c->bar, 0x2c, c->admin.sq >> 32);
+    qpci_io_writel(c->dev, c->bar, 0x30, c->admin.cq);
+    qpci_io_writel(c->dev, c->bar, 0x34, c->admin.cq >> 32);
+
+    cc = 1 << CC_EN_SHIFT | 6 << CC_IOSQES_SHIFT | 4 << CC_IOCQES_SHIFT;
+    qpci_io_writel(c->dev, c->bar, 0x14, cc);
+    while (!NVME_CSTS_RDY(qpci_io_readl(c->dev, c->bar, 0x1c))) {
+        g_assert(g_get_monotonic_time() < end);
+        clock_step(100);
+    }
+    g_assert_false(NVME_CSTS_CFS(qpci_io_readl(c->dev, c->bar, 0x1c)));
+}
+
+static void nvmetest_create_io_queues(NvmeTestCtrl *c, uint16_t sq_size,
+                                      uint16_t cq_size)
+{
+    NvmeCreateCq ccq = {
+        .opcode = NVME_ADM_CMD_CREATE_CQ,
+        .cqid = cpu_to_le16(1),
+        .qsize = cpu_to_le16(cq_size - 1),
+        .cq_flags = cpu_to_le16(NVME_Q_PC),
+    };
+    NvmeCreateSq csq = {
+        .opcode = NVME_ADM_CMD_CREATE_SQ,
+        .sqid = cpu_to_le16(1),
+        .qsize = cpu_to_le16(sq_size - 1),
+        .sq_flags = cpu_to_le16(NVME_Q_PC),
+        .cqid = cpu_to_le16(1),
+    };
+
+    nvmetest_queue_init(c, &c->io, 1, sq_size, cq_size);
+    ccq.prp1 = cpu_to_le64(c->io.cq);
+    csq.prp1 = cpu_to_le64(c->io.sq);
+    g_assert_cmphex(nvmetest_cmd(c, &c->admin, (NvmeCmd *)&ccq), ==,
+                    NVME_SUCCESS);
+    g_assert_cmphex(nvmetest_cmd(c, &c->admin, (NvmeCmd *)&csq), ==,
+                    NVME_SUCCESS);
+}
+
+static void nvmetest_read_cmd(NvmeRwCmd *rw, uint64_t slba, uint16_t nlb)
+{
+    memset(rw, 0, sizeof(*rw));
+    rw->opcode = NVME_CMD_READ;
+    rw->nsid = cpu_to_le32(1);
+    rw->slba = cpu_to_le64(slba);
+    rw->nlb = cpu_to_le16(nlb - 1);
+}
+
+static void nvmetest_sgl_desc(NvmeSglDescriptor *desc, uint8_t type,
+                              uint64_t addr, uint32_t len)
+{
+    memset(desc, 0, sizeof(*desc));
+    desc->addr = cpu_to_le64(addr);
+    desc->len = cpu_to_le32(len);
+    desc->type = type << 4;
+}
+
+static void nvmetest_identify_test(void *obj, void *data,
+                                   QGuestAllocator *alloc)
+{
+    NvmeTestCtrl c;
+    NvmeIdentify cmd = {
+        .opcode = NVME_ADM_CMD_IDENTIFY,
+        .cns = cpu_to_le32(1),
+    };
+    NvmeIdCtrl *id = g_new(NvmeIdCtrl, 1);
+    uint64_t buf;
+
+    if (nvmetest_skip_dma()) {
+        g_free(id);
+        return;
+    }
+    nvmetest_start(&c, obj, alloc);
+    buf = guest_alloc(alloc, sizeof(*id));
+    cmd.prp1 = cpu_to_le64(buf);
+    g_assert_cmphex(nvmetest_cmd(&c, &c.admin, (NvmeCmd *)&cmd), ==,
+                    NVME_SUCCESS);
+
+    memread(buf, id, sizeof(*id));
+    g_assert(le16_to_cpu(id->oacs) & NVME_OACS_DBBUF);
+    g_assert(le32_to_cpu(id->sgls) & NVME_SGLS_SUPPORTED);
+    g_free(id);
+}
+
+/*
+ * Fill the completion queue so that the controller has to publish its
+ * EventIdx, and check that the completions still trickle in when the
+ * guest only rings the doorbell when asked to.
+ */
+static void nvmetest_dbbuf_test(void *obj, void *data, QGuestAllocator *alloc)
+{
+    const int nr_cmds = 3;
+    NvmeTestCtrl c;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_DBBUF_CONFIG,
+    };
+    NvmeRwCmd rw;
+    uint64_t buf;
+    uint32_t ei;
+    gint64 end;
+    int i;
+
+    if (nvmetest_skip_dma()) {
+        return;
+    }
+    nvmetest_start(&c, obj, alloc);
+
+    /* Misaligned buffers are rejected */
+    c.dbs = guest_alloc(alloc, 4096);
+    c.eis = guest_alloc(alloc, 4096);
+    cmd.prp1 = cpu_to_le64(c.dbs + 8);
+    cmd.prp2 = cpu_to_le64(c.eis);
+    g_assert_cmphex(nvmetest_cmd(&c, &c.admin, &cmd), ==,
+                    NVME_INVALID_FIELD | NVME_DNR);
+
+    /* The controller writes the CQ EventIdx only when it has to wait */
+    qtest_memset(global_qtest, c.eis, 0xff, 4096);
+    cmd.prp1 = cpu_to_le64(c.dbs);
+    g_assert_cmphex(nvmetest_cmd(&c, &c.admin, &cmd), ==, NVME_SUCCESS);
+
+    /* Two CQ entries, so that a single unread completion fills the CQ */
+    nvmetest_create_io_queues(&c, NVME_TEST_QSIZE, 2);
+    buf = guest_alloc(alloc, 4096);
+
+    /*
+     * Each command completes while the completion of the previous one
+     * is still unread.
+     */
+    for (i = 0; i < nr_cmds; i++) {
+        nvmetest_read_cmd(&rw, i, 1);
+        rw.prp1 = cpu_to_le64(buf);
+        nvmetest_queue_cmd(&c, &c.io, (NvmeCmd *)&rw);
+        nvmetest_ring_sq(&c, &c.io);
+        if (i == 0) {
+            continue;
+        }
+
+        /* Wait until the controller finds the CQ full */
+        end = g_get_monotonic_time() + NVME_TEST_TIMEOUT_US;
+        do {
+            g_assert(g_get_monotonic_time() < end);
+            clock_step(100);
+            memread(c.eis + 8 + 4, &ei, sizeof(ei));
+        } while (le32_to_cpu(ei) != c.io.cq_head);
+
+        g_assert_cmphex(nvmetest_wait(&c, &c.io), ==, NVME_SUCCESS);
+        memset(&ei, 0xff, sizeof(ei));
+        memwrite(c.eis + 8 + 4, &ei, sizeof(ei));
+    }
+    g_assert_cmphex(nvmetest_wait(&c, &c.io), ==, NVME_SUCCESS);
+}
+
+static void nvmetest_sgl_test(void *obj, void *data, QGuestAllocator *alloc)
+{
+    NvmeTestCtrl c;
+    NvmeSglDescriptor segment[3];
+    uint8_t *pattern, *out;
+    NvmeRwCmd rw;
+    uint64_t buf, list;
+
+    if (nvmetest_skip_dma()) {
+        return;
+    }
+    nvmetest_start(&c, obj, alloc);
+    nvmetest_create_io_queues(&c, NVME_TEST_QSIZE, NVME_TEST_QSIZE);
+
+    buf = guest_alloc(alloc, 8192);
+    list = guest_alloc(alloc, 4096);
+    pattern = g_malloc(8192);
+    out = g_malloc(8192);
+    memset(pattern, 0xaa, 8192);
+
+    /* A single data block in the command */
+    memwrite(buf, pattern, 8192);
+    nvmetest_read_cmd(&rw, 0, 1);
+    rw.flags = NVME_PSDT_SGL_MPTR_CONTIGUOUS << 6;
+    nvmetest_sgl_desc(&rw.sgl, NVME_SGL_DESCR_TYPE_DATA_BLOCK, buf + 8, 512);
+    g_assert_cmphex(nvmetest_cmd(&c, &c.io, (NvmeCmd *)&rw), ==,
+                    NVME_SUCCESS);
+    memread(buf, out, 8192);
+    g_assert_cmphex(out[7], ==, 0xaa);
+    g_assert(buffer_is_zero(out + 8, 512));
+    g_assert_cmphex(out[8 + 512], ==, 0xaa);
+
+    /* A last segment with two data blocks that straddle a page */
+    memwrite(buf, pattern, 8192);
+    nvmetest_sgl_desc(&segment[0], NVME_SGL_DESCR_TYPE_DATA_BLOCK,
+                      buf + 4096 - 256, 512);
+    nvmetest_sgl_desc(&segment[1], NVME_SGL_DESCR_TYPE_DATA_BLOCK,
+                      buf + 6000, 1536);
+    memwrite(list, segment, 2 * sizeof(segment[0]));
+    nvmetest_read_cmd(&rw, 0, 4);
+    rw.flags = NVME_PSDT_SGL_MPTR_CONTIGUOUS << 6;
+    nvmetest_sgl_desc(&rw.sgl, NVME_SGL_DESCR_TYPE_LAST_SEGMENT, list,
+                      2 * sizeof(segment[0]));
+    g_assert_cmphex(nvmetest_cmd(&c, &c.io, (NvmeCmd *)&rw), ==,
+                    NVME_SUCCESS);
+    memread(buf, out, 8192);
+    g_assert_cmphex(out[4096 - 257], ==, 0xaa);
+    g_assert(buffer_is_zero(out + 4096 - 256, 512));
+    g_assert_cmphex(out[4096 + 256], ==, 0xaa);
+    g_assert_cmphex(out[5999], ==, 0xaa);
+    g_assert(buffer_is_zero(out + 6000, 1536));
+    g_assert_cmphex(out[7536], ==, 0xaa);
+
+    /* Too little data for the command */
+    nvmetest_read_cmd(&rw, 0, 8);
+    rw.flags = NVME_PSDT_SGL_MPTR_CONTIGUOUS << 6;
+    nvmetest_sgl_desc(&rw.sgl, NVME_SGL_DESCR_TYPE_LAST_SEGMENT, list,
+                      2 * sizeof(segment[0]));
+    g_assert_cmphex(nvmetest_cmd(&c, &c.io, (NvmeCmd *)&rw), ==,
+                    NVME_DATA_SGL_LEN_INVALID | NVME_DNR);
+
+    /* Bit bucket descriptors are not supported */
+    nvmetest_sgl_desc(&segment[2], NVME_SGL_DESCR_TYPE_BIT_BUCKET, 0, 512);
+    memwrite(list, segment, 3 * sizeof(segment[0]));
+    nvmetest_read_cmd(&rw, 0, 5);
+    rw.flags = NVME_PSDT_SGL_MPTR_CONTIGUOUS << 6;
+    nvmetest_sgl_desc(&rw.sgl, NVME_SGL_DESCR_TYPE_LAST_SEGMENT, list,
+                      3 * sizeof(segment[0]));
+    g_assert_cmphex(nvmetest_cmd(&c, &c.io, (NvmeCmd *)&rw), ==,
+                    NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR);
+
+    g_free(out);
+    g_free(pattern);
+}
+
 static void nvme_register_nodes(void)
 {
     QOSGraphEdgeOptions opts = {
         .extra_device_opts = "addr=04.0,drive=drv0,serial=foo",
-        .before_cmd_line = "-drive id=drv0,if=none,file=null-co://,format=raw",
+        .before_cmd_line = "-drive id=drv0,if=none,file=null-co://,"
+                           "file.read-zeroes=on,format=raw",
     };
 
     add_qpci_address(&opts, &(QPCIAddress) { .devfn = QPCI_DEVFN(4, 0) });
@@ -82,6 +455,9 @@ static void nvme_register_nodes(void)
     qos_add_test("oob-cmb-access", "nvme", nvmetest_oob_cmb_test, &(QOSGraphTestOptions) {
         .edge.extra_device_opts = "cmb_size_mb=2"
     });
+    qos_add_test("identify", "nvme", nvmetest_identify_test, NULL);
+    qos_add_test("dbbuf", "nvme", nvmetest_dbbuf_test, NULL);
+    qos_add_test("sgl", "nvme", nvmetest_sgl_test, NULL);
 }
 
 libqos_init(nvme_register_nodes);
@@ -0,0 +1,96 @@
+/*
+ * Count executed guest instructions
+ *
+ * Each vCPU counts in its own slot, so that vCPUs running in parallel do
+ * not write to the same cache line.  vCPUs past max_vcpus, such as the
+ * threads of a linux-user guest, share an atomic counter.
+ *
+ * With "arg=inline", the count is kept by inline ops rather than by a
+ * callback per instruction.  Inline ops update a single counter without
+ * atomics, so this mode refuses to run with several vCPUs; the threads of
+ * a linux-user guest may still race on it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <qemu-plugin.h>
+
+QEMU_PLUGIN_EXPORT int qemu_plugin_version = QEMU_PLUGIN_VERSION;
+
+typedef struct {
+    uint64_t count;
+} __attribute__((aligned(64))) VCPUCount;
+
+static VCPUCount *vcpu_counts;
+static unsigned int nb_vcpu_counts;
+static uint64_t shared_count;
+static bool do_inline;
+
+static void vcpu_insn_exec(unsigned int vcpu_index, void *userdata)
+{
+    if (vcpu_index < nb_vcpu_counts) {
+        vcpu_counts[vcpu_index].count++;
+    } else {
+        __atomic_fetch_add(&shared_count, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
+{
+    size_t n = qemu_plugin_tb_n_insns(tb);
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
+
+        if (do_inline) {
+            qemu_plugin_register_vcpu_insn_exec_inline(
+                insn, QEMU_PLUGIN_INLINE_ADD_U64, &shared_count, 1);
+        } else {
+            qemu_plugin_register_vcpu_insn_exec_cb(insn, vcpu_insn_exec, NULL);
+        }
+    }
+}
+
+static void plugin_exit(qemu_plugin_id_t id, void *userdata)
+{
+    uint64_t total = shared_count;
+    unsigned int i;
+
+    for (i = 0; i < nb_vcpu_counts; i++) {
+        total += vcpu_counts[i].count;
+    }
+    fprintf(stderr, "insns: %" PRIu64 "\n", total);
+}
+
+QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id,
+                                           const qemu_info_t *info,
+                                           int argc, char **argv)
+{
+    if (argc && !strcmp(argv[0], "inline")) {
+        do_inline = true;
+    }
+
+    if (do_inline) {
+        if (info->system_emulation && info->max_vcpus > 1) {
+            fprintf(stderr, "insn: arg=inline needs a single vCPU\n");
+            return -1;
+        }
+    } else {
+        nb_vcpu_counts = info->system_emulation ? info->max_vcpus : 1;
+        if (posix_memalign((void **)&vcpu_counts, sizeof(VCPUCount),
+                           nb_vcpu_counts * sizeof(VCPUCount))) {
+            return -1;
+        }
+        memset(vcpu_counts, 0, nb_vcpu_counts * sizeof(VCPUCount));
+    }
+
+    qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
+    qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Self-modifying code in hot loops
+ *
+ * A small function in a data page is called many times in a row while
+ * the caller keeps rewriting it, or keeps writing data next to it in the
+ * same page.  Every call must run the code as last written, whether QEMU
+ * runs it from plain translation blocks or from traces of hot blocks
+ * (-accel tcg,trace-threshold=N), and writes that miss the code must not
+ * disturb it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <minilib.h>
+
+#define PAGE_SIZE 4096
+#define ITERATIONS 100000
+/* Calls between two rewrites, enough for the code to become hot */
+#define REWRITE_PERIOD 1000
+
+/*
+ * Same encoding in 32-bit and 64-bit mode:
+ *
+ *      mov  $BASE, %eax
+ *      mov  $LOOPS, %ecx
+ *   1: add  $ADDEND, %eax
+ *      dec  %ecx
+ *      jnz  1b
+ *      ret
+ */
+#define LOOPS 4
+#define BASE_OFFSET 1
+#define ADDEND_OFFSET 11
+
+static const uint8_t code_template[] = {
+    0xb8, 0x00, 0x00, 0x00, 0x00,
+    0xb9, LOOPS, 0x00, 0x00, 0x00,
+    0x05, 0x00, 0x00, 0x00, 0x00,
+    0xff, 0xc9,
+    0x75, 0xf7,
+    0xc3,
+};
+
+/* The code and the data written next to it share a page */
+static struct {
+    uint8_t code[64];
+    uint32_t data[64];
+} __attribute__((aligned(PAGE_SIZE))) page;
+
+typedef uint32_t (*code_fn)(void);
+
+static void put32(int offset, uint32_t val)
+{
+    page.code[offset] = val;
+    page.code[offset + 1] = val >> 8;
+    page.code[offset + 2] = val >> 16;
+    page.code[offset + 3] = val >> 24;
+}
+
+static void init_code(uint32_t base, uint32_t addend)
+{
+    int i;
+
+    for (i = 0; i < sizeof(code_template); i++) {
+        page.code[i] = code_template[i];
+    }
+    put32(BASE_OFFSET, base);
+    put32(ADDEND_OFFSET, addend);
+}
+
+static bool check(const char *test, int i, uint32_t base, uint32_t addend)
+{
+    code_fn fn = (code_fn) page.code;
+    uint32_t expected = base + LOOPS * addend;
+    uint32_t ret = fn();
+
+    if (ret != expected) {
+        ml_printf("%s: iteration %d returned 0x%x instead of 0x%x\n",
+                  test, i, ret, expected);
+        return false;
+    }
+    return true;
+}
+
+/* Rewrite the loop body before every call */
+static bool test_rewrite_every_call(void)
+{
+    int i;
+
+    init_code(0, 0);
+    for (i = 0; i < ITERATIONS; i++) {
+        put32(ADDEND_OFFSET, i);
+        if (!check(__func__, i, 0, i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Let the code become hot, then rewrite it */
+static bool test_rewrite_hot_code(void)
+{
+    uint32_t base = 0, addend = 0;
+    int i;
+
+    init_code(base, addend);
+    for (i = 0; i < ITERATIONS; i++) {
+        if (i % REWRITE_PERIOD == 0) {
+            base = i;
+            addend = i / REWRITE_PERIOD;
+            put32(BASE_OFFSET, base);
+            put32(ADDEND_OFFSET, addend);
+        }
+        if (!check(__func__, i, base, addend)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Write to the code's page without touching the code */
+static bool test_write_next_to_code(void)
+{
+    int i;
+
+    init_code(0x1234, 0x10);
+    for (i = 0; i < ITERATIONS; i++) {
+        page.data[i % 64] = i;
+        if (!check(__func__, i, 0x1234, 0x10)) {
+            return false;
+        }
+    }
+
+    for (i = 0; i < 64; i++) {
+        /* The last iteration that wrote data[i] */
+        uint32_t expected = ITERATIONS - 1 - (ITERATIONS - 1 - i) % 64;
+
+        if (page.data[i] != expected) {
+            ml_printf("%s: data[%d] is 0x%x instead of 0x%x\n",
+                      __func__, i, page.data[i], expected);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(void)
+{
+    bool ok;
+
+    ok = test_rewrite_every_call() &&
+         test_rewrite_hot_code() &&
+         test_write_next_to_code();
+
+    ml_printf("Test complete: %s\n", ok ? "PASSED" : "FAILED");
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,168 @@
+/*
+ * Forward jumps out of hot loops
+ *
+ * A hot loop calls a small function that lives at a higher address, in a
+ * data page.  When the loop is retranslated as a trace
+ * (-accel tcg,trace-threshold=N), the jump to the function may leave out
+ * the stores of the registers and flags that the function overwrites
+ * before reading them.  The caller keeps rewriting the function, so that
+ * those registers and flags become inputs of the function: every call
+ * must still see the values the caller set.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <minilib.h>
+
+#define PAGE_SIZE 4096
+#define ITERATIONS 100000
+/* Calls between two rewrites, enough for the loop to become hot */
+#define REWRITE_PERIOD 1000
+
+#define CONSTANT 0x1234
+
+/*
+ * Same encoding in 32-bit and 64-bit mode.  The functions
+ * take their inputs in %eax, %edx and the flags, and return in %eax.
+ */
+
+/* mov $CONSTANT, %edx; add %edx, %eax; ret: %edx is overwritten */
+static const uint8_t add_constant[] = {
+    0xba, CONSTANT & 0xff, CONSTANT >> 8, 0x00, 0x00,
+    0x01, 0xd0,
+    0xc3,
+};
+
+/* add %edx, %eax; ret: %edx is an input */
+static const uint8_t add_edx[] = {
+    0x90, 0x90, 0x90, 0x90, 0x90,
+    0x01, 0xd0,
+    0xc3,
+};
+
+/* xor %eax, %eax; setc %al; ret: the flags are overwritten */
+static const uint8_t clear_carry[] = {
+    0x90, 0x90,
+    0x31, 0xc0,
+    0x0f, 0x92, 0xc0,
+    0xc3,
+};
+
+/* mov $0, %eax; setc %al; ret: the carry flag is an input */
+static const uint8_t get_carry[] = {
+    0xb8, 0x00, 0x00, 0x00, 0x00,
+    0x0f, 0x92, 0xc0,
+    0xc3,
+};
+
+/* Above the code of the loop, so that calls to it jump forward */
+static struct {
+    uint8_t code[64];
+} __attribute__((aligned(PAGE_SIZE))) page;
+
+/* The call must not overwrite the red zone of the calling function */
+#ifdef __x86_64__
+#define CALL_PAGE "lea -128(%%rsp), %%rsp\n\t" \
+                  "call page\n\t" \
+                  "lea 128(%%rsp), %%rsp"
+#else
+#define CALL_PAGE "call page"
+#endif
+
+static void set_code(const uint8_t *code, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        page.code[i] = code[i];
+    }
+}
+
+static uint32_t call_add(uint32_t a, uint32_t d)
+{
+    asm volatile(CALL_PAGE
+                 : "+a" (a), "+d" (d) : : "ecx", "memory", "cc");
+    return a;
+}
+
+static uint32_t call_carry(uint32_t a, uint32_t b)
+{
+    uint32_t ret;
+
+    /* Sets the carry flag if a < b */
+    asm volatile("cmp %2, %1\n\t"
+                 CALL_PAGE
+                 : "=&a" (ret) : "r" (a), "r" (b)
+                 : "edx", "ecx", "memory", "cc");
+    return ret;
+}
+
+/* Switch between overwriting %edx and reading it */
+static bool test_register_input(void)
+{
+    bool overwrite = false;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        uint32_t expected, ret;
+
+        if (i % REWRITE_PERIOD == 0) {
+            overwrite = !overwrite;
+            if (overwrite) {
+                set_code(add_constant, sizeof(add_constant));
+            } else {
+                set_code(add_edx, sizeof(add_edx));
+            }
+        }
+        expected = i + (overwrite ? CONSTANT : i * 3);
+        ret = call_add(i, i * 3);
+        if (ret != expected) {
+            ml_printf("%s: iteration %d returned 0x%x instead of 0x%x\n",
+                      __func__, i, ret, expected);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Switch between overwriting the flags and reading the carry flag */
+static bool test_flags_input(void)
+{
+    bool overwrite = false;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        uint32_t expected, ret;
+
+        if (i % REWRITE_PERIOD == 0) {
+            overwrite = !overwrite;
+            if (overwrite) {
+                set_code(clear_carry, sizeof(clear_carry));
+            } else {
+                set_code(get_carry, sizeof(get_carry));
+            }
+        }
+        /* Alternate between carry set and clear */
+        expected = overwrite ? 0 : i & 1;
+        ret = call_carry(i & 1 ? 0 : 1, 1);
+        if (ret != expected) {
+            ml_printf("%s: iteration %d returned %d instead of %d\n",
+                      __func__, i, ret, expected);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(void)
+{
+    bool ok;
+
+    ok = test_register_input() && test_flags_input();
+
+    ml_printf("Test complete: %s\n", ok ? "PASSED" : "FAILED");
+    return ok ? 0 : -1;
+}
@@ -11,6 +11,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu-common.h"
 #include "block/aio.h"
 #include "qapi/error.h"
 #include "qemu/timer.h"
@@ -876,6 +877,177 @@ static void test_queue_chaining(void)
     g_assert_cmpint(data_b.i, ==, data_b.max);
 }
 
+static void plug_call_cb(void *opaque)
+{
+    int *n = opaque;
+
+    (*n)++;
+}
+
+static void test_plug_nesting(void)
+{
+    int n = 0;
+
+    /* Outside a plug scope the call runs right away */
+    aio_io_plug_call(ctx, plug_call_cb, &n);
+    g_assert_cmpint(n, ==, 1);
+
+    aio_io_plug(ctx);
+    aio_io_plug(ctx);
+    g_assert(aio_io_plugged(ctx));
+    aio_io_plug_call(ctx, plug_call_cb, &n);
+    g_assert_cmpint(n, ==, 1);
+
+    /* Only closing the outermost scope runs it */
+    aio_io_unplug(ctx);
+    g_assert(aio_io_plugged(ctx));
+    g_assert_cmpint(n, ==, 1);
+
+    aio_io_unplug(ctx);
+    g_assert(!aio_io_plugged(ctx));
+    g_assert_cmpint(n, ==, 2);
+}
+
+static void test_plug_dedup(void)
+{
+    int a = 0, b = 0;
+
+    aio_io_plug(ctx);
+    aio_io_plug_call(ctx, plug_call_cb, &a);
+    aio_io_plug_call(ctx, plug_call_cb, &a);
+    aio_io_plug_call(ctx, plug_call_cb, &b);
+    aio_io_plug_call(ctx, plug_call_cb, &a);
+    aio_io_unplug(ctx);
+
+    g_assert_cmpint(a, ==, 1);
+    g_assert_cmpint(b, ==, 1);
+}
+
+static void test_plug_cancel(void)
+{
+    int a = 0, b = 0;
+
+    aio_io_plug(ctx);
+    aio_io_plug_call(ctx, plug_call_cb, &a);
+    aio_io_plug_call(ctx, plug_call_cb, &b);
+    aio_io_plug_cancel(ctx, plug_call_cb, &a);
+
+    /* Cancelling a call that is not deferred is harmless */
+    aio_io_plug_cancel(ctx, plug_call_cb, &a);
+    aio_io_unplug(ctx);
+
+    g_assert_cmpint(a, ==, 0);
+    g_assert_cmpint(b, ==, 1);
+}
+
+#ifdef CONFIG_POSIX
+/* Only aio-posix opens plug scopes in aio_poll() */
+typedef struct {
+    QEMUBH *bh;
+    int n;
+    int n_in_bh;
+} PlugBHTestData;
+
+static void plug_bh_cb(void *opaque)
+{
+    PlugBHTestData *data = opaque;
+
+    /* aio_poll() runs the bottom half inside a plug scope */
+    g_assert(aio_io_plugged(ctx));
+    aio_io_plug_call(ctx, plug_call_cb, &data->n);
+    data->n_in_bh = data->n;
+}
+
+static void test_plug_aio_poll(void)
+{
+    PlugBHTestData data = { .n = 0 };
+
+    /* Calls deferred by callbacks run when the round of callbacks ends */
+    data.bh = aio_bh_new(ctx, plug_bh_cb, &data);
+    qemu_bh_schedule(data.bh);
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n_in_bh, ==, 0);
+    g_assert_cmpint(data.n, ==, 1);
+
+    /*
+     * A nested aio_poll() may wait for requests that the outer scope has
+     * queued, so it runs the deferred calls first
+     */
+    aio_io_plug(ctx);
+    aio_io_plug_call(ctx, plug_call_cb, &data.n);
+    g_assert_cmpint(data.n, ==, 1);
+    aio_poll(ctx, false);
+    g_assert_cmpint(data.n, ==, 2);
+    g_assert(aio_io_plugged(ctx));
+    aio_io_unplug(ctx);
+    g_assert_cmpint(data.n, ==, 2);
+
+    qemu_bh_delete(data.bh);
+}
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+typedef struct {
+    int fd;
+    int n;
+    bool remove;
+} FdTestData;
+
+static void fd_read_cb(void *opaque)
+{
+    FdTestData *data = opaque;
+    char c;
+
+    data->n++;
+    if (data->remove) {
+        aio_set_fd_handler(ctx, data->fd, false, NULL, NULL, NULL, NULL);
+    } else {
+        g_assert_cmpint(read(data->fd, &c, 1), ==, 1);
+    }
+}
+
+static void test_io_uring_fd(void)
+{
+    FdTestData data = { .n = 0 };
+    int fds[2];
+
+    if (!ctx->fdmon_io_uring) {
+        g_test_skip("io_uring is not available");
+        return;
+    }
+
+    g_assert_cmpint(qemu_pipe(fds), ==, 0);
+    data.fd = fds[0];
+    aio_set_fd_handler(ctx, fds[0], false, fd_read_cb, NULL, NULL, &data);
+    while (aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 0);
+
+    /* The poll is re-armed after every event */
+    g_assert_cmpint(write(fds[1], "x", 1), ==, 1);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(write(fds[1], "x", 1), ==, 1);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 2);
+
+    /* No events once the handler is gone, even with one in flight */
+    aio_set_fd_handler(ctx, fds[0], false, NULL, NULL, NULL, NULL);
+    g_assert_cmpint(write(fds[1], "x", 1), ==, 1);
+    while (aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 2);
+    close(fds[0]);
+    close(fds[1]);
+
+    /* An fd that cannot be polled is reported to its handler */
+    data.remove = true;
+    aio_set_fd_handler(ctx, fds[0], false, fd_read_cb, NULL, NULL, &data);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 3);
+    while (aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 3);
+}
+#endif
+
 /* End of tests.  */
 
 int main(int argc, char **argv)
@@ -903,6 +1075,16 @@ int main(int argc, char **argv)
 
     g_test_add_func("/aio/coroutine/queue-chaining", test_queue_chaining);
 
+    g_test_add_func("/aio/plug/nesting",            test_plug_nesting);
+    g_test_add_func("/aio/plug/dedup",              test_plug_dedup);
+    g_test_add_func("/aio/plug/cancel",             test_plug_cancel);
+#ifdef CONFIG_POSIX
+    g_test_add_func("/aio/plug/aio-poll",           test_plug_aio_poll);
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    g_test_add_func("/aio/io-uring/fd",             test_io_uring_fd);
+#endif
+
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
     g_test_add_func("/aio-gsource/bh/schedule",             test_source_bh_schedule);
     g_test_add_func("/aio-gsource/bh/schedule10",           test_source_bh_schedule10);
@@ -10,6 +10,10 @@
 
 #include "qemu/osdep.h"
 #include "libqtest.h"
+#include "libqos/libqos.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qnum.h"
 #include "qemu/bswap.h"
 #include "qemu/module.h"
 #include "standard-headers/linux/virtio_blk.h"
@@ -23,6 +27,7 @@
 #define TEST_IMAGE_SIZE         (64 * 1024 * 1024)
 #define QVIRTIO_BLK_TIMEOUT_US  (30 * 1000 * 1000)
 #define PCI_SLOT_HP             0x06
+#define MQ_NUM_QUEUES           4
 
 typedef struct QVirtioBlkReq {
     uint32_t type;
@@ -552,6 +557,111 @@ static void msix(void *obj, void *u_data, QGuestAllocator *t_alloc)
     qvirtqueue_cleanup(dev->bus, vq, t_alloc);
 }
 
+/*
+ * With num-queues and two IOThreads, each IOThread serves half of the
+ * virtqueues.  Submit a request on every virtqueue before waiting for any
+ * of them, and read the data back through another virtqueue.
+ */
+static void multiqueue(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlkPCI *blk = obj;
+    QVirtioDevice *dev = &blk->pci_vdev.vdev;
+    QVirtQueue *vq[MQ_NUM_QUEUES];
+    uint64_t req_addr[MQ_NUM_QUEUES];
+    uint32_t free_head[MQ_NUM_QUEUES];
+    QVirtioBlkReq req;
+    uint32_t features;
+    uint8_t status;
+    char *data;
+    char *expected;
+    int i, j;
+
+    features = qvirtio_get_features(dev);
+    g_assert(features & (1u << VIRTIO_BLK_F_MQ));
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                    (1u << VIRTIO_RING_F_EVENT_IDX) |
+                    (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    g_assert_cmpint(qvirtio_config_readw(dev,
+                        offsetof(struct virtio_blk_config, num_queues)),
+                    ==, MQ_NUM_QUEUES);
+
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        vq[i] = qvirtqueue_setup(dev, t_alloc, i);
+    }
+
+    qvirtio_set_driver_ok(dev);
+
+    /* Write sector i through virtqueue i */
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        req.type = VIRTIO_BLK_T_OUT;
+        req.ioprio = 1;
+        req.sector = i;
+        req.data = g_malloc0(512);
+        sprintf(req.data, "TEST%d", i);
+
+        req_addr[i] = virtio_blk_request(t_alloc, dev, &req, 512);
+
+        g_free(req.data);
+
+        free_head[i] = qvirtqueue_add(vq[i], req_addr[i], 16, false, true);
+        qvirtqueue_add(vq[i], req_addr[i] + 16, 512, false, true);
+        qvirtqueue_add(vq[i], req_addr[i] + 528, 1, true, false);
+        qvirtqueue_kick(dev, vq[i], free_head[i]);
+    }
+
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        qvirtio_wait_used_elem(dev, vq[i], free_head[i], NULL,
+                               QVIRTIO_BLK_TIMEOUT_US);
+        status = readb(req_addr[i] + 528);
+        g_assert_cmpint(status, ==, 0);
+        guest_free(t_alloc, req_addr[i]);
+    }
+
+    /* Read sector i through a virtqueue served by the other IOThread */
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        j = (i + 1) % MQ_NUM_QUEUES;
+
+        req.type = VIRTIO_BLK_T_IN;
+        req.ioprio = 1;
+        req.sector = i;
+        req.data = g_malloc0(512);
+
+        req_addr[j] = virtio_blk_request(t_alloc, dev, &req, 512);
+
+        g_free(req.data);
+
+        free_head[j] = qvirtqueue_add(vq[j], req_addr[j], 16, false, true);
+        qvirtqueue_add(vq[j], req_addr[j] + 16, 512, true, true);
+        qvirtqueue_add(vq[j], req_addr[j] + 528, 1, true, false);
+        qvirtqueue_kick(dev, vq[j], free_head[j]);
+    }
+
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        j = (i + 1) % MQ_NUM_QUEUES;
+
+        qvirtio_wait_used_elem(dev, vq[j], free_head[j], NULL,
+                               QVIRTIO_BLK_TIMEOUT_US);
+        status = readb(req_addr[j] + 528);
+        g_assert_cmpint(status, ==, 0);
+
+        data = g_malloc0(512);
+        expected = g_strdup_printf("TEST%d", i);
+        memread(req_addr[j] + 16, data, 512);
+        g_assert_cmpstr(data, ==, expected);
+        g_free(expected);
+        g_free(data);
+
+        guest_free(t_alloc, req_addr[j]);
+    }
+
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        qvirtqueue_cleanup(dev->bus, vq[i], t_alloc);
+    }
+}
+
 static void idx(void *obj, void *u_data, QGuestAllocator *t_alloc)
 {
     QVirtQueue *vq;
@@ -748,6 +858,88 @@ static void resize(void *obj, void *data, QGuestAllocator *t_alloc)
 
 }
 
+/*
+ * A write that fails with werror=stop is submitted again by 'cont'.  It
+ * must be counted once in the queue depth, not once per submission.
+ */
+static void retry(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    QVirtioBlkReq req;
+    QVirtQueue *vq;
+    QDict *resp, *stats, *hist;
+    const QListEntry *entry;
+    QList *bins;
+    uint64_t req_addr;
+    uint32_t features;
+    uint32_t free_head;
+    uint8_t status;
+    int i;
+
+    vq = qvirtqueue_setup(dev, t_alloc, 0);
+
+    features = qvirtio_get_features(dev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                    (1u << VIRTIO_RING_F_EVENT_IDX) |
+                    (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    qvirtio_set_driver_ok(dev);
+
+    /* The first submission fails and stops the VM, the second succeeds */
+    req.type = VIRTIO_BLK_T_OUT;
+    req.ioprio = 1;
+    req.sector = 0;
+    req.data = g_malloc0(512);
+    strcpy(req.data, "TEST");
+
+    req_addr = virtio_blk_request(t_alloc, dev, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(vq, req_addr, 16, false, true);
+    qvirtqueue_add(vq, req_addr + 16, 512, false, true);
+    qvirtqueue_add(vq, req_addr + 528, 1, true, false);
+
+    qvirtqueue_kick(dev, vq, free_head);
+
+    qmp_eventwait("STOP");
+    qmp_discard_response("{ 'execute': 'cont' }");
+
+    qvirtio_wait_used_elem(dev, vq, free_head, NULL, QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+
+    guest_free(t_alloc, req_addr);
+
+    /* Both submissions saw a single request in flight */
+    resp = qmp("{ 'execute': 'query-blockstats' }");
+    g_assert(qdict_haskey(resp, "return"));
+    entry = qlist_first(qdict_get_qlist(resp, "return"));
+    g_assert(entry);
+    stats = qdict_get_qdict(qobject_to(QDict, qlist_entry_obj(entry)),
+                            "stats");
+    g_assert_cmpint(qdict_get_int(stats, "wr_operations"), ==, 1);
+
+    hist = qdict_get_qdict(stats, "wr_queue_depth_histogram");
+    g_assert(hist);
+    bins = qdict_get_qlist(hist, "bins");
+    i = 0;
+    QLIST_FOREACH_ENTRY(bins, entry) {
+        uint64_t count = qnum_get_uint(qobject_to(QNum,
+                                                  qlist_entry_obj(entry)));
+
+        g_assert_cmpuint(count, ==, i == 1 ? 2 : 0);
+        i++;
+    }
+    g_assert_cmpint(i, ==, 2);
+    qobject_unref(resp);
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
 static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
 {
     char *tmp_path = drive_create();
@@ -760,16 +952,49 @@ static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
     return arg;
 }
 
+static void *virtio_blk_retry_setup(GString *cmd_line, void *arg)
+{
+    char *tmp_path = drive_create();
+    char *debug_path = g_strdup("/tmp/qtest-blkdebug.XXXXXX");
+    int fd;
+
+    fd = mkstemp(debug_path);
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+    g_test_queue_destroy(drive_destroy, debug_path);
+
+    prepare_blkdebug_script(debug_path, "write_aio");
+
+    g_string_append_printf(cmd_line,
+                           " -drive if=none,id=drive0,file=blkdebug:%s:%s,"
+                           "format=raw,werror=stop,auto-read-only=off ",
+                           debug_path, tmp_path);
+
+    return arg;
+}
+
+static void *virtio_blk_test_setup_iothreads(GString *cmd_line, void *arg)
+{
+    g_string_append(cmd_line,
+                    " -object iothread,id=iothread0"
+                    " -object iothread,id=iothread1 ");
+    return virtio_blk_test_setup(cmd_line, arg);
+}
+
 static void register_virtio_blk_test(void)
 {
     QOSGraphTestOptions opts = {
         .before = virtio_blk_test_setup,
     };
+    QOSGraphTestOptions retry_opts = {
+        .before = virtio_blk_retry_setup,
+    };
 
     qos_add_test("indirect", "virtio-blk", indirect, &opts);
     qos_add_test("config", "virtio-blk", config, &opts);
     qos_add_test("basic", "virtio-blk", basic, &opts);
     qos_add_test("resize", "virtio-blk", resize, &opts);
+    qos_add_test("retry", "virtio-blk", retry, &retry_opts);
 
     /* tests just for virtio-blk-pci */
     qos_add_test("msix", "virtio-blk-pci", msix, &opts);
@@ -777,6 +1002,11 @@ static void register_virtio_blk_test(void)
     qos_add_test("nxvirtq", "virtio-blk-pci",
                       test_nonexistent_virtqueue, &opts);
     qos_add_test("hotplug", "virtio-blk-pci", pci_hotplug, &opts);
+
+    opts.before = virtio_blk_test_setup_iothreads;
+    opts.edge.extra_device_opts = "num-queues=" stringify(MQ_NUM_QUEUES)
+                                  ",iothreads=iothread0:iothread1";
+    qos_add_test("multiqueue", "virtio-blk-pci", multiqueue, &opts);
 }
 
 libqos_init(register_virtio_blk_test);
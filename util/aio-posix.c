@@ -22,6 +22,10 @@
 #ifdef CONFIG_EPOLL_CREATE1
 #include <sys/epoll.h>
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+#include <poll.h>
+#include <liburing.h>
+#endif
 
 struct AioHandler
 {
@@ -35,6 +39,10 @@ struct AioHandler
     void *opaque;
     bool is_external;
     QLIST_ENTRY(AioHandler) node;
+#ifdef CONFIG_LINUX_IO_URING
+    QSLIST_ENTRY(AioHandler) node_submitted;
+    unsigned flags; /* AIO_IO_URING_* */
+#endif
 };
 
 #ifdef CONFIG_EPOLL_CREATE1
@@ -186,6 +194,383 @@ static bool aio_epoll_check_poll(AioContext *ctx, GPollFD *pfds,
 
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+
+/* Size of the submission queue of the fd monitoring ring */
+#define AIO_IO_URING_ENTRIES 128
+
+/*
+ * AioHandler::flags.  IORING_OP_POLL_ADD is one-shot and asynchronous, so
+ * the kernel may still reference a handler after it has been removed from
+ * ctx->aio_handlers.  A handler is freed only once it is unlinked, not on
+ * the submit list and not armed in the kernel; whoever clears the last of
+ * these conditions frees it.
+ */
+enum {
+    AIO_IO_URING_PENDING  = (1 << 0), /* on fdmon_io_uring_submit_list */
+    AIO_IO_URING_ADD      = (1 << 1), /* IORING_OP_POLL_ADD is needed */
+    AIO_IO_URING_REMOVE   = (1 << 2), /* handler deleted, cancel its poll */
+    AIO_IO_URING_ARMED    = (1 << 3), /* IORING_OP_POLL_ADD is in flight */
+    AIO_IO_URING_UNLINKED = (1 << 4), /* removed from ctx->aio_handlers */
+};
+
+static inline bool aio_io_uring_can_free(unsigned flags)
+{
+    return (flags & AIO_IO_URING_UNLINKED) &&
+           !(flags & (AIO_IO_URING_PENDING | AIO_IO_URING_ARMED));
+}
+
+static inline int poll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? POLLIN : 0) |
+           (pfd_events & G_IO_OUT ? POLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? POLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? POLLERR : 0);
+}
+
+static inline int pfd_events_from_poll(int poll_events)
+{
+    return (poll_events & POLLIN ? G_IO_IN : 0) |
+           (poll_events & POLLOUT ? G_IO_OUT : 0) |
+           (poll_events & POLLHUP ? G_IO_HUP : 0) |
+           (poll_events & POLLERR ? G_IO_ERR : 0);
+}
+
+static bool aio_io_uring_enabled(AioContext *ctx)
+{
+    /* Fall back to ppoll when external clients are disabled. */
+    return ctx->fdmon_io_uring && !aio_external_disabled(ctx);
+}
+
+static void aio_io_uring_enqueue(AioContext *ctx, AioHandler *node,
+                                 unsigned flags)
+{
+    unsigned old_flags;
+
+    old_flags = atomic_fetch_or(&node->flags, AIO_IO_URING_PENDING | flags);
+    if (!(old_flags & AIO_IO_URING_PENDING)) {
+        QSLIST_INSERT_HEAD_ATOMIC(&ctx->fdmon_io_uring_submit_list, node,
+                                  node_submitted);
+    }
+}
+
+/*
+ * Clear the submit list flags of a node taken off the submit list, marking it
+ * armed if a POLL_ADD is about to be submitted.  Returns the previous flags.
+ */
+static unsigned aio_io_uring_dequeue(AioHandler *node, unsigned *new_flags)
+{
+    unsigned old_flags = atomic_read(&node->flags);
+
+    /*
+     * AIO_IO_URING_REMOVE is sticky: it tells the completion path not to
+     * re-arm the poll once the kernel is done with it.
+     */
+    for (;;) {
+        unsigned seen;
+
+        *new_flags = old_flags & ~(AIO_IO_URING_PENDING | AIO_IO_URING_ADD);
+        if (old_flags & AIO_IO_URING_ADD) {
+            *new_flags |= AIO_IO_URING_ARMED;
+        }
+        seen = atomic_cmpxchg(&node->flags, old_flags, *new_flags);
+        if (seen == old_flags) {
+            return old_flags;
+        }
+        old_flags = seen;
+    }
+}
+
+static void aio_io_uring_update(AioContext *ctx, AioHandler *old_node,
+                                AioHandler *new_node)
+{
+    if (!ctx->fdmon_io_uring) {
+        return;
+    }
+    if (new_node && new_node->pfd.events) {
+        aio_io_uring_enqueue(ctx, new_node, AIO_IO_URING_ADD);
+    }
+    if (old_node) {
+        aio_io_uring_enqueue(ctx, old_node, AIO_IO_URING_REMOVE);
+    }
+}
+
+static struct io_uring_sqe *aio_io_uring_get_sqe(AioContext *ctx)
+{
+    struct io_uring *ring = ctx->fdmon_io_uring;
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    int ret;
+
+    if (likely(sqe)) {
+        return sqe;
+    }
+
+    /* No free sqes left, submit pending sqes first */
+    do {
+        ret = io_uring_submit(ring);
+    } while (ret == -EINTR);
+
+    assert(ret > 0);
+    sqe = io_uring_get_sqe(ring);
+    assert(sqe);
+    return sqe;
+}
+
+static void aio_io_uring_add_poll_add_sqe(AioContext *ctx, AioHandler *node)
+{
+    struct io_uring_sqe *sqe = aio_io_uring_get_sqe(ctx);
+
+    io_uring_prep_poll_add(sqe, node->pfd.fd,
+                           poll_events_from_pfd(node->pfd.events));
+    io_uring_sqe_set_data(sqe, node);
+}
+
+static void aio_io_uring_add_poll_remove_sqe(AioContext *ctx,
+                                             AioHandler *node)
+{
+    struct io_uring_sqe *sqe = aio_io_uring_get_sqe(ctx);
+
+    /*
+     * The POLL_REMOVE completion itself carries no handler.  Open-code
+     * io_uring_prep_poll_remove() since its argument type differs across
+     * liburing versions.
+     */
+    io_uring_prep_rw(IORING_OP_POLL_REMOVE, sqe, -1, node, 0, 0);
+    io_uring_sqe_set_data(sqe, NULL);
+}
+
+/* Place the changes queued by aio_set_fd_handler() on the submission queue */
+static void aio_io_uring_fill_sq_ring(AioContext *ctx)
+{
+    QSLIST_HEAD(, AioHandler) submit_list;
+    AioHandler *node;
+
+    QSLIST_MOVE_ATOMIC(&submit_list, &ctx->fdmon_io_uring_submit_list);
+
+    while ((node = QSLIST_FIRST(&submit_list))) {
+        unsigned old_flags, new_flags;
+
+        QSLIST_REMOVE_HEAD(&submit_list, node_submitted);
+        old_flags = aio_io_uring_dequeue(node, &new_flags);
+
+        /* Order matters, just in case both flags were set */
+        if (old_flags & AIO_IO_URING_ADD) {
+            aio_io_uring_add_poll_add_sqe(ctx, node);
+        }
+        if (old_flags & AIO_IO_URING_REMOVE) {
+            if (new_flags & AIO_IO_URING_ARMED) {
+                aio_io_uring_add_poll_remove_sqe(ctx, node);
+            } else if (aio_io_uring_can_free(new_flags)) {
+                atomic_dec(&ctx->fdmon_io_uring_deferred_frees);
+                g_free(node);
+            }
+        }
+    }
+}
+
+/* Returns true if @cqe made a handler ready */
+static bool aio_io_uring_process_cqe(AioContext *ctx,
+                                     struct io_uring_cqe *cqe)
+{
+    AioHandler *node = io_uring_cqe_get_data(cqe);
+    unsigned old_flags;
+
+    /* Timeouts and POLL_REMOVE have no AioHandler */
+    if (!node) {
+        return false;
+    }
+
+    if (!(atomic_read(&node->flags) & AIO_IO_URING_REMOVE)) {
+        bool ready = true;
+
+        if (cqe->res >= 0) {
+            node->pfd.revents |= pfd_events_from_poll(cqe->res);
+        } else if (cqe->res == -EINTR || cqe->res == -EAGAIN ||
+                   cqe->res == -ENOMEM || cqe->res == -ECANCELED) {
+            /* Nothing happened on the fd, just try again */
+            ready = false;
+        } else {
+            /*
+             * The fd cannot be polled, e.g. because it was closed under
+             * the handler's feet.  Let the handler find out, as it would
+             * with poll(2) returning POLLERR.
+             */
+            node->pfd.revents |= G_IO_ERR;
+        }
+
+        /* IORING_OP_POLL_ADD is one-shot so we must re-arm it */
+        aio_io_uring_add_poll_add_sqe(ctx, node);
+        return ready;
+    }
+
+    /*
+     * The handler was deleted, so the kernel is done with it.  Free it if
+     * aio_set_fd_handler() already unlinked it.
+     */
+    old_flags = atomic_fetch_and(&node->flags, ~AIO_IO_URING_ARMED);
+    if (aio_io_uring_can_free(old_flags & ~AIO_IO_URING_ARMED)) {
+        atomic_dec(&ctx->fdmon_io_uring_deferred_frees);
+        g_free(node);
+    }
+    return false;
+}
+
+static int aio_io_uring_process_cq_ring(AioContext *ctx)
+{
+    struct io_uring *ring = ctx->fdmon_io_uring;
+    struct io_uring_cqe *cqe;
+    unsigned num_cqes = 0;
+    unsigned num_ready = 0;
+    unsigned head;
+
+    io_uring_for_each_cqe(ring, head, cqe) {
+        if (aio_io_uring_process_cqe(ctx, cqe)) {
+            num_ready++;
+        }
+        num_cqes++;
+    }
+
+    io_uring_cq_advance(ring, num_cqes);
+    return num_ready;
+}
+
+/*
+ * Submit pending poll changes and wait for ready handlers in a single
+ * io_uring_enter(2) call.  Returns the number of ready handlers, whose
+ * pfd.revents have been filled in.
+ */
+static int aio_io_uring_wait(AioContext *ctx, int64_t timeout)
+{
+    struct __kernel_timespec ts;
+    unsigned wait_nr = 1; /* block until at least one cqe is ready */
+    int ret;
+
+    if (timeout == 0) {
+        wait_nr = 0; /* non-blocking */
+    } else if (timeout > 0) {
+        struct io_uring_sqe *sqe = aio_io_uring_get_sqe(ctx);
+
+        /* The timeout self-cancels when another cqe becomes ready */
+        ts.tv_sec = timeout / NANOSECONDS_PER_SECOND;
+        ts.tv_nsec = timeout % NANOSECONDS_PER_SECOND;
+        io_uring_prep_timeout(sqe, &ts, 1, 0);
+        io_uring_sqe_set_data(sqe, NULL);
+    }
+
+    aio_io_uring_fill_sq_ring(ctx);
+
+    do {
+        ret = io_uring_submit_and_wait(ctx->fdmon_io_uring, wait_nr);
+    } while (ret == -EINTR);
+
+    assert(ret >= 0);
+
+    return aio_io_uring_process_cq_ring(ctx);
+}
+
+/* Do we need io_uring_enter(2) even though polling made progress? */
+static bool aio_io_uring_need_wait(AioContext *ctx)
+{
+    struct io_uring *ring = ctx->fdmon_io_uring;
+
+    if (!aio_io_uring_enabled(ctx)) {
+        return false;
+    }
+    return io_uring_cq_ready(ring) || io_uring_sq_ready(ring) ||
+           atomic_read(&QSLIST_FIRST(&ctx->fdmon_io_uring_submit_list));
+}
+
+static bool aio_io_uring_setup(AioContext *ctx)
+{
+    struct io_uring *ring = g_new0(struct io_uring, 1);
+    int ret;
+
+    ret = io_uring_queue_init(AIO_IO_URING_ENTRIES, ring, 0);
+    if (ret != 0) {
+        g_free(ring);
+        return false;
+    }
+
+    QSLIST_INIT(&ctx->fdmon_io_uring_submit_list);
+    ctx->fdmon_io_uring = ring;
+    return true;
+}
+
+static void aio_io_uring_destroy(AioContext *ctx)
+{
+    struct io_uring *ring = ctx->fdmon_io_uring;
+
+    if (!ring) {
+        return;
+    }
+
+    /*
+     * Deleted handlers may still be referenced by in-flight polls.  Every
+     * one of them has a POLL_REMOVE queued or a completion on the way, so
+     * keep reaping until the kernel has let go of all of them.
+     */
+    while (atomic_read(&ctx->fdmon_io_uring_deferred_frees) > 0) {
+        int ret;
+
+        aio_io_uring_fill_sq_ring(ctx);
+        do {
+            ret = io_uring_submit_and_wait(ring, 1);
+        } while (ret == -EINTR);
+        assert(ret >= 0);
+        aio_io_uring_process_cq_ring(ctx);
+    }
+
+    io_uring_queue_exit(ring);
+    g_free(ring);
+    ctx->fdmon_io_uring = NULL;
+}
+
+/*
+ * Free a handler that has been unlinked from ctx->aio_handlers.  With
+ * io_uring the kernel may still hold a reference to it, in which case the
+ * submission or completion path frees it later.
+ */
+static void aio_free_handler(AioContext *ctx, AioHandler *node)
+{
+    unsigned old_flags;
+
+    old_flags = atomic_fetch_or(&node->flags, AIO_IO_URING_UNLINKED);
+    if (aio_io_uring_can_free(old_flags | AIO_IO_URING_UNLINKED)) {
+        g_free(node);
+    } else {
+        atomic_inc(&ctx->fdmon_io_uring_deferred_frees);
+    }
+}
+
+#else
+
+static bool aio_io_uring_enabled(AioContext *ctx)
+{
+    return false;
+}
+
+static void aio_io_uring_update(AioContext *ctx, AioHandler *old_node,
+                                AioHandler *new_node)
+{
+}
+
+static int aio_io_uring_wait(AioContext *ctx, int64_t timeout)
+{
+    assert(false);
+}
+
+static bool aio_io_uring_need_wait(AioContext *ctx)
+{
+    return false;
+}
+
+static void aio_free_handler(AioContext *ctx, AioHandler *node)
+{
+    g_free(node);
+}
+
+#endif
+
 static AioHandler *find_aio_handler(AioContext *ctx, int fd)
 {
     AioHandler *node;
@@ -298,11 +683,12 @@ void aio_set_fd_handler(AioContext *ctx,
         /* Unregister deleted fd_handler */
         aio_epoll_update(ctx, node, false);
     }
+    aio_io_uring_update(ctx, node, new_node);
     qemu_lockcnt_unlock(&ctx->list_lock);
     aio_notify(ctx);
 
     if (deleted) {
-        g_free(node);
+        aio_free_handler(ctx, node);
     }
 }
 
@@ -444,7 +830,7 @@ static bool aio_dispatch_handlers(AioContext *ctx)
         if (node->deleted) {
             if (qemu_lockcnt_dec_if_lock(&ctx->list_lock)) {
                 QLIST_REMOVE(node, node);
-                g_free(node);
+                aio_free_handler(ctx, node);
                 qemu_lockcnt_inc_and_unlock(&ctx->list_lock);
             }
         }
@@ -455,12 +841,14 @@ static bool aio_dispatch_handlers(AioContext *ctx)
 
 void aio_dispatch(AioContext *ctx)
 {
+    aio_io_plug(ctx);
     qemu_lockcnt_inc(&ctx->list_lock);
     aio_bh_poll(ctx);
     aio_dispatch_handlers(ctx);
     qemu_lockcnt_dec(&ctx->list_lock);
 
     timerlistgroup_run_timers(&ctx->tlg);
+    aio_io_unplug(ctx);
 }
 
 /* These thread-local variables are used only in a small part of aio_poll
@@ -618,6 +1006,13 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     assert(in_aio_context_home_thread(ctx));
 
+    /* Requests issued by the callbacks of this round are submitted together
+     * when it ends.  A nested aio_poll() may be waiting for requests that
+     * the outer round has queued, so push them out first.
+     */
+    aio_io_plug_flush(ctx);
+    aio_io_plug(ctx);
+
     /* aio_notify can avoid the expensive event_notifier_set if
      * everything (file descriptors, bottom halves, timers) will
      * be re-evaluated before the next blocking poll().  This is
@@ -642,12 +1037,20 @@ bool aio_poll(AioContext *ctx, bool blocking)
     /* If polling is allowed, non-blocking aio_poll does not need the
      * system call---a single round of run_poll_handlers_once suffices.
      */
-    if (timeout || atomic_read(&ctx->poll_disable_cnt)) {
+    if (timeout || atomic_read(&ctx->poll_disable_cnt) ||
+        aio_io_uring_need_wait(ctx)) {
+        bool use_io_uring = aio_io_uring_enabled(ctx);
+
         assert(npfd == 0);
 
+        /* Polling handlers may have queued requests */
+        if (timeout) {
+            aio_io_plug_flush(ctx);
+        }
+
         /* fill pollfds */
 
-        if (!aio_epoll_enabled(ctx)) {
+        if (!aio_epoll_enabled(ctx) && !use_io_uring) {
             QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
                 if (!node->deleted && node->pfd.events
                     && aio_node_check(ctx, node->is_external)) {
@@ -657,7 +1060,10 @@ bool aio_poll(AioContext *ctx, bool blocking)
         }
 
         /* wait until next event */
-        if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
+        if (use_io_uring) {
+            /* revents are filled in directly, npfd stays 0 */
+            ret = aio_io_uring_wait(ctx, timeout);
+        } else if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
             AioHandler epoll_handler;
 
             epoll_handler.pfd.fd = ctx->epollfd;
@@ -735,11 +1141,18 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     progress |= timerlistgroup_run_timers(&ctx->tlg);
 
+    aio_io_unplug(ctx);
     return progress;
 }
 
 void aio_context_setup(AioContext *ctx)
 {
+#ifdef CONFIG_LINUX_IO_URING
+    /* Prefer io_uring, epoll is only used if the kernel lacks it */
+    if (aio_io_uring_setup(ctx)) {
+        return;
+    }
+#endif
 #ifdef CONFIG_EPOLL_CREATE1
     assert(!ctx->epollfd);
     ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
@@ -754,6 +1167,9 @@ void aio_context_setup(AioContext *ctx)
 
 void aio_context_destroy(AioContext *ctx)
 {
+#ifdef CONFIG_LINUX_IO_URING
+    aio_io_uring_destroy(ctx);
+#endif
 #ifdef CONFIG_EPOLL_CREATE1
     aio_epoll_disable(ctx);
 #endif
@@ -276,9 +276,20 @@ aio_ctx_finalize(GSource     *source)
     }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (ctx->linux_io_uring) {
+        luring_detach_aio_context(ctx->linux_io_uring, ctx);
+        luring_cleanup(ctx->linux_io_uring);
+        ctx->linux_io_uring = NULL;
+    }
+#endif
+
     assert(QSLIST_EMPTY(&ctx->scheduled_coroutines));
     qemu_bh_delete(ctx->co_schedule_bh);
 
+    assert(!ctx->io_plugged && ctx->io_plug_calls->len == 0);
+    g_array_free(ctx->io_plug_calls, true);
+
     qemu_lockcnt_lock(&ctx->list_lock);
     assert(!qemu_lockcnt_count(&ctx->list_lock));
     while (ctx->first_bh) {
@@ -340,6 +351,109 @@ LinuxAioState *aio_get_linux_aio(AioContext *ctx)
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
+{
+    if (ctx->linux_io_uring) {
+        return ctx->linux_io_uring;
+    }
+
+    ctx->linux_io_uring = luring_init(errp);
+    if (!ctx->linux_io_uring) {
+        return NULL;
+    }
+
+    luring_attach_aio_context(ctx->linux_io_uring, ctx);
+    return ctx->linux_io_uring;
+}
+
+LuringState *aio_get_linux_io_uring(AioContext *ctx)
+{
+    assert(ctx->linux_io_uring);
+    return ctx->linux_io_uring;
+}
+#endif
+
+typedef struct AioPlugCall {
+    void (*fn)(void *);
+    void *opaque;
+} AioPlugCall;
+
+void aio_io_plug(AioContext *ctx)
+{
+    if (in_aio_context_home_thread(ctx)) {
+        ctx->io_plugged++;
+    }
+}
+
+void aio_io_unplug(AioContext *ctx)
+{
+    if (!in_aio_context_home_thread(ctx)) {
+        return;
+    }
+
+    assert(ctx->io_plugged);
+    if (--ctx->io_plugged == 0) {
+        aio_io_plug_flush(ctx);
+    }
+}
+
+bool aio_io_plugged(AioContext *ctx)
+{
+    return ctx->io_plugged && in_aio_context_home_thread(ctx);
+}
+
+void aio_io_plug_call(AioContext *ctx, void (*fn)(void *), void *opaque)
+{
+    AioPlugCall call = { .fn = fn, .opaque = opaque };
+    guint i;
+
+    if (!aio_io_plugged(ctx)) {
+        fn(opaque);
+        return;
+    }
+
+    for (i = 0; i < ctx->io_plug_calls->len; i++) {
+        AioPlugCall *c = &g_array_index(ctx->io_plug_calls, AioPlugCall, i);
+
+        if (c->fn == fn && c->opaque == opaque) {
+            return;
+        }
+    }
+    g_array_append_val(ctx->io_plug_calls, call);
+}
+
+void aio_io_plug_cancel(AioContext *ctx, void (*fn)(void *), void *opaque)
+{
+    guint i;
+
+    if (!in_aio_context_home_thread(ctx)) {
+        return;
+    }
+
+    for (i = 0; i < ctx->io_plug_calls->len; i++) {
+        AioPlugCall *c = &g_array_index(ctx->io_plug_calls, AioPlugCall, i);
+
+        if (c->fn == fn && c->opaque == opaque) {
+            g_array_remove_index(ctx->io_plug_calls, i);
+            return;
+        }
+    }
+}
+
+void aio_io_plug_flush(AioContext *ctx)
+{
+    /* Remove each call before running it, the function may add new calls
+     * or flush again from a nested aio_poll() */
+    while (ctx->io_plug_calls->len) {
+        guint last = ctx->io_plug_calls->len - 1;
+        AioPlugCall call = g_array_index(ctx->io_plug_calls, AioPlugCall, last);
+
+        g_array_set_size(ctx->io_plug_calls, last);
+        call.fn(call.opaque);
+    }
+}
+
 void aio_notify(AioContext *ctx)
 {
     /* Write e.g. bh->scheduled before reading ctx->notify_me.  Pairs
@@ -431,7 +545,13 @@ AioContext *aio_context_new(Error **errp)
 #ifdef CONFIG_LINUX_AIO
     ctx->linux_aio = NULL;
 #endif
+
+#ifdef CONFIG_LINUX_IO_URING
+    ctx->linux_io_uring = NULL;
+#endif
     ctx->thread_pool = NULL;
+    ctx->io_plugged = 0;
+    ctx->io_plug_calls = g_array_new(false, false, sizeof(AioPlugCall));
     qemu_rec_mutex_init(&ctx->lock);
     timerlistgroup_init(&ctx->tlg, aio_timerlist_notify, ctx);
 
@@ -131,6 +131,7 @@ int main(int argc, char **argv)
 #include "qapi/qmp/qerror.h"
 #include "sysemu/iothread.h"
 #include "qemu/guest-random.h"
+#include "qemu/plugin.h"
 
 #define MAX_VIRTIO_CONSOLES 1
 
@@ -310,6 +311,11 @@ static QemuOptsList qemu_accel_opts = {
             .type = QEMU_OPT_STRING,
             .help = "Enable/disable multi-threaded TCG",
         },
+        {
+            .name = "trace-threshold",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Executions after which a TB is retranslated as a trace",
+        },
         { /* end of list */ }
     },
 };
@@ -2981,6 +2987,7 @@ int main(int argc, char **argv, char **envp)
     qemu_init_exec_dir(argv[0]);
 
     module_call_init(MODULE_INIT_QOM);
+    module_call_init(MODULE_INIT_MIGRATION);
 
     qemu_add_opts(&qemu_drive_opts);
     qemu_add_drive_opts(&qemu_legacy_drive_opts);
@@ -2996,6 +3003,9 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_global_opts);
     qemu_add_opts(&qemu_mon_opts);
     qemu_add_opts(&qemu_trace_opts);
+#ifdef CONFIG_PLUGIN
+    qemu_add_opts(&qemu_plugin_opts);
+#endif
     qemu_add_opts(&qemu_option_rom_opts);
     qemu_add_opts(&qemu_machine_opts);
     qemu_add_opts(&qemu_accel_opts);
@@ -3730,6 +3740,13 @@ int main(int argc, char **argv, char **envp)
                     exit(1);
                 }
                 break;
+            case QEMU_OPTION_tb_cache:
+#ifndef CONFIG_TCG
+                error_report("TCG is disabled");
+                exit(1);
+#endif
+                tcg_tb_cache = optarg;
+                break;
             case QEMU_OPTION_icount:
                 icount_opts = qemu_opts_parse_noisily(qemu_find_opts("icount"),
                                                       optarg, true);
@@ -3774,6 +3791,14 @@ int main(int argc, char **argv, char **envp)
                 g_free(trace_file);
                 trace_file = trace_opt_parse(optarg);
                 break;
+#ifdef CONFIG_PLUGIN
+            case QEMU_OPTION_plugin:
+                if (!qemu_opts_parse_noisily(qemu_find_opts("plugin"),
+                                             optarg, true)) {
+                    exit(1);
+                }
+                break;
+#endif
             case QEMU_OPTION_readconfig:
                 {
                     int ret = qemu_read_config_file(optarg);
@@ -4235,6 +4260,14 @@ int main(int argc, char **argv, char **envp)
     current_machine->maxram_size = maxram_size;
     current_machine->ram_slots = ram_slots;
 
+#ifdef CONFIG_PLUGIN
+    /* Saved translations would lack, or keep, the plugins' instrumentation */
+    if (tcg_tb_cache && !QTAILQ_EMPTY(&qemu_find_opts("plugin")->head)) {
+        error_report("-tb-cache cannot be used together with -plugin");
+        exit(1);
+    }
+#endif
+
     /*
      * Note: uses machine properties such as kernel-irqchip, must run
      * after machine_set_property().
@@ -4337,6 +4370,7 @@ int main(int argc, char **argv, char **envp)
 
     if (tcg_enabled()) {
         qemu_tcg_configure(accel_opts, &error_fatal);
+        qemu_plugin_load_list(max_cpus, &error_fatal);
     }
 
     if (default_net) {